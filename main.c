@@ -4,11 +4,37 @@
     Brandon Luk
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#define GLFW_INCLUDE_GLEXT
 #include <GLFW/glfw3.h>
 
 #include <math.h>
+#include <omp.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 #define MONITOR_SIZE_X 1920
 #define MONITOR_SIZE_Y 1080
@@ -19,6 +45,9 @@ static const double monitor_widescreen_compensation = (double) MONITOR_SIZE_X /
 #define CIRCLE_RADIUS 0.05  // Radius for a circle around the mouse cursor whose circumference is used as a reference to which points from the cursor are extended
 
 double RAY_DENSITY = 180.0; // Number of rays to cast
+int REFLECTION_DEPTH = 4;   // Number of times a ray can be reflected by mirrors
+
+#define MAX_RAY_HITS 16     // Most walls a ray is followed through. Light is assumed to be used up past that.
 
 typedef struct{
     double x, y;
@@ -28,17 +57,442 @@ typedef struct{
     Point point1, point2;
 } Line;
 
-static const Line walls[] = {   {{ 0.65,  0.5}, { 0.7,   0.8}},
-                                {{ 0.2,   0.3}, { 0.4,  -0.2}},
-                                {{ 0.4,  -0.2}, { 0.05, -0.3}},
-                                {{ 0.05, -0.3}, {-0.2,  -0.1}},
-                                {{-0.2,  -0.1}, {-0.1,   0.2}},
-                                {{-0.1,   0.2}, { 0.2,   0.3}},
-                                {{-0.5,   0.5}, {-0.3,   0.3}},
-                                {{-0.3,   0.5}, {-0.5,   0.3}},
-                                {{-0.5,  -0.5}, {-0.2,  -0.5}}   };
+/* How a wall treats the rays that hit it */
+typedef enum{
+    MATERIAL_OPAQUE,    // Stops rays
+    MATERIAL_MIRROR,    // Reflects rays
+    MATERIAL_TRANSLUCENT // Lets rays through, attenuated by the wall's opacity
+} Material;
+
+/* A ray starting at origin along dir, and where it hit. t is INFINITY and wall -1 if it hit no wall. */
+typedef struct{
+    Point origin, dir;
+} Ray;
+
+typedef struct{
+    double t;
+    int wall;
+} RayHit;
+
+/*  A circle moving from one point to another, and the first contact it makes with a wall on the way.
+    The radius, like light radii, is measured with the widescreen compensation removed so the circle is round on screen,
+    and the contact normal is a unit vector in that same space. t is 1 and wall -1 if the circle reaches its destination. */
+typedef struct{
+    Point from, to;
+    double radius;
+} SweepQuery;
+
+typedef struct{
+    double t;
+    Point normal;
+    int wall;
+} SweepHit;
+
+/* How the light from the cursor is rendered. The number keys switch between modes. */
+typedef enum{
+    MODE_RAYS,          // Hard-edged rays from a point light
+    MODE_SOFT_SHADOWS,  // An area light with analytic soft shadows
+    MODE_PATH_TRACING,  // Progressive global illumination with light bouncing off the walls
+    MODE_CASCADES,      // Radiance cascades lighting the whole scene from every light at once
+    MODE_PARTICLES,     // A million particles bouncing off the walls
+    MODE_BEAMS,         // Exact beams from a point light, split at wall endpoints
+    MODE_FOG,           // Fog of war revealed by the player and the agents
+    MODE_FIRST_PERSON   // The walls seen through the player's eyes
+} RenderMode;
+
+static RenderMode render_mode = MODE_RAYS;
+
+/* A CPU-side image that is uploaded to a texture and stretched over the window. Pixels are RGB floats, row by row from the bottom-left corner. */
+typedef struct{
+    int width, height;
+    float* pixels;
+    unsigned char* bytes;   // Staging buffer for the upload
+    GLuint texture;
+} Framebuffer;
+
+#define FRAMEBUFFER_WIDTH 480
+#define FRAMEBUFFER_HEIGHT 270
+
+static Framebuffer framebuffer = {0, 0, NULL, NULL, 0};
+
+#define AREA_LIGHT_SIZE 0.03    // Radius of the cursor's disc light in soft shadow mode
+#define AREA_LIGHT_REACH 1.5    // Distance at which the disc light's brightness has fallen off to nothing
+
+/*  The path tracer accumulates one sample per pixel per frame into the framebuffer until the cursor moves or a wall changes.
+    Rays traced per second, including shadow rays, are measured so the engine's throughput can be benchmarked. */
+#define PATH_TILE_SIZE 16
+#define PATH_MAX_BOUNCES 8
+#define PATH_WALL_ALBEDO 0.7
+#define PATH_LIGHT_INTENSITY 1.0
+
+static int path_samples = 0;
+static Point path_light;
+static int path_wall_revision = -1;
+static double path_rays_per_second = 0.0;
+
+/*  Radiance cascades. Level i has probes every RC_PROBE_SPACING * 2^i framebuffer pixels, each tracing 4^(i+1) directions over
+    the interval between RC_INTERVAL * (4^i - 1) / 3 and RC_INTERVAL * (4^(i+1) - 1) / 3 pixels from the probe. Every light,
+    including the cursor, is an emitting disc of RC_EMITTER_RADIUS pixels. */
+#define RC_LEVELS 5
+#define RC_PROBE_SPACING 2
+#define RC_INTERVAL 2.0
+#define RC_EMITTER_RADIUS 3.0
+#define RC_EMITTER_BRIGHTNESS 8.0
+
+typedef struct{
+    Point center;       // In framebuffer pixels
+    float r, g, b;
+} CascadeEmitter;
+
+/*  Particles are stored as separate float arrays (structure of arrays) and sorted by grid cell every tick, so the crossing
+    tests of all particles in a cell against each of the cell's walls run as one vectorizable loop. */
+#define MAX_PARTICLES 1000000
+
+typedef struct{
+    float *x, *y, *vx, *vy;
+} ParticleArrays;
+
+static ParticleArrays particles, particles_sorted;
+static int particle_count = 0;
+
+/* OpenGL buffer functions, which are not in the OpenGL 1.1 headers on every platform and have to be loaded at runtime */
+static PFNGLGENBUFFERSPROC glGenBuffersPtr = NULL;
+static PFNGLBINDBUFFERPROC glBindBufferPtr = NULL;
+static PFNGLBUFFERDATAPROC glBufferDataPtr = NULL;
+static PFNGLBUFFERSUBDATAPROC glBufferSubDataPtr = NULL;
+
+/*  Beam tracing. A beam is the wedge of space seen from its apex through its window, beyond the window. Tracing a beam splits it at
+    the endpoints of the walls it sees into parts that each end on a single wall or on the border, so unlike casting rays nothing
+    between samples is missed. A part that ends on a mirror is reflected as a new beam from the mirror image of the apex through the
+    lit stretch of the mirror, and one that ends on a translucent wall continues through it, dimmed. Coordinates are widescreen
+    compensated. Beams are traced from a work queue shared by every thread. A beam ends on a target: a wall index from 0, or
+    -1 - side for a side of the border. */
+#define MAX_BEAMS 65536
+#define BEAM_NO_WALL (-5)               // The wall of a light's primary beams, apart from every target
+#define BEAM_PRIMARY_COUNT 8            // The full circle around a light is split into this many beams, so each is narrower than PI
+#define BEAM_MIRROR_REFLECTANCE 0.6f    // Matches the rays in drawRays
+#define BEAM_MIN_INTENSITY 0.01f        // Dimmer beams are not followed any further
+
+typedef struct{
+    Point apex;
+    Point window[2];
+    int wall;           // The wall the window lies on, BEAM_NO_WALL for a light's primary beams
+    int reflections, crossings;
+    float intensity;
+} Beam;
+
+/* The part of a beam between its window and the wall it ends on, as a quad in window coordinates */
+typedef struct{
+    Point corners[4];
+    int reflections, crossings;
+    float intensity;
+} BeamFragment;
+
+static Beam* beam_queue = NULL;
+static int beam_queue_count = 0;
+static int beam_queue_capacity = 0;
+static int beam_queue_dropped = 0;     // Beams left out of the last trace because the queue was full
+static pthread_mutex_t beam_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t beam_queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t beam_fragments_lock = PTHREAD_MUTEX_INITIALIZER;
+static BeamFragment* beam_fragments = NULL;
+static int beam_fragment_count = 0;
+static int beam_fragment_capacity = 0;
+static double beam_coverage = 0.0;  // Fraction of the scene lit directly by the cursor's beams
+
+/*  Fog of war over a FOG_SIZE by FOG_SIZE grid of tiles covering the window. The player and the first agents are units that
+    reveal the tiles they see within their sight radius, which is FOG_SIGHT_RADIUS tiles across and stretched vertically so it is
+    round on screen. Each unit keeps its visibility as a bitset of the tiles around it, and every tile counts the units that see
+    it, so a unit that moves to another tile only has to remove its old visibility and add its new one. Tiles that are or have ever
+    been seen are kept in bit-packed bitmaps, which are unpacked into a texture only in the rows that changed. */
+#define FOG_SIZE 1024
+#define FOG_MAX_UNITS 1024
+#define FOG_SIGHT_RADIUS 32
+#define FOG_BAND 16         // Rows of tiles per band when the tile counts are updated in parallel
+#define FOG_SIGHT_RADIUS_Y ((int) (FOG_SIGHT_RADIUS * MONITOR_SIZE_X / MONITOR_SIZE_Y))
+#define FOG_WINDOW_WIDTH (2 * FOG_SIGHT_RADIUS + 1)
+#define FOG_WINDOW_HEIGHT (2 * FOG_SIGHT_RADIUS_Y + 1)
+#define FOG_WINDOW_ROW_WORDS ((FOG_WINDOW_WIDTH + 63) / 64)
+#define FOG_WINDOW_WORDS (FOG_WINDOW_ROW_WORDS * FOG_WINDOW_HEIGHT)
+
+typedef struct{
+    int x, y;           // The tile the unit's visibility was computed from
+    int next_x, next_y; // The tile the unit is on now
+    int valid;          // Whether the visibility has been added to the tile counts
+    int moved;          // Whether the visibility has to be recomputed this frame
+    uint64_t* visible;  // FOG_WINDOW_WIDTH by FOG_WINDOW_HEIGHT bits centered on the unit's tile, each row starting a new word
+    uint64_t* next;     // Where the new visibility is computed before it replaces the old one
+} FogUnit;
+
+static FogUnit* fog_units = NULL;
+static uint64_t* fog_blocked = NULL;    // Tiles a wall passes through
+static uint64_t* fog_visible = NULL;    // Tiles seen by at least one unit
+static uint64_t* fog_explored = NULL;   // Tiles that have ever been seen
+static unsigned short* fog_counts = NULL;
+static unsigned char* fog_texels = NULL;
+static GLuint fog_texture = 0;
+static int fog_wall_revision = -1;
+static unsigned char fog_dirty_rows[FOG_SIZE];  // Rows of the texture that are out of date
+static int fog_recomputed = 0;          // Units whose visibility was recomputed in the last update
+static int fog_sight_extent[FOG_SIGHT_RADIUS_Y + 1];   // How far sight reaches sideways, by distance up or down in tiles
+
+/*  The first person view casts one ray per column of the framebuffer, up to FIRST_PERSON_COLUMN_BUDGET rays per frame, and draws
+    the wall each ray hits as a vertical span whose height is inversely proportional to the wall's distance along the view
+    direction. When the framebuffer is wider than the budget, every ray shades several neighbouring columns. */
+#define FIRST_PERSON_WIDTH 1280
+#define FIRST_PERSON_HEIGHT 720
+#define FIRST_PERSON_COLUMN_BUDGET 640
+#define FIRST_PERSON_FOV (PI / 3.0)     // Horizontal field of view
+#define FIRST_PERSON_WALL_HEIGHT 0.08   // Walls this far away fill the view from top to bottom
+
+/*  Wall textures for the first person view live in one atlas of RGB floats. Each texture is stored column by column, so a wall
+    span reads one contiguous run of texels, and is followed by its mip levels down to a single texel. */
+#define WALL_TEXTURE_SIZE 64
+#define WALL_TEXTURE_LEVELS 7
+#define WALL_TEXTURE_TEXELS 5461        // Texels in all levels of one texture: 64 * 64 + 32 * 32 + ... + 1 * 1
+#define WALL_TEXTURE_COUNT 4
+
+enum{
+    WALL_TEXTURE_BRICK,
+    WALL_TEXTURE_STONE,
+    WALL_TEXTURE_METAL,
+    WALL_TEXTURE_GLASS
+};
+
+static float wall_atlas[WALL_TEXTURE_COUNT * WALL_TEXTURE_TEXELS * 3];
+
+static const Line default_walls[] = {   {{ 0.65,  0.5}, { 0.7,   0.8}},
+                                        {{ 0.2,   0.3}, { 0.4,  -0.2}},
+                                        {{ 0.4,  -0.2}, { 0.05, -0.3}},
+                                        {{ 0.05, -0.3}, {-0.2,  -0.1}},
+                                        {{-0.2,  -0.1}, {-0.1,   0.2}},
+                                        {{-0.1,   0.2}, { 0.2,   0.3}},
+                                        {{-0.5,   0.5}, {-0.3,   0.3}},
+                                        {{-0.3,   0.5}, {-0.5,   0.3}},
+                                        {{-0.5,  -0.5}, {-0.2,  -0.5}}   };
+
+static const Material default_materials[] = {MATERIAL_MIRROR, MATERIAL_OPAQUE, MATERIAL_OPAQUE, MATERIAL_OPAQUE, MATERIAL_OPAQUE,
+                                             MATERIAL_OPAQUE, MATERIAL_OPAQUE, MATERIAL_OPAQUE, MATERIAL_MIRROR};
+
+/* The walls currently in the scene. Every wall is also registered in wall_grid so rays only test the walls near them. */
+static Line* walls = NULL;
+static Material* wall_materials = NULL;
+static float* wall_opacity = NULL;  // Fraction of light a translucent wall stops. 1 for every other wall.
+static unsigned char* wall_textures = NULL; // The first person texture of each wall while it is opaque, kept as it moves
+static int wall_count = 0;
+static int wall_capacity = 0;
+static int wall_revision = 0;   // Incremented whenever a wall changes
+
+#define BORDER 1.1  // The scene is enclosed by a square border at +/- this coordinate
+
+/*  A uniform grid over the bordered scene. Each cell lists the indices of the walls whose bounding box overlaps it.
+    This is the one acceleration structure shared by every ray that is cast, whichever light it belongs to. */
+#define GRID_SIZE 32
+#define GRID_CELL_SIZE (2.0 * BORDER / GRID_SIZE)
+
+typedef struct{
+    int* items;
+    int count, capacity;
+} GridCell;
+
+static GridCell wall_grid[GRID_SIZE][GRID_SIZE];
+
+/* The same grid over the lights' emitting discs in radiance cascades mode, rebuilt every frame */
+static GridCell emitter_grid[GRID_SIZE][GRID_SIZE];
+
+/*  A point light. Its visibility polygon is cached along with the polygon's bounding box, and only recomputed when the light moves,
+    the ray count changes, or a wall overlapping that bounding box changes. */
+typedef struct{
+    Point position;
+    Point velocity;     // Zero for fixed lights
+    float r, g, b;
+    double radius;
+
+    Point* polygon;     // Hit points of the light's rays, in order of angle
+    int polygon_count;
+    Point polygon_origin;
+    Point bounds_min, bounds_max;   // Bounding box of the polygon. No wall outside of it can change what the light sees.
+    int valid;
+} Light;
+
+#define MAX_LIGHTS 1024
+
+/* A body moved by the swept circle queries: the player, steered with WASD, and wandering agents */
+#define PLAYER_RADIUS 0.02
+#define PLAYER_SPEED 0.5
+#define PLAYER_TURN_SPEED 2.5   // In radians per second
+#define AGENT_RADIUS 0.006
+#define MAX_AGENTS 100000
+
+static Point player_position = {0.0, -0.8};
+static double player_heading = PI / 2.0;    // Direction the player faces in first person, with the widescreen compensation removed
+static int player_active = 0;   // The player is only shown once it has been moved
+
+static Point* agent_positions = NULL;
+static Point* agent_velocities = NULL;
+static int agent_count = 0;
+
+static Light lights[MAX_LIGHTS];
+static int light_count = 0;
+
+/*  Static lights are never cast at runtime. Their light is baked offline into the lightmap, which covers the window and is
+    stored as 8-bit RGB texels, row by row starting from the bottom-left corner. */
+static Light static_lights[MAX_LIGHTS];
+static int static_light_count = 0;
+
+#define LIGHTMAP_WIDTH 512
+#define LIGHTMAP_HEIGHT 256
+#define LIGHTMAP_MAX_SCALE 8    // Scene files may hold lightmaps up to this many times the baked size each way
+
+typedef struct{
+    int width, height;
+    unsigned char* texels;
+    GLuint texture;     // 0 until the texels are uploaded
+} Lightmap;
+
+static Lightmap lightmap = {0, 0, NULL, 0};
 
+/* Number of light polygons reused from the cache and recomputed, in the last frame and since startup */
+static int frame_cache_hits = 0, frame_cache_misses = 0;
+static long long total_cache_hits = 0, total_cache_misses = 0;
 
+/*  Input can be recorded to a trace file and replayed from it, so that benchmark runs see exactly the same workload. The main
+    loop reads the cursor, the held keys and the time from the current input frame rather than from GLFW, and the key, scroll and
+    click events that arrive during a frame are stored with it. Frame times and cursor positions are rounded to floats even while
+    recording, so the recorded run computes exactly what its replays do.
+
+    A trace starts with INPUT_TRACE_MAGIC and INPUT_TRACE_VERSION, followed by one record per frame, in the byte order of the
+    machine that recorded it:
+        float dt, float cursor x, float cursor y, uint8 held keys, uint8 event count, and per event:
+        uint8 type, uint8 mods, int16 key, float x, float y */
+#define INPUT_TRACE_MAGIC "RCIN"
+#define INPUT_TRACE_VERSION 1
+#define INPUT_MAX_EVENTS 255
+
+typedef enum{
+    INPUT_LIVE,
+    INPUT_RECORD,
+    INPUT_REPLAY
+} InputMode;
+
+typedef enum{
+    INPUT_EVENT_KEY,
+    INPUT_EVENT_SCROLL,
+    INPUT_EVENT_CLICK,
+    INPUT_EVENT_RELEASE     // Of the left mouse button, at the cursor
+} InputEventType;
+
+typedef struct{
+    unsigned char type;
+    unsigned char mods;
+    short key;
+    float x, y;     // The cursor for clicks, the offset in y for scrolling
+} InputEvent;
+
+typedef struct{
+    double time;
+    float dt;
+    double cursor_x, cursor_y;      // In GLFW window coordinates
+    unsigned char held;             // One bit for each of input_held_keys
+    int event_count;
+    InputEvent events[INPUT_MAX_EVENTS];
+} InputFrame;
+
+static const int input_held_keys[] = {GLFW_KEY_W, GLFW_KEY_A, GLFW_KEY_S, GLFW_KEY_D};
+
+static InputMode input_mode = INPUT_LIVE;
+static FILE* input_trace = NULL;
+static InputFrame input_frame;
+static int input_headless = 0;      // Replay in a hidden window as fast as possible
+static double input_clock = 0.0;    // GLFW time when the current frame started
+static double input_replay_start = 0.0;
+static long long input_frames = 0;
+
+/*  The wall editor, toggled with E. Dragging from empty space draws a new wall, dragging an endpoint moves it, and Delete or
+    Backspace removes the wall under the cursor. Walls are picked through wall_grid and every edit updates the grid in place,
+    so editing stays interactive however many walls there are. */
+#define EDITOR_PICK_RADIUS 10.0     // In pixels
+
+static int editor_active = 0;
+static int editor_hover_wall = -1;      // The wall under the cursor, or -1
+static int editor_hover_endpoint = -1;  // 0 or 1 when the cursor is on that endpoint of the wall, -1 otherwise
+static int editor_drag_wall = -1;       // The wall whose endpoint is being dragged, or -1
+static int editor_drag_endpoint = 0;
+static int editor_drawing = 0;          // The button is down over empty space. The wall is added once the cursor moves away.
+static Point editor_draw_start;
+
+/*  Frame capture writes every capture_interval-th frame to a numbered PPM file. The window is read into a ring of pixel buffer
+    objects, so glReadPixels returns at once and each buffer is only mapped CAPTURE_PBO_COUNT - 1 frames later, when the GPU has long
+    finished with it. The pixels are then copied into a slot of a bounded queue, and CAPTURE_THREADS writer threads encode and write
+    them, so the render loop only waits for the disk when every slot is full. Without pixel buffer objects the window is read
+    synchronously, but the files are still written in the background. */
+#define CAPTURE_PBO_COUNT 3
+#define CAPTURE_QUEUE_SIZE 8
+#define CAPTURE_THREADS 2
+
+typedef enum{
+    CAPTURE_SLOT_FREE,
+    CAPTURE_SLOT_PENDING,   // Waiting for a writer
+    CAPTURE_SLOT_WRITING
+} CaptureSlotState;
+
+typedef struct{
+    unsigned char* pixels;  // RGB, bottom row first
+    int width, height;
+    long long index;        // Number of the image in the sequence
+    CaptureSlotState state;
+} CaptureSlot;
+
+static const char* capture_prefix = NULL;  // NULL when not capturing
+static int capture_interval = 1;
+static long long capture_frame = 0;         // Frames rendered since capture started
+static long long capture_reads = 0;         // Frames read back from the window
+static long long capture_waits = 0;         // Times the render loop had to wait for a free slot
+static int capture_failed = 0;
+
+static GLuint capture_pbos[CAPTURE_PBO_COUNT];
+static int capture_pbo_width[CAPTURE_PBO_COUNT], capture_pbo_height[CAPTURE_PBO_COUNT];
+static int capture_pbos_available = 0;
+static PFNGLMAPBUFFERPROC glMapBufferPtr = NULL;
+static PFNGLUNMAPBUFFERPROC glUnmapBufferPtr = NULL;
+
+static CaptureSlot capture_slots[CAPTURE_QUEUE_SIZE];
+static int capture_fill = 0, capture_take = 0;  // Next slot to fill and to write. Pending slots always follow capture_take.
+static int capture_stopping = 0;
+static pthread_t capture_threads[CAPTURE_THREADS];
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_pending = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t capture_freed = PTHREAD_COND_INITIALIZER;
+
+/*  Visibility streaming writes the cursor's visibility polygon, the nearest hit of each of drawRays' primary rays, to a file or
+    pipe every frame. Coordinates are quantized to multiples of 1 / STREAM_SCALE and every frame is encoded against the one before
+    it: runs of points that did not move are skipped and the others are stored as differences, all as variable-length integers,
+    so a still cursor costs a few bytes per frame. A frame is encoded on its own as a key frame when the number of points changes
+    and every STREAM_KEYFRAME_INTERVAL frames, so a reader that lost its place can recover.
+
+    The stream starts with STREAM_MAGIC followed by the version and STREAM_SCALE as varints. Varints hold 7 bits per byte, low bits
+    first, with the top bit set on every byte but the last, and signed values are zigzag encoded (0, -1, 1, -2, ... as 0, 1, 2, ...).
+    Each frame is then:
+        uint8 flags (bit 0 set for a key frame), varint point count, signed varints for the change in the origin's x and y
+        key frame:  signed varints for the change in x and y from the previous point, the first point following the origin
+        otherwise:  pairs of a varint count of unchanged points and, unless they reach the end, a varint count of changed points
+                    followed by signed varints for the change in x and y of each since the last frame */
+#define STREAM_MAGIC "RCVS"
+#define STREAM_VERSION 1
+#define STREAM_SCALE 4096
+#define STREAM_KEYFRAME_INTERVAL 120
+
+static FILE* stream_file = NULL;
+static Point stream_origin;
+static Point* stream_points = NULL;         // This frame's polygon
+static int stream_point_count = 0;
+static int stream_point_capacity = 0;
+static long long stream_points_frame = -1;  // Input frame the polygon was cast in, if drawRays has already cast it
+static int* stream_previous = NULL;         // The last frame's quantized polygon, x and y interleaved
+static int stream_previous_count = -1;
+static int stream_previous_origin[2];
+static unsigned char* stream_bytes = NULL;  // The frame being encoded
+static long long stream_frames = 0, stream_bytes_written = 0, stream_raw_bytes = 0;
 
 /*  Convert points from the GLFW coordinate system (where the origin is the top-left)
     to the OpenGL coordinate system (where the origin is in the center of the window). */
@@ -65,6 +519,23 @@ Point normalizeMonitorCoordinates(double xpos, double ypos)
     return norm;
 }
 
+/* The cursor position in the current input frame, in GLFW coordinates */
+void inputCursorPos(double* xpos, double* ypos)
+{
+    *xpos = input_frame.cursor_x;
+    *ypos = input_frame.cursor_y;
+}
+
+/* Whether a key was held down at the start of the current input frame. Only the keys in input_held_keys are tracked. */
+int inputKeyDown(int key)
+{
+    for(int i = 0; i < (int) (sizeof(input_held_keys) / sizeof(input_held_keys[0])); ++i)
+        if(input_held_keys[i] == key)
+            return (input_frame.held >> i) & 1;
+
+    return 0;
+}
+
 /* Return the distance between two points */
 double pointDistance(Point p1, Point p2)
 {
@@ -107,203 +578,7437 @@ int findLineSegmentIntersection(Line l1, Line l2, Point* intersection)
     return 0;
 }
 
-/*  Return a line that is an extension of the provided argument. The first point of the expanded line will be the same as the argument line.
-    The second point will be arbitrarily large along the slope of the provided argument. */
-Line expandLine(Line original)
+/* Return the grid coordinate of the cell containing the given coordinate, clamped to the grid */
+int gridCoordinate(double coord)
 {
-    static const double ARBITRARY_OUT_OF_BOUNDS_COORD = INT16_MAX; // Some arbitarily large value that will surely be outside the bounds of the screen
+    int c = (int) floor((coord + BORDER) / GRID_CELL_SIZE);
 
-    Line expanded;
-    expanded.point1 = original.point1;
+    if(c < 0)
+        return 0;
+    else if(c >= GRID_SIZE)
+        return GRID_SIZE - 1;
 
-    /* Find the equation of the line */
+    return c;
+}
 
-    /* If the x's of the two points are the same the line is vertical */
-    if(fabs(original.point2.x - original.point1.x) < 10e-7)
+/* Append an index to a grid cell */
+void gridCellAppend(GridCell* cell, int item)
+{
+    if(cell->count == cell->capacity)
     {
-        if(original.point2.y < original.point1.y)
-        {
-            expanded.point2 = (Point){original.point1.x, (-1) * ARBITRARY_OUT_OF_BOUNDS_COORD};
-        }
-        else
+        cell->capacity = cell->capacity ? cell->capacity * 2 : 4;
+        cell->items = realloc(cell->items, cell->capacity * sizeof(int));
+        if(!cell->items)
         {
-            expanded.point2 = (Point){original.point1.x, ARBITRARY_OUT_OF_BOUNDS_COORD};
+            fprintf(stderr, "Out of memory growing a grid cell\n");
+            exit(-1);
         }
-        
-        return expanded;
     }
-    /* If the y's of the two points are the same the line is horizontal */
-    else if(fabs(original.point2.y - original.point1.y) < 10e-7)
+
+    cell->items[cell->count++] = item;
+}
+
+/* Register the wall at the given index in every grid cell overlapped by its bounding box */
+void gridInsertWall(int index)
+{
+    const Line* w = &walls[index];
+
+    int x0 = gridCoordinate(fmin(w->point1.x, w->point2.x));
+    int x1 = gridCoordinate(fmax(w->point1.x, w->point2.x));
+    int y0 = gridCoordinate(fmin(w->point1.y, w->point2.y));
+    int y1 = gridCoordinate(fmax(w->point1.y, w->point2.y));
+
+    for(int x = x0; x <= x1; ++x)
+        for(int y = y0; y <= y1; ++y)
+            gridCellAppend(&wall_grid[x][y], index);
+}
+
+/*  Invalidate the cached polygon of every light whose bounding region overlaps the bounding box of the changed wall.
+    Every other light keeps its polygon, since the wall lies entirely outside of what it can see. */
+void markWallChanged(Line w)
+{
+    double min_x = fmin(w.point1.x, w.point2.x);
+    double max_x = fmax(w.point1.x, w.point2.x);
+    double min_y = fmin(w.point1.y, w.point2.y);
+    double max_y = fmax(w.point1.y, w.point2.y);
+
+    ++wall_revision;
+
+    for(int i = 0; i < light_count; ++i)
     {
-        if(original.point2.x < original.point1.x)
-        {
-            expanded.point2 = (Point){(-1.0) * ARBITRARY_OUT_OF_BOUNDS_COORD, original.point1.y};
-        }
-        else
+        const Light* l = &lights[i];
+
+        if( l->bounds_max.x >= min_x && l->bounds_min.x <= max_x &&
+            l->bounds_max.y >= min_y && l->bounds_min.y <= max_y)
+            lights[i].valid = 0;
+    }
+}
+
+/* Add a wall to the scene and the grid. The opacity only matters for translucent walls. */
+void addWall(Line w, Material material, float opacity)
+{
+    if(wall_count == wall_capacity)
+    {
+        wall_capacity = wall_capacity ? wall_capacity * 2 : 16;
+        walls = realloc(walls, wall_capacity * sizeof(Line));
+        wall_materials = realloc(wall_materials, wall_capacity * sizeof(Material));
+        wall_opacity = realloc(wall_opacity, wall_capacity * sizeof(float));
+        wall_textures = realloc(wall_textures, wall_capacity);
+        if(!walls || !wall_materials || !wall_opacity || !wall_textures)
         {
-            expanded.point2 = (Point){ARBITRARY_OUT_OF_BOUNDS_COORD, original.point1.y};
+            fprintf(stderr, "Out of memory growing the wall list\n");
+            exit(-1);
         }
-        
-        return expanded;
     }
 
-    double slope = (original.point2.y - original.point1.y) / (original.point2.x - original.point1.x);
-    double y_intercept = original.point1.y - (slope * original.point1.x);
+    walls[wall_count] = w;
+    wall_materials[wall_count] = material;
+    wall_opacity[wall_count] = material == MATERIAL_TRANSLUCENT ? opacity : 1.0f;
+    wall_textures[wall_count] = wall_count % 2 ? WALL_TEXTURE_STONE : WALL_TEXTURE_BRICK;
+    gridInsertWall(wall_count);
+    ++wall_count;
+
+    markWallChanged(w);
+}
+
+/* Remove the wall at the given index from every grid cell overlapped by its bounding box */
+void gridRemoveWall(int index)
+{
+    const Line* w = &walls[index];
 
-    expanded.point2.x = ARBITRARY_OUT_OF_BOUNDS_COORD;
-    expanded.point2.y = (slope * expanded.point2.x) + y_intercept; 
+    int x0 = gridCoordinate(fmin(w->point1.x, w->point2.x));
+    int x1 = gridCoordinate(fmax(w->point1.x, w->point2.x));
+    int y0 = gridCoordinate(fmin(w->point1.y, w->point2.y));
+    int y1 = gridCoordinate(fmax(w->point1.y, w->point2.y));
 
-    if(original.point2.x < original.point1.x)
-        expanded.point2.x *= -1;
-    if(original.point2.y < original.point1.y)
-        expanded.point2.y *= 1;
+    for(int x = x0; x <= x1; ++x)
+        for(int y = y0; y <= y1; ++y)
+        {
+            GridCell* cell = &wall_grid[x][y];
 
-    return expanded;
+            for(int i = 0; i < cell->count; ++i)
+                if(cell->items[i] == index)
+                {
+                    cell->items[i] = cell->items[--cell->count];
+                    break;
+                }
+        }
 }
 
-void evaluateIntersection(Line* start, Line* expanded, const Line* toIntersect, Point* intersection, Point* temp, double* dist_to_intersection)
+/* Change the index the wall at the given index is registered under, in every grid cell overlapped by its bounding box */
+void gridRenameWall(int index, int new_index)
 {
-    if(findLineSegmentIntersection(*expanded, *toIntersect, temp))
-        if(pointDistance(start->point1, *temp) < *dist_to_intersection)
+    const Line* w = &walls[index];
+
+    int x0 = gridCoordinate(fmin(w->point1.x, w->point2.x));
+    int x1 = gridCoordinate(fmax(w->point1.x, w->point2.x));
+    int y0 = gridCoordinate(fmin(w->point1.y, w->point2.y));
+    int y1 = gridCoordinate(fmax(w->point1.y, w->point2.y));
+
+    for(int x = x0; x <= x1; ++x)
+        for(int y = y0; y <= y1; ++y)
         {
-            *dist_to_intersection = pointDistance(start->point1, *temp);
-            *intersection = *temp;
-        } 
+            GridCell* cell = &wall_grid[x][y];
+
+            for(int i = 0; i < cell->count; ++i)
+                if(cell->items[i] == index)
+                {
+                    cell->items[i] = new_index;
+                    break;
+                }
+        }
 }
 
-/* Return the nearest point of intersection between the provided line and any other objects (either a wall or border) */
-Point findNearestIntersectionPoint(Line start)
+/* Remove a wall from the scene and the grid. The last wall takes its place, so no other wall changes its index. */
+void removeWall(int index)
 {
-    static const Line borders[] = { {{-1.1,  1.1 }, { 1.1,  1.1}},  // North border
-                                    {{ 1.1,  1.1 }, { 1.1, -1.1}},  // East border
-                                    {{-1.1, -1.1 }, { 1.1, -1.1}},  // South border
-                                    {{-1.1,  1.1 }, {-1.1, -1.1}}}; // West border
+    int last = wall_count - 1;
 
-    Point intersection;
-    Point temp;
-    double dist_to_intersection = (double) INT64_MAX; // An arbitrarily large value to begin with
-    Line expanded = expandLine(start);
+    markWallChanged(walls[index]);
+    gridRemoveWall(index);
 
-    /* Check if the line intersects any walls */
-    for(int i = 0; i < (sizeof(walls) / sizeof(walls[0])); ++i)
+    if(index != last)
     {
-        evaluateIntersection(&start, &expanded, &walls[i], &intersection, &temp, &dist_to_intersection);
+        gridRenameWall(last, index);
+        walls[index] = walls[last];
+        wall_materials[index] = wall_materials[last];
+        wall_opacity[index] = wall_opacity[last];
+        wall_textures[index] = wall_textures[last];
     }
 
-    /* Check if the line intersects any borders */
-    for(int i = 0; i < (sizeof(borders) / sizeof(borders[0])); ++i)
+    --wall_count;
+}
+
+/* Move a wall and change its material. Only the grid cells under its old and new position are touched. */
+void replaceWall(int index, Line w, Material material, float opacity)
+{
+    markWallChanged(walls[index]);
+    gridRemoveWall(index);
+
+    walls[index] = w;
+    wall_materials[index] = material;
+    wall_opacity[index] = material == MATERIAL_TRANSLUCENT ? opacity : 1.0f;
+    gridInsertWall(index);
+
+    markWallChanged(w);
+}
+
+/* The distance between two points in pixels on the monitor, which stretches the x axis more than the y axis */
+double pixelDistance(Point a, Point b)
+{
+    return hypot((a.x - b.x) * (MONITOR_SIZE_X / 2.0), (a.y - b.y) * (MONITOR_SIZE_Y / 2.0));
+}
+
+/*  Find the wall nearest to a point within EDITOR_PICK_RADIUS pixels, skipping the wall exclude. Only the grid cells within
+    that radius are searched. An endpoint within the radius wins over a nearer wall, so endpoints can be grabbed where walls
+    meet. Returns the wall's index, or -1, and sets *endpoint to 0 or 1 for an endpoint and -1 for the rest of the wall. */
+int pickWall(Point p, int exclude, int* endpoint)
+{
+    double radius_x = EDITOR_PICK_RADIUS / (MONITOR_SIZE_X / 2.0);
+    double radius_y = EDITOR_PICK_RADIUS / (MONITOR_SIZE_Y / 2.0);
+
+    int x0 = gridCoordinate(p.x - radius_x);
+    int x1 = gridCoordinate(p.x + radius_x);
+    int y0 = gridCoordinate(p.y - radius_y);
+    int y1 = gridCoordinate(p.y + radius_y);
+
+    int nearest = -1, nearest_end_wall = -1, nearest_end = -1;
+    double distance = EDITOR_PICK_RADIUS, end_distance = EDITOR_PICK_RADIUS;
+
+    for(int x = x0; x <= x1; ++x)
+        for(int y = y0; y <= y1; ++y)
+        {
+            const GridCell* cell = &wall_grid[x][y];
+
+            for(int k = 0; k < cell->count; ++k)
+            {
+                int i = cell->items[k];
+                if(i == exclude)
+                    continue;
+
+                const Line* w = &walls[i];
+                double d1 = pixelDistance(w->point1, p);
+                double d2 = pixelDistance(w->point2, p);
+
+                if(d1 < end_distance || d2 < end_distance)
+                {
+                    nearest_end_wall = i;
+                    nearest_end = d2 < d1;
+                    end_distance = fmin(d1, d2);
+                }
+
+                /* The nearest point on the wall, in pixels relative to p so the radius is the same in every direction */
+                double ax = (w->point1.x - p.x) * (MONITOR_SIZE_X / 2.0), ay = (w->point1.y - p.y) * (MONITOR_SIZE_Y / 2.0);
+                double ex = (w->point2.x - w->point1.x) * (MONITOR_SIZE_X / 2.0), ey = (w->point2.y - w->point1.y) * (MONITOR_SIZE_Y / 2.0);
+                double length_squared = ex * ex + ey * ey;
+                double t = length_squared > 0.0 ? fmax(0.0, fmin(1.0, -(ax * ex + ay * ey) / length_squared)) : 0.0;
+                double d = hypot(ax + t * ex, ay + t * ey);
+
+                if(d < distance)
+                {
+                    nearest = i;
+                    distance = d;
+                }
+            }
+        }
+
+    if(nearest_end_wall >= 0)
     {
-        evaluateIntersection(&start, &expanded, &borders[i], &intersection, &temp, &dist_to_intersection);
+        *endpoint = nearest_end;
+        return nearest_end_wall;
     }
 
-    return intersection;
+    *endpoint = -1;
+    return nearest;
 }
 
-void drawWall(const Line* w)
+/*  Return the parameter t at which the ray origin + t * dir crosses the wall, or INFINITY if it does not.
+    dir does not need to be normalized. */
+double intersectRayWall(Point origin, Point dir, const Line* w)
 {
-    glColor3f(1.0f, 1.0f, 1.0f);
-    glLineWidth(5.0f);
-    glEnable(GL_LINE_SMOOTH);
+    double ex = w->point2.x - w->point1.x;
+    double ey = w->point2.y - w->point1.y;
+    double denominator = dir.x * ey - dir.y * ex;
 
-    glBegin(GL_LINES);
-    glVertex2f(w->point1.x, w->point1.y);
-    glVertex2f(w->point2.x, w->point2.y);
+    /* Parallel lines never cross */
+    if(fabs(denominator) < 10e-12)
+        return INFINITY;
 
+    double ox = w->point1.x - origin.x;
+    double oy = w->point1.y - origin.y;
+    double t = (ox * ey - oy * ex) / denominator;
+    double u = (ox * dir.y - oy * dir.x) / denominator;
 
-    glEnd();
+    if(t >= 0.0 && 0.0 <= u && u <= 1.0)
+        return t;
+
+    return INFINITY;
 }
 
-void drawRays(GLFWwindow** window)
+/*  The state of a walk along a ray through the grid cells it crosses, in order (Amanatides & Woo).
+    t_exit is the ray parameter at which the ray leaves the current cell. */
+typedef struct{
+    int x, y;
+    int step_x, step_y;
+    double t_max_x, t_max_y;
+    double t_delta_x, t_delta_y;
+    double t_exit;
+} GridWalk;
+
+/* Start a walk at the cell containing the ray's origin */
+GridWalk beginGridWalk(Point origin, Point dir)
 {
-    /* Get the current position of the cursos to be used as the origin for the light */
-    double xorigin, yorigin;
-    glfwGetCursorPos(*window, &xorigin, &yorigin);
-    
-    Point normalizedOrigin = normalizeMonitorCoordinates(xorigin, yorigin);
-    
-    double inc = 2.0 * PI / RAY_DENSITY;
+    GridWalk walk;
 
-    Point onCircumference, endPoint;
-    double xpos, ypos;
+    walk.x = gridCoordinate(origin.x);
+    walk.y = gridCoordinate(origin.y);
+    walk.step_x = dir.x > 0.0 ? 1 : -1;
+    walk.step_y = dir.y > 0.0 ? 1 : -1;
 
-    glLineWidth(1.0f);
+    double next_x = -BORDER + (walk.x + (walk.step_x > 0 ? 1 : 0)) * GRID_CELL_SIZE;
+    double next_y = -BORDER + (walk.y + (walk.step_y > 0 ? 1 : 0)) * GRID_CELL_SIZE;
 
-    glBegin(GL_LINES);
-    for(int i = 0; i < (int) RAY_DENSITY; ++i)
+    walk.t_max_x = dir.x != 0.0 ? (next_x - origin.x) / dir.x : INFINITY;
+    walk.t_max_y = dir.y != 0.0 ? (next_y - origin.y) / dir.y : INFINITY;
+    walk.t_delta_x = dir.x != 0.0 ? GRID_CELL_SIZE / fabs(dir.x) : INFINITY;
+    walk.t_delta_y = dir.y != 0.0 ? GRID_CELL_SIZE / fabs(dir.y) : INFINITY;
+    walk.t_exit = fmin(walk.t_max_x, walk.t_max_y);
+
+    return walk;
+}
+
+/* Step to the next cell along the ray. Returns 0 once the ray has left the grid. */
+int stepGridWalk(GridWalk* walk)
+{
+    if(walk->t_max_x < walk->t_max_y)
     {
-        xpos = normalizedOrigin.x + CIRCLE_RADIUS * cos(i * inc);
-        ypos = normalizedOrigin.y + (CIRCLE_RADIUS * monitor_widescreen_compensation) * sin(i * inc);
-        onCircumference = (Point){xpos, ypos};
+        walk->x += walk->step_x;
+        walk->t_max_x += walk->t_delta_x;
+    }
+    else
+    {
+        walk->y += walk->step_y;
+        walk->t_max_y += walk->t_delta_y;
+    }
+
+    walk->t_exit = fmin(walk->t_max_x, walk->t_max_y);
+
+    return walk->x >= 0 && walk->x < GRID_SIZE && walk->y >= 0 && walk->y < GRID_SIZE;
+}
+
+/*  Return the parameter t at which the ray origin + t * dir first hits a wall before t_max, or INFINITY if it hits none.
+    The ray walks the grid cell by cell and stops as soon as the nearest hit lies inside the visited cells.
+    With any_hit set it stops at the first wall found before t_max instead, which is all an occlusion test needs.
+    If wall_index is not NULL it receives the index of the wall that was hit. */
+double traverseWalls(Point origin, Point dir, double t_max, int any_hit, int* wall_index)
+{
+    GridWalk walk = beginGridWalk(origin, dir);
+    double nearest = t_max;
+    int nearest_index = -1;
 
-        endPoint = findNearestIntersectionPoint((Line){normalizedOrigin, onCircumference});
+    do
+    {
+        const GridCell* cell = &wall_grid[walk.x][walk.y];
+
+        for(int i = 0; i < cell->count; ++i)
+        {
+            double t = intersectRayWall(origin, dir, &walls[cell->items[i]]);
+            if(t < nearest)
+            {
+                nearest = t;
+                nearest_index = cell->items[i];
+            }
+        }
 
-        glVertex2d(normalizedOrigin.x, normalizedOrigin.y);
-        glVertex2d(endPoint.x, endPoint.y);
+        if(any_hit && nearest_index >= 0)
+            break;
+
+        /* Any hit before the ray leaves this cell is closer than anything in the cells after it */
+        if(nearest <= walk.t_exit)
+            break;
     }
-    glEnd();
+    while(stepGridWalk(&walk));
+
+    if(wall_index)
+        *wall_index = nearest_index;
+
+    return nearest_index >= 0 ? nearest : INFINITY;
 }
 
-/* Scrolling the mousewheel down reduces the number of rays projected. Scrolling up increases the number. */
-void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
+/* Return the parameter t at which the ray origin + t * dir first hits a wall, or INFINITY if it hits none */
+double castRay(Point origin, Point dir, int* wall_index)
 {
-    RAY_DENSITY += yoffset;
-    
-    if(RAY_DENSITY < 0.0)
-        RAY_DENSITY = 0.0;
-    else  if(RAY_DENSITY > 1080.0) // An arbitrary limit. Can go higher, but begins to make your eyes hurt.
-        RAY_DENSITY = 1080.0;
+    return traverseWalls(origin, dir, INFINITY, 0, wall_index);
 }
 
-void initializeWindow(GLFWwindow** window)
+/* Return 1 if any wall crosses the segment between the two points */
+int segmentOccluded(Point from, Point to)
 {
-    /* Set the window to be non-resizable by the user */
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    Point dir = {to.x - from.x, to.y - from.y};
 
-    /* Create a windowed mode window and its OpenGL context */
-    *window = glfwCreateWindow(1920, 1080, "Raycaster", NULL, NULL);
-    if (!(*window))
-    {
-        glfwTerminate();
-        exit(-1);
-    }
+    return traverseWalls(from, dir, 1.0, 1, NULL) != INFINITY;
+}
 
-    /* Make the window's context current */
-    glfwMakeContextCurrent(*window);
+/* Return the parameter t at which the ray origin + t * dir leaves the square enclosed by the borders */
+double borderExit(Point origin, Point dir)
+{
+    double tx = dir.x > 0.0 ? (BORDER - origin.x) / dir.x : dir.x < 0.0 ? (-BORDER - origin.x) / dir.x : INFINITY;
+    double ty = dir.y > 0.0 ? (BORDER - origin.y) / dir.y : dir.y < 0.0 ? (-BORDER - origin.y) / dir.y : INFINITY;
 
-    /* Turn on scrolling input */
-    glfwSetScrollCallback(*window, scroll_callback);
+    return fmin(tx, ty);
 }
 
-int main(void)
+/*  Cast one ray of a batch. The hit receives the ray parameter of the nearest wall, clipped to the borders, and the index of that
+    wall (-1 if the ray reached the borders). */
+RayHit castBatchRay(Ray ray)
 {
-    GLFWwindow* window;
+    int wall;
+    double t = castRay(ray.origin, ray.dir, &wall);
+    double border = borderExit(ray.origin, ray.dir);
 
-    /* Initialize the library */
-    if (!glfwInit())
-        return -1;
+    return t < border ? (RayHit){t, wall} : (RayHit){border, -1};
+}
 
-    initializeWindow(&window);
+/* Cast a batch of rays in parallel */
+void castRayBatch(const Ray* rays, RayHit* hits, int count)
+{
+    #pragma omp parallel for schedule(static, 64) if(count > 256)
+    for(int i = 0; i < count; ++i)
+        hits[i] = castBatchRay(rays[i]);
+}
 
-    /* Loop until the user closes the window */
-    while (!glfwWindowShouldClose(window))
+/* Cast a batch of rays on the calling thread, for callers that already run in parallel and would only nest another team */
+void castRayBatchSerial(const Ray* rays, RayHit* hits, int count)
+{
+    for(int i = 0; i < count; ++i)
+        hits[i] = castBatchRay(rays[i]);
+}
+
+/* Return the mirror image of a direction reflected by a wall. The reflection is done with the widescreen compensation removed, so it looks right on screen. */
+Point reflectDirection(Point dir, const Line* w)
+{
+    double ex = w->point2.x - w->point1.x;
+    double ey = (w->point2.y - w->point1.y) / monitor_widescreen_compensation;
+    double dy = dir.y / monitor_widescreen_compensation;
+    double scale = 2.0 * (dir.x * ex + dy * ey) / (ex * ex + ey * ey);
+
+    return (Point){scale * ex - dir.x, (scale * ey - dy) * monitor_widescreen_compensation};
+}
+
+/*  Find the walls the ray origin + t * dir crosses before t_max, and write the nearest max_hits of them to hits, sorted by t.
+    Returns the number of hits written. The hits are kept in a max-heap of at most max_hits entries while the grid is walked,
+    so the walk ends as soon as the heap is full and nothing in later cells can be nearer, without sorting every wall on the ray. */
+int castRayAllHits(Point origin, Point dir, double t_max, RayHit* hits, int max_hits)
+{
+    GridWalk walk = beginGridWalk(origin, dir);
+    double t_enter = -INFINITY;
+    int count = 0;
+
+    if(max_hits <= 0)
+        return 0;
+
+    do
     {
-        /* Render here */
-        glClear(GL_COLOR_BUFFER_BIT);
-        drawRays(&window);
+        const GridCell* cell = &wall_grid[walk.x][walk.y];
+
+        for(int i = 0; i < cell->count; ++i)
+        {
+            double t = intersectRayWall(origin, dir, &walls[cell->items[i]]);
+
+            /* A wall spanning several cells is only counted in the cell its hit lies in */
+            if(t >= t_max || t < t_enter || t >= walk.t_exit)
+                continue;
+
+            int slot;
+            if(count < max_hits)
+            {
+                /* Sift the new hit up from the end of the heap */
+                slot = count++;
+                while(slot > 0 && hits[(slot - 1) / 2].t < t)
+                {
+                    hits[slot] = hits[(slot - 1) / 2];
+                    slot = (slot - 1) / 2;
+                }
+            }
+            else if(t < hits[0].t)
+            {
+                /* Replace the farthest hit and sift the new one down */
+                slot = 0;
+                for(;;)
+                {
+                    int child = 2 * slot + 1;
+                    if(child >= count)
+                        break;
+                    if(child + 1 < count && hits[child + 1].t > hits[child].t)
+                        ++child;
+                    if(hits[child].t <= t)
+                        break;
 
-        // Draw walls
-        for(int i = 0; i < (sizeof(walls) / sizeof(walls[0])); ++i)
+                    hits[slot] = hits[child];
+                    slot = child;
+                }
+            }
+            else
+                continue;
+
+            hits[slot] = (RayHit){t, cell->items[i]};
+        }
+
+        if(count == max_hits && hits[0].t <= walk.t_exit)
+            break;
+        if(t_max <= walk.t_exit)
+            break;
+
+        t_enter = walk.t_exit;
+    }
+    while(stepGridWalk(&walk));
+
+    /* Heap sort the hits into ascending order */
+    for(int end = count - 1; end > 0; --end)
+    {
+        RayHit farthest = hits[0];
+        RayHit moved = hits[end];
+        int slot = 0;
+
+        for(;;)
         {
-            drawWall(&walls[i]);
+            int child = 2 * slot + 1;
+            if(child >= end)
+                break;
+            if(child + 1 < end && hits[child + 1].t > hits[child].t)
+                ++child;
+            if(hits[child].t <= moved.t)
+                break;
+
+            hits[slot] = hits[child];
+            slot = child;
         }
 
+        hits[slot] = moved;
+        hits[end] = farthest;
+    }
+
+    return count;
+}
+
+/* Return the fraction of light that gets from one point to the other through the walls between them */
+double segmentTransmittance(Point from, Point to)
+{
+    RayHit hits[MAX_RAY_HITS];
+    Point dir = {to.x - from.x, to.y - from.y};
+    int count = castRayAllHits(from, dir, 1.0, hits, MAX_RAY_HITS);
+    double transmittance = 1.0;
+
+    for(int i = 0; i < count; ++i)
+        transmittance *= 1.0 - wall_opacity[hits[i].wall];
+
+    return count == MAX_RAY_HITS ? 0.0 : transmittance;
+}
+
+/*  Return the first contact between a circle moving from a to b and the wall, all in widescreen compensated coordinates.
+    The contact is either with the wall's side, where the circle's center is radius away from the wall's line, or with one of
+    its endpoints. Returns INFINITY if there is no contact in [0, 1], otherwise t and the normal pointing from the wall to the circle. */
+double sweepCircleWall(Point a, Point b, double radius, Point w1, Point w2, Point* normal)
+{
+    Point move = {b.x - a.x, b.y - a.y};
+    Point edge = {w2.x - w1.x, w2.y - w1.y};
+    double length = sqrt(edge.x * edge.x + edge.y * edge.y);
+    double nearest = INFINITY;
+
+    if(length > 10e-12)
+    {
+        Point n = {-edge.y / length, edge.x / length};
+        double start = n.x * (a.x - w1.x) + n.y * (a.y - w1.y);
+        double speed = n.x * move.x + n.y * move.y;
+        double side = start >= 0.0 ? 1.0 : -1.0;
+
+        /* Already touching the side, or moving towards it */
+        double t = fabs(start) <= radius ? 0.0 : speed * side < 0.0 ? (side * radius - start) / speed : INFINITY;
+
+        if(t <= 1.0)
+        {
+            Point p = {a.x + t * move.x - w1.x, a.y + t * move.y - w1.y};
+            double u = (p.x * edge.x + p.y * edge.y) / (length * length);
+
+            /* Moving away from a side it already touches is not a contact */
+            if(0.0 <= u && u <= 1.0 && !(t == 0.0 && speed * side > 0.0))
+            {
+                nearest = t;
+                *normal = (Point){n.x * side, n.y * side};
+            }
+        }
+    }
+
+    const Point endpoints[2] = {w1, w2};
+    for(int i = 0; i < 2; ++i)
+    {
+        /* The circle's center against a circle of the same radius around the endpoint */
+        Point o = {a.x - endpoints[i].x, a.y - endpoints[i].y};
+        double qa = move.x * move.x + move.y * move.y;
+        double qb = o.x * move.x + o.y * move.y;
+        double qc = o.x * o.x + o.y * o.y - radius * radius;
+        double t;
+
+        if(qc <= 0.0)
+            t = qb < 0.0 ? 0.0 : INFINITY;   // Already touching the endpoint, a contact only if moving towards it
+        else if(qa < 10e-24 || qb * qb - qa * qc < 0.0)
+            continue;
+        else
+            t = (-qb - sqrt(qb * qb - qa * qc)) / qa;
+
+        if(t >= 0.0 && t <= 1.0 && t < nearest)
+        {
+            Point p = {o.x + t * move.x, o.y + t * move.y};
+            double distance = sqrt(p.x * p.x + p.y * p.y);
+
+            nearest = t;
+            *normal = distance > 10e-12 ? (Point){p.x / distance, p.y / distance} : (Point){-move.x, -move.y};
+        }
+    }
+
+    return nearest;
+}
+
+/*  Find the first wall a circle touches while moving along the query's path. Only the walls in the grid cells overlapped by
+    the bounding box of the whole sweep are tested. */
+SweepHit sweepCircle(SweepQuery query)
+{
+    SweepHit result = {1.0, {0.0, 0.0}, -1};
+    double reach_x = query.radius;
+    double reach_y = query.radius * monitor_widescreen_compensation;
+
+    int x0 = gridCoordinate(fmin(query.from.x, query.to.x) - reach_x);
+    int x1 = gridCoordinate(fmax(query.from.x, query.to.x) + reach_x);
+    int y0 = gridCoordinate(fmin(query.from.y, query.to.y) - reach_y);
+    int y1 = gridCoordinate(fmax(query.from.y, query.to.y) + reach_y);
+
+    Point a = {query.from.x, query.from.y / monitor_widescreen_compensation};
+    Point b = {query.to.x, query.to.y / monitor_widescreen_compensation};
+
+    for(int x = x0; x <= x1; ++x)
+        for(int y = y0; y <= y1; ++y)
+        {
+            const GridCell* cell = &wall_grid[x][y];
+
+            for(int i = 0; i < cell->count; ++i)
+            {
+                const Line* w = &walls[cell->items[i]];
+                Point w1 = {w->point1.x, w->point1.y / monitor_widescreen_compensation};
+                Point w2 = {w->point2.x, w->point2.y / monitor_widescreen_compensation};
+                Point normal;
+                double t = sweepCircleWall(a, b, query.radius, w1, w2, &normal);
+
+                if(t < result.t || (t == result.t && result.wall < 0))
+                    result = (SweepHit){t, normal, cell->items[i]};
+            }
+        }
+
+    return result;
+}
+
+/* Sweep a batch of circles in parallel */
+void sweepCircleBatch(const SweepQuery* queries, SweepHit* hits, int count)
+{
+    #pragma omp parallel for schedule(static, 64) if(count > 256)
+    for(int i = 0; i < count; ++i)
+        hits[i] = sweepCircle(queries[i]);
+}
+
+/*  Move a circle by the given offset, sliding along the walls it runs into. Returns the position it ends up at.
+    The circle stops just short of each contact and the rest of its motion loses the component into the wall. */
+Point moveCircle(Point position, Point offset, double radius)
+{
+    for(int i = 0; i < 3 && (offset.x != 0.0 || offset.y != 0.0); ++i)
+    {
+        SweepHit hit = sweepCircle((SweepQuery){position, {position.x + offset.x, position.y + offset.y}, radius});
+        double t = hit.wall < 0 ? 1.0 : fmax(hit.t - 10e-6, 0.0);
+
+        position = (Point){position.x + t * offset.x, position.y + t * offset.y};
+        if(hit.wall < 0)
+            break;
+
+        /* Slide along the wall, in compensated coordinates where the normal lives */
+        Point rest = {(1.0 - t) * offset.x, (1.0 - t) * offset.y / monitor_widescreen_compensation};
+        double into = rest.x * hit.normal.x + rest.y * hit.normal.y;
+        offset = (Point){rest.x - into * hit.normal.x, (rest.y - into * hit.normal.y) * monitor_widescreen_compensation};
+    }
+
+    return position;
+}
+
+/* Return the nearest point of intersection between the provided line and any other objects (either a wall or border) */
+Point findNearestIntersectionPoint(Line start)
+{
+    Point dir = {start.point2.x - start.point1.x, start.point2.y - start.point1.y};
+
+    double t = fmin(castRay(start.point1, dir, NULL), borderExit(start.point1, dir));
+
+    return (Point){start.point1.x + t * dir.x, start.point1.y + t * dir.y};
+}
+
+/* Draw a wall, tinted blue if it is a mirror and green if it is translucent */
+void drawWall(const Line* w, Material material)
+{
+    if(material == MATERIAL_MIRROR)
+        glColor3f(0.5f, 0.8f, 1.0f);
+    else if(material == MATERIAL_TRANSLUCENT)
+        glColor3f(0.4f, 0.9f, 0.5f);
+    else
+        glColor3f(1.0f, 1.0f, 1.0f);
+    glLineWidth(5.0f);
+    glEnable(GL_LINE_SMOOTH);
+
+    glBegin(GL_LINES);
+    glVertex2f(w->point1.x, w->point1.y);
+    glVertex2f(w->point2.x, w->point2.y);
+
+
+    glEnd();
+}
+
+/* Make room for this frame's streamed polygon of count points around origin, and return where the points go */
+Point* streamPolygonBuffer(Point origin, int count)
+{
+    if(stream_point_capacity < count)
+    {
+        free(stream_points);
+        free(stream_previous);
+        free(stream_bytes);
+        stream_point_capacity = count;
+        stream_points = malloc(count * sizeof(Point));
+        stream_previous = malloc(count * 2 * sizeof(int));
+        stream_bytes = malloc(16 + (size_t) count * 15);   // Flags, count and origin, then at most 3 varints of 5 bytes per point
+        if(!stream_points || !stream_previous || !stream_bytes)
+        {
+            fprintf(stderr, "Out of memory allocating the visibility stream\n");
+            exit(-1);
+        }
+        stream_previous_count = -1;
+    }
+
+    stream_origin = origin;
+    stream_point_count = count;
+    stream_points_frame = input_frames;
+    return stream_points;
+}
+
+/*  Cast rays from the cursor and draw them. Rays pass through translucent walls, dimmed by each wall's opacity, and are
+    reflected up to REFLECTION_DEPTH times by mirrors.
+    The rays are cast as a wavefront: every ray of a bounce is cast as one batch, and the ones that hit a mirror are compacted
+    into the batch for the next bounce, instead of following each ray through all of its bounces. */
+void drawRays(GLFWwindow** window)
+{
+    static Ray* rays = NULL;
+    static float* intensity = NULL;
+    static RayHit* hits = NULL;
+    static int* hit_counts = NULL;
+    static int capacity = 0;
+
+    /* Get the current position of the cursos to be used as the origin for the light */
+    double xorigin, yorigin;
+    inputCursorPos(&xorigin, &yorigin);
+    
+    Point normalizedOrigin = normalizeMonitorCoordinates(xorigin, yorigin);
+    
+    int count = (int) RAY_DENSITY;
+    double inc = 2.0 * PI / RAY_DENSITY;
+
+    if(capacity < count)
+    {
+        free(rays);
+        free(intensity);
+        free(hits);
+        free(hit_counts);
+        capacity = count;
+        rays = malloc(capacity * sizeof(Ray));
+        intensity = malloc(capacity * sizeof(float));
+        hits = malloc(capacity * MAX_RAY_HITS * sizeof(RayHit));
+        hit_counts = malloc(capacity * sizeof(int));
+        if(!rays || !intensity || !hits || !hit_counts)
+        {
+            fprintf(stderr, "Out of memory allocating rays\n");
+            exit(-1);
+        }
+    }
+
+    double xpos, ypos;
+
+    for(int i = 0; i < count; ++i)
+    {
+        xpos = CIRCLE_RADIUS * cos(i * inc);
+        ypos = (CIRCLE_RADIUS * monitor_widescreen_compensation) * sin(i * inc);
+        rays[i] = (Ray){normalizedOrigin, {xpos, ypos}};
+        intensity[i] = 1.0f;
+    }
+
+    glLineWidth(1.0f);
+
+    for(int bounce = 0; bounce <= REFLECTION_DEPTH && count > 0; ++bounce)
+    {
+        #pragma omp parallel for schedule(static, 64) if(count > 256)
+        for(int i = 0; i < count; ++i)
+            hit_counts[i] = castRayAllHits(rays[i].origin, rays[i].dir, borderExit(rays[i].origin, rays[i].dir), &hits[i * MAX_RAY_HITS], MAX_RAY_HITS);
+
+        /* The nearest hits of the primary rays are the cursor's visibility polygon, which is kept when it is being streamed */
+        if(bounce == 0 && stream_file)
+        {
+            Point* polygon = streamPolygonBuffer(normalizedOrigin, count);
+
+            for(int i = 0; i < count; ++i)
+            {
+                double t = hit_counts[i] ? hits[i * MAX_RAY_HITS].t : borderExit(rays[i].origin, rays[i].dir);
+                polygon[i] = (Point){rays[i].origin.x + t * rays[i].dir.x, rays[i].origin.y + t * rays[i].dir.y};
+            }
+        }
+
+        /* Draw each ray up to the first wall that stops it, and keep the ones stopped by a mirror, reflected, for the next bounce */
+        int reflected = 0;
+
+        glBegin(GL_LINES);
+        for(int i = 0; i < count; ++i)
+        {
+            const RayHit* ray_hits = &hits[i * MAX_RAY_HITS];
+            Ray ray = rays[i];
+            float brightness = intensity[i];
+            Point from = ray.origin;
+            int k;
+
+            for(k = 0; k < hit_counts[i]; ++k)
+            {
+                Point hit = {ray.origin.x + ray_hits[k].t * ray.dir.x, ray.origin.y + ray_hits[k].t * ray.dir.y};
+
+                glColor3f(brightness, brightness, brightness);
+                glVertex2d(from.x, from.y);
+                glVertex2d(hit.x, hit.y);
+
+                from = hit;
+                if(wall_materials[ray_hits[k].wall] != MATERIAL_TRANSLUCENT)
+                    break;
+
+                brightness *= 1.0f - wall_opacity[ray_hits[k].wall];
+            }
+
+            if(k == hit_counts[i])
+            {
+                /* Every wall let the ray through, so it continues to the borders unless it ran out of hits first */
+                if(hit_counts[i] < MAX_RAY_HITS)
+                {
+                    double t = borderExit(ray.origin, ray.dir);
+
+                    glColor3f(brightness, brightness, brightness);
+                    glVertex2d(from.x, from.y);
+                    glVertex2d(ray.origin.x + t * ray.dir.x, ray.origin.y + t * ray.dir.y);
+                }
+                continue;
+            }
+
+            if(wall_materials[ray_hits[k].wall] != MATERIAL_MIRROR)
+                continue;
+
+            Point dir = reflectDirection(ray.dir, &walls[ray_hits[k].wall]);
+
+            /* Start just off the mirror so the reflected ray does not hit it again */
+            rays[reflected] = (Ray){{from.x + dir.x * 10e-7, from.y + dir.y * 10e-7}, dir};
+            intensity[reflected++] = brightness * 0.6f;
+        }
+        glEnd();
+
+        count = reflected;
+    }
+}
+
+/*  Recompute the visibility polygon of a light by casting RAY_DENSITY rays around it, clipped to the light's radius.
+    Ray directions use the same widescreen compensation as drawRays so that the light's radius looks circular on screen. */
+void computeLightPolygon(Light* l)
+{
+    int count = (int) RAY_DENSITY;
+    double inc = 2.0 * PI / count;
+
+    if(l->polygon_count != count)
+    {
+        free(l->polygon);
+        l->polygon = malloc(count * sizeof(Point));
+        l->polygon_count = l->polygon ? count : 0;
+    }
+
+    l->bounds_min = l->bounds_max = l->position;
+
+    for(int i = 0; i < l->polygon_count; ++i)
+    {
+        Point dir = {cos(i * inc), monitor_widescreen_compensation * sin(i * inc)};
+        double t = fmin(fmin(traverseWalls(l->position, dir, l->radius, 0, NULL), borderExit(l->position, dir)), l->radius);
+        Point p = {l->position.x + t * dir.x, l->position.y + t * dir.y};
+
+        l->polygon[i] = p;
+        l->bounds_min = (Point){fmin(l->bounds_min.x, p.x), fmin(l->bounds_min.y, p.y)};
+        l->bounds_max = (Point){fmax(l->bounds_max.x, p.x), fmax(l->bounds_max.y, p.y)};
+    }
+
+    l->polygon_origin = l->position;
+    l->valid = 1;
+}
+
+/*  Move the moving lights and bring every light's visibility polygon up to date.
+    Lights are independent of each other, so the stale ones are recomputed in parallel against the shared wall grid. */
+void updateLights(double dt)
+{
+    for(int i = 0; i < light_count; ++i)
+    {
+        Light* l = &lights[i];
+
+        l->position.x += l->velocity.x * dt;
+        l->position.y += l->velocity.y * dt;
+
+        /* Bounce moving lights off the edges of the window */
+        if(fabs(l->position.x) > 1.0)
+        {
+            l->position.x = copysign(1.0, l->position.x);
+            l->velocity.x *= -1;
+        }
+        if(fabs(l->position.y) > 1.0)
+        {
+            l->position.y = copysign(1.0, l->position.y);
+            l->velocity.y *= -1;
+        }
+
+        if(l->position.x != l->polygon_origin.x || l->position.y != l->polygon_origin.y || l->polygon_count != (int) RAY_DENSITY)
+            l->valid = 0;
+    }
+
+    int misses = 0;
+
+    #pragma omp parallel for schedule(dynamic, 4) reduction(+:misses)
+    for(int i = 0; i < light_count; ++i)
+    {
+        if(!lights[i].valid)
+        {
+            computeLightPolygon(&lights[i]);
+            ++misses;
+        }
+    }
+
+    frame_cache_misses = misses;
+    frame_cache_hits = light_count - misses;
+    total_cache_misses += frame_cache_misses;
+    total_cache_hits += frame_cache_hits;
+}
+
+/* Show the light count and the light cache counters in the window title */
+void updateWindowTitle(GLFWwindow* window)
+{
+    char title[256];
+    long long total = total_cache_hits + total_cache_misses;
+
+    snprintf(title, sizeof(title), "Raycaster - %d lights, cache hits %d misses %d this frame (%.1f%% hit rate overall)",
+             light_count, frame_cache_hits, frame_cache_misses, total ? 100.0 * total_cache_hits / total : 0.0);
+
+    if(render_mode == MODE_PATH_TRACING)
+        snprintf(title + strlen(title), sizeof(title) - strlen(title), " - path tracing %d samples per pixel, %.2f Mrays/s",
+                 path_samples, path_rays_per_second / 1e6);
+    else if(render_mode == MODE_BEAMS)
+        snprintf(title + strlen(title), sizeof(title) - strlen(title), " - %d beams (%d dropped), %d beam fragments, %.1f%% of the scene lit directly",
+                 beam_queue_count, beam_queue_dropped, beam_fragment_count, 100.0 * beam_coverage);
+    else if(render_mode == MODE_FOG)
+        snprintf(title + strlen(title), sizeof(title) - strlen(title), " - fog of war, %d units moved to another tile this frame", fog_recomputed);
+
+    if(editor_active)
+        snprintf(title + strlen(title), sizeof(title) - strlen(title), " - editing %d walls", wall_count);
+
+    glfwSetWindowTitle(window, title);
+}
+
+/*  Draw every light's visibility polygon as a triangle fan whose color falls off linearly with distance.
+    The polygons are blended additively so overlapping lights brighten each other. */
+void drawLights(void)
+{
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+
+    for(int i = 0; i < light_count; ++i)
+    {
+        const Light* l = &lights[i];
+
+        if(l->polygon_count == 0)
+            continue;
+
+        glBegin(GL_TRIANGLE_FAN);
+        glColor3f(l->r, l->g, l->b);
+        glVertex2d(l->position.x, l->position.y);
+
+        for(int j = 0; j <= l->polygon_count; ++j)
+        {
+            Point p = l->polygon[j % l->polygon_count];
+            double dx = p.x - l->position.x;
+            double dy = (p.y - l->position.y) / monitor_widescreen_compensation;
+            float falloff = (float) fmax(0.0, 1.0 - sqrt(dx * dx + dy * dy) / l->radius);
+
+            glColor3f(l->r * falloff, l->g * falloff, l->b * falloff);
+            glVertex2d(p.x, p.y);
+        }
+        glEnd();
+    }
+
+    glDisable(GL_BLEND);
+}
+
+/* Add a light to the scene. Returns 0 if there is no room for another light. */
+int addLight(Point position, Point velocity, float r, float g, float b, double radius)
+{
+    if(light_count == MAX_LIGHTS)
+        return 0;
+
+    lights[light_count++] = (Light){position, velocity, r, g, b, radius, NULL, 0, position, position, position, 0};
+    return 1;
+}
+
+/* Return a random double in [min, max] */
+double randomRange(double min, double max)
+{
+    return min + (max - min) * rand() / RAND_MAX;
+}
+
+/* Add a batch of randomly placed and colored lights. Moving lights drift across the window and bounce off its edges. */
+void spawnRandomLights(int count, int moving)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        Point position = {randomRange(-1.0, 1.0), randomRange(-1.0, 1.0)};
+        Point velocity = {0.0, 0.0};
+
+        if(moving)
+            velocity = (Point){randomRange(-0.2, 0.2), randomRange(-0.2, 0.2)};
+
+        if(!addLight(position, velocity, (float) randomRange(0.0, 0.25), (float) randomRange(0.0, 0.25), (float) randomRange(0.0, 0.25), randomRange(0.1, 0.4)))
+            return;
+    }
+}
+
+/* Remove every light from the scene */
+void clearLights(void)
+{
+    for(int i = 0; i < light_count; ++i)
+        free(lights[i].polygon);
+
+    light_count = 0;
+}
+
+/*  Bake the static lights into the lightmap. Each texel sums the falloff of every static light that reaches it, dimmed by any translucent walls in between.
+    Texels are independent, so rows are baked in parallel. */
+void bakeLightmap(int width, int height)
+{
+    free(lightmap.texels);
+    lightmap.width = width;
+    lightmap.height = height;
+    lightmap.texels = calloc((size_t) width * height * 3, 1);
+    if(!lightmap.texels)
+    {
+        fprintf(stderr, "Out of memory allocating the lightmap\n");
+        exit(-1);
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int y = 0; y < height; ++y)
+        for(int x = 0; x < width; ++x)
+        {
+            Point texel = {-1.0 + (x + 0.5) * 2.0 / width, -1.0 + (y + 0.5) * 2.0 / height};
+            double color[3] = {0.0, 0.0, 0.0};
+
+            for(int i = 0; i < static_light_count; ++i)
+            {
+                const Light* l = &static_lights[i];
+                double dx = texel.x - l->position.x;
+                double dy = (texel.y - l->position.y) / monitor_widescreen_compensation;
+                double falloff = 1.0 - sqrt(dx * dx + dy * dy) / l->radius;
+
+                if(falloff <= 0.0)
+                    continue;
+
+                /* Only pay for the full list of walls in between when something is in the way */
+                if(segmentOccluded(l->position, texel))
+                    falloff *= segmentTransmittance(l->position, texel);
+
+                color[0] += l->r * falloff;
+                color[1] += l->g * falloff;
+                color[2] += l->b * falloff;
+            }
+
+            unsigned char* out = &lightmap.texels[((size_t) y * width + x) * 3];
+            for(int c = 0; c < 3; ++c)
+                out[c] = (unsigned char) (fmin(color[c], 1.0) * 255.0 + 0.5);
+        }
+}
+
+/*  Compress lightmap texels. Each byte is replaced by its difference from the same channel of the previous texel,
+    which turns the smooth falloff and the unlit areas into long runs, and the result is run-length encoded (PackBits):
+    a header byte h < 128 is followed by h + 1 literal bytes, and h >= 128 is followed by one byte repeated h - 126 times.
+    Returns the compressed size, with the compressed bytes in a newly allocated buffer. */
+size_t compressLightmap(const unsigned char* texels, size_t size, unsigned char** compressed)
+{
+    unsigned char* delta = malloc(size);
+    unsigned char* out = malloc(size + size / 128 + 1);   // The worst case is all literals
+    if(!delta || !out)
+    {
+        fprintf(stderr, "Out of memory compressing the lightmap\n");
+        exit(-1);
+    }
+
+    for(size_t i = 0; i < size; ++i)
+        delta[i] = (unsigned char) (texels[i] - (i >= 3 ? texels[i - 3] : 0));
+
+    size_t in = 0, length = 0;
+    while(in < size)
+    {
+        size_t run = 1;
+        while(in + run < size && run < 129 && delta[in + run] == delta[in])
+            ++run;
+
+        if(run >= 2)
+        {
+            out[length++] = (unsigned char) (run + 126);
+            out[length++] = delta[in];
+            in += run;
+            continue;
+        }
+
+        /* Gather literals until the next run of at least two bytes */
+        size_t literals = 1;
+        while(in + literals < size && literals < 128 && !(in + literals + 1 < size && delta[in + literals] == delta[in + literals + 1]))
+            ++literals;
+
+        out[length++] = (unsigned char) (literals - 1);
+        memcpy(&out[length], &delta[in], literals);
+        length += literals;
+        in += literals;
+    }
+
+    free(delta);
+    *compressed = out;
+    return length;
+}
+
+/* Undo compressLightmap. Returns 0 if the compressed data does not decode to exactly size bytes. */
+int decompressLightmap(const unsigned char* compressed, size_t length, unsigned char* texels, size_t size)
+{
+    size_t in = 0, out = 0;
+
+    while(in < length)
+    {
+        unsigned char header = compressed[in++];
+
+        if(header < 128)
+        {
+            size_t literals = header + 1;
+            if(in + literals > length || out + literals > size)
+                return 0;
+
+            memcpy(&texels[out], &compressed[in], literals);
+            in += literals;
+            out += literals;
+        }
+        else
+        {
+            size_t run = header - 126;
+            if(in >= length || out + run > size)
+                return 0;
+
+            memset(&texels[out], compressed[in++], run);
+            out += run;
+        }
+    }
+
+    if(out != size)
+        return 0;
+
+    for(size_t i = 3; i < size; ++i)
+        texels[i] = (unsigned char) (texels[i] + texels[i - 3]);
+
+    return 1;
+}
+
+static const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Write bytes to a file as base64, 76 characters per line */
+void writeBase64(FILE* file, const unsigned char* bytes, size_t length)
+{
+    int column = 0;
+
+    for(size_t i = 0; i < length; i += 3)
+    {
+        unsigned int group = bytes[i] << 16;
+        if(i + 1 < length)
+            group |= bytes[i + 1] << 8;
+        if(i + 2 < length)
+            group |= bytes[i + 2];
+
+        char encoded[4] = {base64_alphabet[(group >> 18) & 63], base64_alphabet[(group >> 12) & 63],
+                           i + 1 < length ? base64_alphabet[(group >> 6) & 63] : '=', i + 2 < length ? base64_alphabet[group & 63] : '='};
+        fwrite(encoded, 1, 4, file);
+
+        column += 4;
+        if(column == 76)
+        {
+            fputc('\n', file);
+            column = 0;
+        }
+    }
+
+    if(column)
+        fputc('\n', file);
+}
+
+/* Decode a line of base64 and append the bytes to out. Returns the number of bytes written. */
+size_t decodeBase64Line(const char* line, unsigned char* out)
+{
+    unsigned int group = 0;
+    int bits = 0;
+    size_t length = 0;
+
+    for(; *line && *line != '='; ++line)
+    {
+        const char* found = strchr(base64_alphabet, *line);
+        if(!found)
+            continue;   // Skip whitespace and line endings
+
+        group = (group << 6) | (unsigned int) (found - base64_alphabet);
+        bits += 6;
+
+        if(bits >= 8)
+        {
+            bits -= 8;
+            out[length++] = (unsigned char) (group >> bits);
+        }
+    }
+
+    return length;
+}
+
+/*  Parse a "wall x1 y1 x2 y2 [mirror | translucent opacity]" line of a scene file. Returns 1 for a wall, 0 if the line is not a
+    wall and -1 for a wall of unknown material, whose name is left in material_name (32 characters). */
+int parseWallLine(const char* line, Line* w, Material* material, float* opacity, char* material_name)
+{
+    char keyword[32];
+    material_name[0] = '\0';
+    *opacity = 1.0f;
+
+    if(sscanf(line, "%31s", keyword) != 1 || strcmp(keyword, "wall") ||
+       sscanf(line, "%*s %lf %lf %lf %lf %31s %f", &w->point1.x, &w->point1.y, &w->point2.x, &w->point2.y, material_name, opacity) < 4)
+        return 0;
+
+    if(!material_name[0])
+        *material = MATERIAL_OPAQUE;
+    else if(!strcmp(material_name, "mirror"))
+        *material = MATERIAL_MIRROR;
+    else if(!strcmp(material_name, "translucent") && *opacity >= 0.0f && *opacity <= 1.0f)
+        *material = MATERIAL_TRANSLUCENT;
+    else
+        return -1;
+
+    if(*material != MATERIAL_TRANSLUCENT)
+        *opacity = 1.0f;
+    return 1;
+}
+
+/*  Load a scene file. Each line is one of
+        wall x1 y1 x2 y2 [mirror | translucent opacity]
+        light x y r g b radius [vx vy]      a light that is cast every frame, optionally moving
+        static_light x y r g b radius       a light that only contributes through the baked lightmap
+        lightmap width height length        followed by the compressed texels in base64 and a line reading "end"
+    Blank lines and lines starting with '#' are ignored. Returns 0 if the file cannot be read or is malformed. */
+int loadScene(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if(!file)
+    {
+        fprintf(stderr, "Could not open scene file %s\n", path);
+        return 0;
+    }
+
+    char line[512];
+    int line_number = 0;
+
+    while(fgets(line, sizeof(line), file))
+    {
+        ++line_number;
+
+        char keyword[32];
+        if(sscanf(line, "%31s", keyword) != 1 || keyword[0] == '#')
+            continue;
+
+        Line w;
+        Point p, v = {0.0, 0.0};
+        float r, g, b;
+        double radius;
+        int width, height;
+        size_t length;
+
+        char material_name[32];
+        Material material;
+        float opacity;
+        int wall = parseWallLine(line, &w, &material, &opacity, material_name);
+
+        if(wall > 0)
+            addWall(w, material, opacity);
+        else if(wall < 0)
+        {
+            fprintf(stderr, "%s:%d: unknown wall material \"%s\"\n", path, line_number, material_name);
+            fclose(file);
+            return 0;
+        }
+        else if(!strcmp(keyword, "light") && sscanf(line, "%*s %lf %lf %f %f %f %lf %lf %lf", &p.x, &p.y, &r, &g, &b, &radius, &v.x, &v.y) >= 6)
+        {
+            addLight(p, v, r, g, b, radius);
+        }
+        else if(!strcmp(keyword, "static_light") && sscanf(line, "%*s %lf %lf %f %f %f %lf", &p.x, &p.y, &r, &g, &b, &radius) == 6)
+        {
+            if(static_light_count < MAX_LIGHTS)
+                static_lights[static_light_count++] = (Light){p, v, r, g, b, radius, NULL, 0, p, p, p, 0};
+        }
+        else if(!strcmp(keyword, "lightmap") && sscanf(line, "%*s %d %d %zu", &width, &height, &length) == 3 && width > 0 && height > 0)
+        {
+            /* Every run of 128 texel bytes compresses to at most 129, so anything longer cannot be a lightmap of this size */
+            if(width > LIGHTMAP_MAX_SCALE * LIGHTMAP_WIDTH || height > LIGHTMAP_MAX_SCALE * LIGHTMAP_HEIGHT ||
+               length > (size_t) width * height * 3 / 128 * 129 + 129)
+            {
+                fprintf(stderr, "%s:%d: lightmap of %d by %d texels in %zu bytes is too large\n", path, line_number, width, height, length);
+                fclose(file);
+                return 0;
+            }
+
+            unsigned char* compressed = malloc(length + 80);
+            size_t size = (size_t) width * height * 3;
+            size_t read = 0;
+
+            free(lightmap.texels);
+            lightmap = (Lightmap){width, height, malloc(size), 0};
+            if(!compressed || !lightmap.texels)
+            {
+                fprintf(stderr, "Out of memory loading the lightmap\n");
+                exit(-1);
+            }
+
+            while(fgets(line, sizeof(line), file) && strncmp(line, "end", 3))
+            {
+                ++line_number;
+                if(read + strlen(line) * 3 / 4 > length + 80)
+                    break;
+                read += decodeBase64Line(line, &compressed[read]);
+            }
+
+            if(read != length || !decompressLightmap(compressed, length, lightmap.texels, size))
+            {
+                fprintf(stderr, "%s:%d: corrupt lightmap\n", path, line_number);
+                free(compressed);
+                fclose(file);
+                return 0;
+            }
+
+            free(compressed);
+        }
+        else
+        {
+            fprintf(stderr, "%s:%d: could not parse \"%s\"\n", path, line_number, keyword);
+            fclose(file);
+            return 0;
+        }
+    }
+
+    fclose(file);
+    return 1;
+}
+
+/* Write the current walls, lights and lightmap to a scene file. Returns 0 on failure. */
+int saveScene(const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if(!file)
+    {
+        fprintf(stderr, "Could not write scene file %s\n", path);
+        return 0;
+    }
+
+    for(int i = 0; i < wall_count; ++i)
+    {
+        fprintf(file, "wall %.17g %.17g %.17g %.17g", walls[i].point1.x, walls[i].point1.y, walls[i].point2.x, walls[i].point2.y);
+
+        if(wall_materials[i] == MATERIAL_MIRROR)
+            fprintf(file, " mirror");
+        else if(wall_materials[i] == MATERIAL_TRANSLUCENT)
+            fprintf(file, " translucent %g", wall_opacity[i]);
+
+        fprintf(file, "\n");
+    }
+
+    for(int i = 0; i < light_count; ++i)
+    {
+        const Light* l = &lights[i];
+        fprintf(file, "light %.17g %.17g %g %g %g %.17g %.17g %.17g\n", l->position.x, l->position.y, l->r, l->g, l->b, l->radius, l->velocity.x, l->velocity.y);
+    }
+
+    for(int i = 0; i < static_light_count; ++i)
+    {
+        const Light* l = &static_lights[i];
+        fprintf(file, "static_light %.17g %.17g %g %g %g %.17g\n", l->position.x, l->position.y, l->r, l->g, l->b, l->radius);
+    }
+
+    if(lightmap.texels)
+    {
+        unsigned char* compressed;
+        size_t length = compressLightmap(lightmap.texels, (size_t) lightmap.width * lightmap.height * 3, &compressed);
+
+        fprintf(file, "lightmap %d %d %zu\n", lightmap.width, lightmap.height, length);
+        writeBase64(file, compressed, length);
+        fprintf(file, "end\n");
+        free(compressed);
+    }
+
+    return fclose(file) == 0;
+}
+
+/*  Watching the scene file. With --watch, the walls are reloaded whenever the file is saved, and only the walls that changed
+    are touched in the grid. Lights and everything else in the file keep their state from the start. */
+#define SCENE_POLL_INTERVAL 0.5    // Seconds between checks of the file when inotify is not available
+
+static const char* scene_watch_path = NULL;
+static time_t scene_watch_modified;
+static long long scene_watch_size;
+static double scene_watch_poll_time;
+#ifdef __linux__
+static int scene_watch_fd = -1;
+static const char* scene_watch_name = NULL;    // The file's name within the watched directory
+#endif
+
+/* A wall as read from a scene file, and where it is in the scene or the file */
+typedef struct{
+    Line wall;
+    Material material;
+    float opacity;
+    int index;
+} WallRecord;
+
+/* Order ints from lowest to highest, for qsort */
+int compareInts(const void* a, const void* b)
+{
+    int x = *(const int*) a;
+    int y = *(const int*) b;
+    return (x > y) - (x < y);
+}
+
+/* Order walls by position, then material, so identical walls sort next to each other */
+int compareWallRecords(const void* a, const void* b)
+{
+    const WallRecord* x = a;
+    const WallRecord* y = b;
+    double u[5] = {x->wall.point1.x, x->wall.point1.y, x->wall.point2.x, x->wall.point2.y, x->opacity};
+    double v[5] = {y->wall.point1.x, y->wall.point1.y, y->wall.point2.x, y->wall.point2.y, y->opacity};
+
+    for(int i = 0; i < 5; ++i)
+        if(u[i] != v[i])
+            return u[i] < v[i] ? -1 : 1;
+
+    return (x->material > y->material) - (x->material < y->material);
+}
+
+/*  Read only the walls of a scene file. Returns the number of walls, or -1 if the file cannot be read or has a malformed wall,
+    in which case nothing is allocated. */
+int readSceneWalls(const char* path, WallRecord** records)
+{
+    FILE* file = fopen(path, "r");
+    if(!file)
+    {
+        fprintf(stderr, "Could not open scene file %s\n", path);
+        return -1;
+    }
+
+    char line[512];
+    int line_number = 0, count = 0, capacity = 0;
+    *records = NULL;
+
+    while(fgets(line, sizeof(line), file))
+    {
+        WallRecord r;
+        char material_name[32];
+
+        ++line_number;
+        int wall = parseWallLine(line, &r.wall, &r.material, &r.opacity, material_name);
+        if(wall == 0)
+        {
+            char keyword[32];
+            if(sscanf(line, "%31s", keyword) != 1 || strcmp(keyword, "wall"))
+                continue;
+        }
+
+        if(wall <= 0)
+        {
+            fprintf(stderr, "%s:%d: malformed wall\n", path, line_number);
+            free(*records);
+            *records = NULL;
+            fclose(file);
+            return -1;
+        }
+
+        if(count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            *records = realloc(*records, capacity * sizeof(WallRecord));
+            if(!*records)
+            {
+                fprintf(stderr, "Out of memory reading walls\n");
+                exit(-1);
+            }
+        }
+
+        r.index = count;
+        (*records)[count++] = r;
+    }
+
+    fclose(file);
+    return count;
+}
+
+/*  Make the scene's walls match the given ones, touching only the walls that differ. Walls found in both are kept, walls that
+    are only in the scene are moved to where the new ones are, and whatever is left over is removed or added. Walls are matched
+    by sorting both sets, so this takes O(n log n) time rather than the rebuild of the whole grid a full reload would need. */
+void applySceneWalls(WallRecord* incoming, int incoming_count, int* added, int* removed, int* moved)
+{
+    WallRecord* current = malloc((wall_count + 1) * sizeof(WallRecord));
+    int* stale = malloc((wall_count + 1) * sizeof(int));
+    int* fresh = malloc((incoming_count + 1) * sizeof(int));
+    if(!current || !stale || !fresh)
+    {
+        fprintf(stderr, "Out of memory comparing walls\n");
+        exit(-1);
+    }
+
+    for(int i = 0; i < wall_count; ++i)
+        current[i] = (WallRecord){walls[i], wall_materials[i], wall_opacity[i], i};
+
+    qsort(current, wall_count, sizeof(WallRecord), compareWallRecords);
+    qsort(incoming, incoming_count, sizeof(WallRecord), compareWallRecords);
+
+    /* Walk both sorted sets together to pair up identical walls */
+    int stale_count = 0, fresh_count = 0;
+    int i = 0, j = 0;
+
+    while(i < wall_count || j < incoming_count)
+    {
+        int order = i == wall_count ? 1 : j == incoming_count ? -1 : compareWallRecords(&current[i], &incoming[j]);
+
+        if(order == 0)
+        {
+            ++i;
+            ++j;
+        }
+        else if(order < 0)
+            stale[stale_count++] = current[i++].index;
+        else
+            fresh[fresh_count++] = j++;
+    }
+
+    /* Move the lowest stale walls and remove the rest from the top down, so every removal takes its replacement from above */
+    qsort(stale, stale_count, sizeof(int), compareInts);
+
+    *moved = stale_count < fresh_count ? stale_count : fresh_count;
+    *removed = stale_count - *moved;
+    *added = fresh_count - *moved;
+
+    for(int k = 0; k < *moved; ++k)
+    {
+        const WallRecord* r = &incoming[fresh[k]];
+        replaceWall(stale[k], r->wall, r->material, r->opacity);
+    }
+
+    for(int k = stale_count - 1; k >= *moved; --k)
+        removeWall(stale[k]);
+
+    for(int k = *moved; k < fresh_count; ++k)
+    {
+        const WallRecord* r = &incoming[fresh[k]];
+        addWall(r->wall, r->material, r->opacity);
+    }
+
+    free(current);
+    free(stale);
+    free(fresh);
+}
+
+/* Reload the walls of the watched scene file, keeping the current ones if it cannot be read */
+void reloadSceneWalls(void)
+{
+    double start = glfwGetTime();
+    WallRecord* incoming;
+    int count = readSceneWalls(scene_watch_path, &incoming);
+
+    if(count < 0)
+    {
+        fprintf(stderr, "Keeping the current walls\n");
+        return;
+    }
+
+    /* Walls change their indices, so the editor lets go of the wall it was holding */
+    editor_hover_wall = editor_drag_wall = -1;
+    editor_drawing = 0;
+
+    int added, removed, moved;
+    applySceneWalls(incoming, count, &added, &removed, &moved);
+    free(incoming);
+
+    printf("Reloaded %s: %d walls added, %d removed and %d moved in %.1f ms\n", scene_watch_path, added, removed, moved,
+           1000.0 * (glfwGetTime() - start));
+}
+
+/* Record the scene file's modification time and size, to tell when it changes without inotify */
+void statSceneFile(time_t* modified, long long* size)
+{
+    struct stat status;
+
+    if(stat(scene_watch_path, &status) == 0)
+    {
+        *modified = status.st_mtime;
+        *size = (long long) status.st_size;
+    }
+    else
+    {
+        *modified = 0;
+        *size = -1;
+    }
+}
+
+/*  Start watching a scene file for changes. On Linux the directory holding it is watched with inotify, which also sees editors
+    that save by writing a new file and renaming it over the old one. Elsewhere, or if inotify is not available, the file's
+    modification time and size are checked every SCENE_POLL_INTERVAL seconds. */
+void startSceneWatch(const char* path)
+{
+    scene_watch_path = path;
+    statSceneFile(&scene_watch_modified, &scene_watch_size);
+    scene_watch_poll_time = glfwGetTime();
+
+#ifdef __linux__
+    const char* slash = strrchr(path, '/');
+    char directory[1024];
+
+    if(slash)
+        snprintf(directory, sizeof(directory), "%.*s", (int) (slash - path) + (slash == path), path);
+    else
+        strcpy(directory, ".");
+    scene_watch_name = slash ? slash + 1 : path;
+
+    scene_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(scene_watch_fd >= 0 && inotify_add_watch(scene_watch_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        close(scene_watch_fd);
+        scene_watch_fd = -1;
+    }
+
+    if(scene_watch_fd < 0)
+        fprintf(stderr, "Could not watch %s with inotify, checking it every %g s instead\n", directory, SCENE_POLL_INTERVAL);
+#endif
+}
+
+/* Reload the walls if the watched scene file has changed. Called every frame. */
+void pollSceneWatch(void)
+{
+    if(!scene_watch_path)
+        return;
+
+#ifdef __linux__
+    if(scene_watch_fd >= 0)
+    {
+        int changed = 0;
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t length;
+
+        while((length = read(scene_watch_fd, events, sizeof(events))) > 0)
+            for(char* p = events; p < events + length; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len)
+            {
+                const struct inotify_event* event = (const struct inotify_event*) p;
+                if(event->len && !strcmp(event->name, scene_watch_name))
+                    changed = 1;
+            }
+
+        if(changed)
+            reloadSceneWalls();
+        return;
+    }
+#endif
+
+    double now = glfwGetTime();
+    if(now - scene_watch_poll_time < SCENE_POLL_INTERVAL)
+        return;
+    scene_watch_poll_time = now;
+
+    time_t modified;
+    long long size;
+    statSceneFile(&modified, &size);
+
+    if(size >= 0 && (modified != scene_watch_modified || size != scene_watch_size))
+    {
+        scene_watch_modified = modified;
+        scene_watch_size = size;
+        reloadSceneWalls();
+    }
+}
+
+/* Draw the baked lightmap over the whole window, blended additively like the dynamic lights */
+void drawLightmap(void)
+{
+    if(!lightmap.texels)
+        return;
+
+    glEnable(GL_TEXTURE_2D);
+
+    if(!lightmap.texture)
+    {
+        glGenTextures(1, &lightmap.texture);
+        glBindTexture(GL_TEXTURE_2D, lightmap.texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, lightmap.width, lightmap.height, 0, GL_RGB, GL_UNSIGNED_BYTE, lightmap.texels);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, lightmap.texture);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glColor3f(1.0f, 1.0f, 1.0f);
+
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, -1.0f);
+    glTexCoord2f(1.0f, 0.0f); glVertex2f( 1.0f, -1.0f);
+    glTexCoord2f(1.0f, 1.0f); glVertex2f( 1.0f,  1.0f);
+    glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f,  1.0f);
+    glEnd();
+
+    glDisable(GL_BLEND);
+    glDisable(GL_TEXTURE_2D);
+}
+
+/* Allocate a framebuffer of the given size, or do nothing if it already has that size */
+void initializeFramebuffer(Framebuffer* fb, int width, int height)
+{
+    if(fb->width == width && fb->height == height)
+        return;
+
+    free(fb->pixels);
+    free(fb->bytes);
+    fb->width = width;
+    fb->height = height;
+    fb->pixels = calloc((size_t) width * height * 3, sizeof(float));
+    fb->bytes = malloc((size_t) width * height * 3);
+    if(!fb->pixels || !fb->bytes)
+    {
+        fprintf(stderr, "Out of memory allocating a %dx%d framebuffer\n", width, height);
+        exit(-1);
+    }
+}
+
+/* Return the window coordinates of the center of a framebuffer pixel */
+Point framebufferPixelCenter(const Framebuffer* fb, int x, int y)
+{
+    return (Point){-1.0 + (x + 0.5) * 2.0 / fb->width, -1.0 + (y + 0.5) * 2.0 / fb->height};
+}
+
+/* Upload the framebuffer, with every pixel multiplied by scale and clamped, and draw it over the whole window */
+void presentFramebuffer(Framebuffer* fb, float scale)
+{
+    size_t size = (size_t) fb->width * fb->height * 3;
+
+    for(size_t i = 0; i < size; ++i)
+    {
+        float v = fb->pixels[i] * scale;
+        fb->bytes[i] = (unsigned char) (v >= 1.0f ? 255 : v <= 0.0f ? 0 : v * 255.0f + 0.5f);
+    }
+
+    glEnable(GL_TEXTURE_2D);
+
+    if(!fb->texture)
+    {
+        glGenTextures(1, &fb->texture);
+        glBindTexture(GL_TEXTURE_2D, fb->texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, fb->texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, fb->width, fb->height, 0, GL_RGB, GL_UNSIGNED_BYTE, fb->bytes);
+    glColor3f(1.0f, 1.0f, 1.0f);
+
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, -1.0f);
+    glTexCoord2f(1.0f, 0.0f); glVertex2f( 1.0f, -1.0f);
+    glTexCoord2f(1.0f, 1.0f); glVertex2f( 1.0f,  1.0f);
+    glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f,  1.0f);
+    glEnd();
+
+    glDisable(GL_TEXTURE_2D);
+}
+
+/*  The region in which a wall can shadow part of a disc light, bounded by the convex hull of a few corners. Coordinates are
+    widescreen compensated (y divided by the compensation) so the disc is round. */
+typedef struct{
+    Point a, b;         // The wall's endpoints
+    float opacity;
+    Point corners[6];
+    double min_y, max_y;
+    double distance;            // From the light to the nearest point of the wall
+    int first_row, last_row;    // The framebuffer rows whose pixel centers the hull spans
+} ShadowWedge;
+
+/* One end of the part of the disc light a wall hides from a pixel, for sweeping along the light */
+typedef struct{
+    double position;    // Along the light, from 0 to 1
+    float opacity;
+    int enter;          // 1 where the wall starts hiding the light, 0 where it stops
+} ShadowEvent;
+
+#define SHADOW_MERGED 4    // Disjoint intervals of the light hidden by opaque walls that are merged per pixel as they are found
+
+/* A wall hiding part of the disc light from a pixel, found while scan-converting one row of the framebuffer */
+typedef struct{
+    int x;
+    float opacity;
+    double low, high;
+} ShadowSpan;
+
+/* Rotate a vector by an angle */
+Point rotatePoint(Point p, double angle)
+{
+    return (Point){p.x * cos(angle) - p.y * sin(angle), p.x * sin(angle) + p.y * cos(angle)};
+}
+
+/* Return the wrapped difference between two angles, in (-PI, PI] */
+double angleDifference(double a, double b)
+{
+    double d = fmod(a - b, 2.0 * PI);
+
+    if(d > PI)
+        d -= 2.0 * PI;
+    else if(d <= -PI)
+        d += 2.0 * PI;
+
+    return d;
+}
+
+/*  Build the shadow wedge of a wall for a disc light centered at c with the given radius, all in compensated coordinates.
+    Returns 0 if the wall cannot cast a shadow (it is out of reach or touches the light). */
+int buildShadowWedge(Point c, double radius, Point a, Point b, double reach, ShadowWedge* wedge)
+{
+    Point ca = {a.x - c.x, a.y - c.y};
+    Point cb = {b.x - c.x, b.y - c.y};
+    double da = sqrt(ca.x * ca.x + ca.y * ca.y);
+    double db = sqrt(cb.x * cb.x + cb.y * cb.y);
+    double orientation = ca.x * cb.y - ca.y * cb.x;
+
+    /* The wall is out of reach if its nearest point is */
+    Point ab = {b.x - a.x, b.y - a.y};
+    double t = fmax(0.0, fmin(1.0, -(ca.x * ab.x + ca.y * ab.y) / (ab.x * ab.x + ab.y * ab.y)));
+    double nearest = hypot(ca.x + t * ab.x, ca.y + t * ab.y);
+
+    if(da <= radius || db <= radius || fabs(orientation) < 10e-12 || nearest > reach)
+        return 0;
+
+    wedge->a = a;
+    wedge->b = b;
+    wedge->distance = nearest;
+
+    if(nearest <= radius)
+    {
+        /* The wall passes through the light, and can shadow anything in reach */
+        for(int i = 0; i < 6; ++i)
+            wedge->corners[i] = (Point){c.x + (i & 1 ? reach : -reach), c.y + (i & 2 ? reach : -reach)};
+    }
+    else
+    {
+        /*  Light from the disc passes each endpoint in directions within asin(radius / distance) of the direction away from the
+            light, so the shadow lies in the convex hull of the wall and those extreme directions, followed until they leave the
+            light's reach. */
+        Point ends[2] = {a, b};
+        Point away[2] = {ca, cb};
+        double lengths[2] = {da, db};
+        double far = (reach + fmax(da, db)) / (nearest - radius);
+
+        wedge->corners[0] = a;
+        wedge->corners[1] = b;
+        for(int k = 0; k < 2; ++k)
+            for(int s = 0; s < 2; ++s)
+            {
+                double spread = asin(radius / lengths[k]);
+                Point u = rotatePoint((Point){away[k].x / lengths[k], away[k].y / lengths[k]}, s ? spread : -spread);
+
+                wedge->corners[2 + 2 * k + s] = (Point){ends[k].x + far * u.x, ends[k].y + far * u.y};
+            }
+    }
+
+    wedge->min_y = wedge->max_y = wedge->corners[0].y;
+    for(int i = 1; i < 6; ++i)
+    {
+        wedge->min_y = fmin(wedge->min_y, wedge->corners[i].y);
+        wedge->max_y = fmax(wedge->max_y, wedge->corners[i].y);
+    }
+
+    return 1;
+}
+
+/*  Find the part of the disc light hidden from p by the wall from a to b. The light is treated as the chord of the disc facing p,
+    and the hidden part is returned as the interval [*low, *high] along that chord, from 0 to 1. Returns 0 if none of it is hidden. */
+int occludedInterval(Point a, Point b, Point c, double radius, Point p, double* low, double* high)
+{
+    double dx = c.x - p.x;
+    double dy = c.y - p.y;
+    double distance = sqrt(dx * dx + dy * dy);
+
+    if(distance <= radius)
+        return 0;
+
+    double to_light = atan2(dy, dx);
+    double half_width = asin(radius / distance);
+    double angle_a = angleDifference(atan2(a.y - p.y, a.x - p.x), to_light);
+    double angle_b = angleDifference(atan2(b.y - p.y, b.x - p.x), to_light);
+
+    /* A wall that straddles the direction away from the light is behind p */
+    if(fabs(angle_a - angle_b) > PI)
+        return 0;
+
+    double from = fmax(fmin(angle_a, angle_b), -half_width);
+    double to = fmin(fmax(angle_a, angle_b), half_width);
+    if(to <= from)
+        return 0;
+
+    /*  The wall only hides the part of the chord beyond it from p. That is all or none of the overlap unless the wall's line
+        crosses the chord, and then the overlap is cut where it does. */
+    Point e = {b.x - a.x, b.y - a.y};
+    double side_p = e.x * (p.y - a.y) - e.y * (p.x - a.x);
+    int hidden[2];
+
+    for(int k = 0; k < 2; ++k)
+    {
+        double angle = k ? to : from;
+        double length = distance / cos(angle);
+        Point x = {p.x + length * cos(to_light + angle), p.y + length * sin(to_light + angle)};
+
+        hidden[k] = (e.x * (x.y - a.y) - e.y * (x.x - a.x) > 0.0) != (side_p > 0.0);
+    }
+
+    if(!hidden[0] && !hidden[1])
+        return 0;
+
+    if(hidden[0] != hidden[1])
+    {
+        double s = ((c.x - a.x) * dx + (c.y - a.y) * dy) / (e.x * dx + e.y * dy);
+        double cut = angleDifference(atan2(a.y + s * e.y - p.y, a.x + s * e.x - p.x), to_light);
+
+        if(hidden[0])
+            to = fmin(to, cut);
+        else
+            from = fmax(from, cut);
+
+        if(to <= from)
+            return 0;
+    }
+
+    *low = (from + half_width) / (2.0 * half_width);
+    *high = (to + half_width) / (2.0 * half_width);
+    return 1;
+}
+
+/*  Return 1 if the wall is hidden from the whole disc light by the first opaque wall in front of it: if both of its endpoints are in
+    that wall's umbra, so is all of it, since the umbra is convex, and it cannot darken anything the other wall does not already.
+    light is in window coordinates and c in compensated ones. Walls only hidden by several walls together are kept. */
+int wallInUmbra(int index, Point light, Point c, double radius)
+{
+    const Line* w = &walls[index];
+    Point ends[2] = {w->point1, w->point2};
+    int occluder = -1;
+
+    for(int k = 0; k < 2; ++k)
+    {
+        int hit;
+        Point dir = {ends[k].x - light.x, ends[k].y - light.y};
+
+        if(traverseWalls(light, dir, 1.0, 0, &hit) == INFINITY || hit == index || wall_opacity[hit] < 1.0f || (k && hit != occluder))
+            return 0;
+        occluder = hit;
+    }
+
+    Point a = {walls[occluder].point1.x, walls[occluder].point1.y / monitor_widescreen_compensation};
+    Point b = {walls[occluder].point2.x, walls[occluder].point2.y / monitor_widescreen_compensation};
+
+    for(int k = 0; k < 2; ++k)
+    {
+        double low, high;
+        Point p = {ends[k].x, ends[k].y / monitor_widescreen_compensation};
+
+        if(!occludedInterval(a, b, c, radius, p, &low, &high) || low > 0.0 || high < 1.0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Order shadow wedges from the nearest wall to the light to the farthest */
+int compareShadowWedges(const void* a, const void* b)
+{
+    double x = ((const ShadowWedge*) a)->distance;
+    double y = ((const ShadowWedge*) b)->distance;
+    return (x > y) - (x < y);
+}
+
+/* Order shadow events along the light */
+int compareShadowEvents(const void* a, const void* b)
+{
+    double x = ((const ShadowEvent*) a)->position;
+    double y = ((const ShadowEvent*) b)->position;
+    return (x > y) - (x < y);
+}
+
+/* Whether the merged intervals of the light hidden from a pixel already hold all of [low, high] */
+int shadowIntervalCovered(const double (*intervals)[2], int count, double low, double high)
+{
+    for(int i = 0; i < count; ++i)
+        if(intervals[i][0] <= low && intervals[i][1] >= high)
+            return 1;
+
+    return 0;
+}
+
+/*  Add the interval [low, high] of the light that an opaque wall hides from a pixel to the pixel's merged intervals, which are kept
+    sorted and disjoint. Returns 0 if it would need more than SHADOW_MERGED of them. */
+int mergeShadowInterval(double (*intervals)[2], int* count, double low, double high)
+{
+    int first = 0;
+    while(first < *count && intervals[first][1] < low)
+        ++first;
+
+    int last = first;
+    while(last < *count && intervals[last][0] <= high)
+        ++last;
+
+    if(first == last)
+    {
+        if(*count == SHADOW_MERGED)
+            return 0;
+
+        memmove(&intervals[first + 1], &intervals[first], (*count - first) * sizeof(intervals[0]));
+        intervals[first][0] = low;
+        intervals[first][1] = high;
+        ++*count;
+        return 1;
+    }
+
+    /* Replace the intervals it overlaps with their union */
+    intervals[first][0] = fmin(low, intervals[first][0]);
+    intervals[first][1] = fmax(high, intervals[last - 1][1]);
+    memmove(&intervals[first + 1], &intervals[last], (*count - last) * sizeof(intervals[0]));
+    *count -= last - first - 1;
+    return 1;
+}
+
+/*  Return the fraction of the disc light that reaches a pixel through the walls hiding the given spans of it, and the merged
+    intervals hidden by opaque walls. Everything is swept in order along the light, so where walls overlap the light is stopped
+    once by an opaque wall, and by the product of the translucent walls' transmissions, rather than once per wall.
+    events needs room for 2 * (count + interval_count). */
+double lightTransmission(const ShadowSpan* spans, int count, const double (*intervals)[2], int interval_count, ShadowEvent* events)
+{
+    int event_count = 0;
+
+    for(int i = 0; i < count; ++i)
+    {
+        events[event_count++] = (ShadowEvent){spans[i].low, spans[i].opacity, 1};
+        events[event_count++] = (ShadowEvent){spans[i].high, spans[i].opacity, 0};
+    }
+
+    for(int i = 0; i < interval_count; ++i)
+    {
+        events[event_count++] = (ShadowEvent){intervals[i][0], 1.0f, 1};
+        events[event_count++] = (ShadowEvent){intervals[i][1], 1.0f, 0};
+    }
+
+    qsort(events, event_count, sizeof(ShadowEvent), compareShadowEvents);
+
+    double hidden = 0.0, previous = 0.0, transmission = 1.0;
+    int opaque = 0;
+
+    for(int i = 0; i < event_count; ++i)
+    {
+        hidden += (events[i].position - previous) * (opaque ? 1.0 : 1.0 - transmission);
+        previous = events[i].position;
+
+        if(events[i].opacity >= 1.0f)
+            opaque += events[i].enter ? 1 : -1;
+        else if(events[i].enter)
+            transmission *= 1.0 - events[i].opacity;
+        else
+            transmission /= 1.0 - events[i].opacity;
+    }
+
+    return 1.0 - fmin(hidden, 1.0);
+}
+
+/*  Return the first pixel at or after x that is not yet dark. Dark pixels point past themselves, and the links are shortened as
+    they are followed, so the runs of dark pixels the walls behind them cover are skipped in one step. */
+int nextLitPixel(int* next, int x)
+{
+    int root = x;
+    while(next[root] != root)
+        root = next[root];
+
+    while(next[x] != root)
+    {
+        int following = next[x];
+        next[x] = root;
+        x = following;
+    }
+
+    return root;
+}
+
+/*  Render the cursor's disc light with soft shadows into the framebuffer. The walls in reach are gathered from the grid, and those
+    wholly in the umbra of another wall are dropped. Each remaining wall's shadow wedge is scan-converted row by row, and only the
+    pixels it covers compute the part of the light it hides. Each pixel then merges the parts hidden by every wall, so the cost
+    grows with the shadowed pixels of the visible walls rather than with a number of light samples. */
+void renderSoftShadows(Point light)
+{
+    static ShadowWedge* wedges = NULL;
+    static int* wall_marks = NULL;      // The frame each wall was last gathered in
+    static int* candidates = NULL;
+    static int wedge_capacity = 0;
+    static int mark = 0;
+    static int* row_starts = NULL;
+    static int* row_fill = NULL;
+    static int* row_wedges = NULL;
+    static int row_wedge_capacity = 0;
+
+    if(wedge_capacity < wall_count)
+    {
+        free(wedges);
+        free(wall_marks);
+        free(candidates);
+        wedge_capacity = wall_capacity;
+        wedges = malloc(wedge_capacity * sizeof(ShadowWedge));
+        wall_marks = calloc(wedge_capacity, sizeof(int));
+        candidates = malloc(wedge_capacity * sizeof(int));
+        if(!wedges || !wall_marks || !candidates)
+        {
+            fprintf(stderr, "Out of memory allocating shadow wedges\n");
+            exit(-1);
+        }
+        mark = 0;
+    }
+
+    initializeFramebuffer(&framebuffer, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT);
+
+    int width = framebuffer.width, height = framebuffer.height;
+    if(!row_starts)
+    {
+        row_starts = malloc((FRAMEBUFFER_HEIGHT + 1) * sizeof(int));
+        row_fill = malloc(FRAMEBUFFER_HEIGHT * sizeof(int));
+        if(!row_starts || !row_fill)
+        {
+            fprintf(stderr, "Out of memory allocating shadow wedges\n");
+            exit(-1);
+        }
+    }
+
+    /* Gather the walls in the grid cells within reach of the light, each once */
+    Point c = {light.x, light.y / monitor_widescreen_compensation};
+    int x0 = gridCoordinate(light.x - AREA_LIGHT_REACH), x1 = gridCoordinate(light.x + AREA_LIGHT_REACH);
+    int y0 = gridCoordinate(light.y - AREA_LIGHT_REACH * monitor_widescreen_compensation);
+    int y1 = gridCoordinate(light.y + AREA_LIGHT_REACH * monitor_widescreen_compensation);
+    int candidate_count = 0;
+
+    ++mark;
+    for(int x = x0; x <= x1; ++x)
+        for(int y = y0; y <= y1; ++y)
+        {
+            const GridCell* cell = &wall_grid[x][y];
+
+            for(int i = 0; i < cell->count; ++i)
+                if(wall_marks[cell->items[i]] != mark)
+                {
+                    wall_marks[cell->items[i]] = mark;
+                    candidates[candidate_count++] = cell->items[i];
+                }
+        }
+
+    /* Build the wedges of the walls that can be seen from some part of the light, then pack them in the order they were gathered */
+    #pragma omp parallel for schedule(dynamic, 64)
+    for(int k = 0; k < candidate_count; ++k)
+    {
+        int i = candidates[k];
+        Point a = {walls[i].point1.x, walls[i].point1.y / monitor_widescreen_compensation};
+        Point b = {walls[i].point2.x, walls[i].point2.y / monitor_widescreen_compensation};
+
+        if(!buildShadowWedge(c, AREA_LIGHT_SIZE, a, b, AREA_LIGHT_REACH, &wedges[k]) || wallInUmbra(i, light, c, AREA_LIGHT_SIZE))
+            candidates[k] = -1;
+        else
+            wedges[k].opacity = wall_opacity[i];
+    }
+
+    int wedge_count = 0;
+    for(int k = 0; k < candidate_count; ++k)
+        if(candidates[k] >= 0)
+            wedges[wedge_count++] = wedges[k];
+
+    /* Near walls first, so the pixels they hide the whole light from can skip the walls behind them */
+    qsort(wedges, wedge_count, sizeof(ShadowWedge), compareShadowWedges);
+
+    /* Bin the wedges by the rows they cover, so each row only visits its own */
+    memset(row_starts, 0, (height + 1) * sizeof(int));
+    for(int i = 0; i < wedge_count; ++i)
+    {
+        ShadowWedge* wedge = &wedges[i];
+        wedge->first_row = (int) fmax(0.0, ceil((wedge->min_y * monitor_widescreen_compensation + 1.0) * height / 2.0 - 0.5));
+        wedge->last_row = (int) fmin(height - 1.0, floor((wedge->max_y * monitor_widescreen_compensation + 1.0) * height / 2.0 - 0.5));
+
+        for(int y = wedge->first_row; y <= wedge->last_row; ++y)
+            ++row_starts[y + 1];
+    }
+
+    for(int y = 0; y < height; ++y)
+    {
+        row_starts[y + 1] += row_starts[y];
+        row_fill[y] = row_starts[y];
+    }
+
+    if(row_wedge_capacity < row_starts[height])
+    {
+        free(row_wedges);
+        row_wedge_capacity = row_starts[height];
+        row_wedges = malloc(row_wedge_capacity * sizeof(int));
+        if(!row_wedges)
+        {
+            fprintf(stderr, "Out of memory allocating shadow wedges\n");
+            exit(-1);
+        }
+    }
+
+    for(int i = 0; i < wedge_count; ++i)
+        for(int y = wedges[i].first_row; y <= wedges[i].last_row; ++y)
+            row_wedges[row_fill[y]++] = i;
+
+    #pragma omp parallel
+    {
+        int span_capacity = 1024;
+        ShadowSpan* spans = malloc(span_capacity * sizeof(ShadowSpan));
+        ShadowSpan* sorted = malloc(span_capacity * sizeof(ShadowSpan));
+        ShadowEvent* events = malloc(2 * (span_capacity + SHADOW_MERGED) * sizeof(ShadowEvent));
+        int* pixel_starts = malloc((width + 1) * sizeof(int));
+        /*  The intervals of the light opaque walls hide from each pixel of the row, merged as they are found. Once they hold all of
+            the light the pixel is dark, and the walls behind it are skipped. Walls that do not fit are kept as spans. */
+        double (*merged)[SHADOW_MERGED][2] = malloc(width * sizeof(merged[0]));
+        int* merged_counts = malloc(width * sizeof(int));
+        int* next_lit = malloc((width + 1) * sizeof(int));
+        if(!spans || !sorted || !events || !pixel_starts || !merged || !merged_counts || !next_lit)
+        {
+            fprintf(stderr, "Out of memory allocating shadow spans\n");
+            exit(-1);
+        }
+
+        #pragma omp for schedule(dynamic, 4)
+        for(int y = 0; y < height; ++y)
+        {
+            double py = framebufferPixelCenter(&framebuffer, 0, y).y / monitor_widescreen_compensation;
+            double reach_squared = AREA_LIGHT_REACH * AREA_LIGHT_REACH - (py - c.y) * (py - c.y);
+            double reach_x = sqrt(fmax(reach_squared, 0.0));
+            int span_count = 0;
+
+            memset(merged_counts, 0, width * sizeof(int));
+            for(int x = 0; x <= width; ++x)
+                next_lit[x] = x;
+
+            /* Scan-convert the row's wedges, noting what part of the light each one hides from every pixel it covers */
+            for(int k = row_starts[y]; k < row_starts[y + 1]; ++k)
+            {
+                const ShadowWedge* wedge = &wedges[row_wedges[k]];
+                double min_x = INFINITY, max_x = -INFINITY;
+
+                /* The hull's edges are among the segments between its corners, and all of those lie in it */
+                for(int i = 0; i < 6; ++i)
+                    for(int j = i + 1; j < 6; ++j)
+                    {
+                        Point e0 = wedge->corners[i];
+                        Point e1 = wedge->corners[j];
+
+                        if((e0.y < py && e1.y < py) || (e0.y > py && e1.y > py))
+                            continue;
+
+                        /* A segment along the row covers the row from one of its ends to the other */
+                        double x = e0.y == e1.y ? e0.x : e0.x + (py - e0.y) / (e1.y - e0.y) * (e1.x - e0.x);
+                        double other = e0.y == e1.y ? e1.x : x;
+                        min_x = fmin(min_x, fmin(x, other));
+                        max_x = fmax(max_x, fmax(x, other));
+                    }
+
+                min_x = fmax(min_x, c.x - reach_x);
+                max_x = fmin(max_x, c.x + reach_x);
+                if(reach_squared <= 0.0 || min_x > max_x)
+                    continue;
+
+                int first = (int) fmax(0.0, ceil((min_x + 1.0) * width / 2.0 - 0.5));
+                int last = (int) fmin(width - 1.0, floor((max_x + 1.0) * width / 2.0 - 0.5));
+                if(first > last)
+                    continue;
+
+                for(int x = nextLitPixel(next_lit, first); x <= last; x = nextLitPixel(next_lit, x + 1))
+                {
+                    Point p = {-1.0 + (x + 0.5) * 2.0 / width, py};
+                    double low, high;
+
+                    if(!occludedInterval(wedge->a, wedge->b, c, AREA_LIGHT_SIZE, p, &low, &high) ||
+                       shadowIntervalCovered(merged[x], merged_counts[x], low, high))
+                        continue;
+
+                    if(wedge->opacity >= 1.0f && mergeShadowInterval(merged[x], &merged_counts[x], low, high))
+                    {
+                        if(shadowIntervalCovered(merged[x], merged_counts[x], 0.0, 1.0))
+                            next_lit[x] = x + 1;
+                        continue;
+                    }
+
+                    if(span_count == span_capacity)
+                    {
+                        span_capacity *= 2;
+                        spans = realloc(spans, span_capacity * sizeof(ShadowSpan));
+                        sorted = realloc(sorted, span_capacity * sizeof(ShadowSpan));
+                        events = realloc(events, 2 * (span_capacity + SHADOW_MERGED) * sizeof(ShadowEvent));
+                        if(!spans || !sorted || !events)
+                        {
+                            fprintf(stderr, "Out of memory allocating shadow spans\n");
+                            exit(-1);
+                        }
+                    }
+
+                    spans[span_count++] = (ShadowSpan){x, wedge->opacity, low, high};
+                }
+            }
+
+            /* Group the spans by pixel */
+            memset(pixel_starts, 0, (width + 1) * sizeof(int));
+            for(int i = 0; i < span_count; ++i)
+                ++pixel_starts[spans[i].x + 1];
+            for(int x = 0; x < width; ++x)
+                pixel_starts[x + 1] += pixel_starts[x];
+            for(int i = 0; i < span_count; ++i)
+                sorted[pixel_starts[spans[i].x]++] = spans[i];
+
+            for(int x = 0, start = 0; x < width; ++x)
+            {
+                double dx = framebufferPixelCenter(&framebuffer, x, y).x - c.x;
+                double dy = py - c.y;
+                double brightness = fmax(1.0 - sqrt(dx * dx + dy * dy) / AREA_LIGHT_REACH, 0.0);
+                int end = pixel_starts[x];
+
+                if(next_lit[x] != x)
+                    brightness = 0.0;
+                else if(brightness > 0.0 && end - start + merged_counts[x] > 0)
+                    brightness *= lightTransmission(&sorted[start], end - start, merged[x], merged_counts[x], events);
+                start = end;
+
+                float* out = &framebuffer.pixels[((size_t) y * width + x) * 3];
+                out[0] = out[1] = out[2] = (float) brightness;
+            }
+        }
+
+        free(spans);
+        free(sorted);
+        free(events);
+        free(pixel_starts);
+        free(merged);
+        free(merged_counts);
+        free(next_lit);
+    }
+}
+
+/* A xorshift64* random number generator. Each tile of each pass gets its own stream, so results do not depend on thread scheduling. */
+typedef struct{
+    unsigned long long state;
+} Random;
+
+/* Seed a random stream from two integers */
+Random seedRandom(unsigned long long a, unsigned long long b)
+{
+    /* Mix the seed with splitmix64 so neighbouring tiles get unrelated streams */
+    unsigned long long z = a * 0x9E3779B97F4A7C15ULL + b + 0x632BE59BD9B4E019ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+
+    return (Random){z ? z : 1};
+}
+
+/* Return a uniformly distributed double in [0, 1) */
+double randomUniform(Random* random)
+{
+    random->state ^= random->state >> 12;
+    random->state ^= random->state << 25;
+    random->state ^= random->state >> 27;
+
+    return ((random->state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Return the light arriving at p directly from the point light, through any translucent walls */
+double pathDirectLight(Point p, Point light, long long* rays)
+{
+    ++*rays;
+    double transmittance = segmentTransmittance(p, light);
+    if(transmittance == 0.0)
+        return 0.0;
+
+    double dx = light.x - p.x;
+    double dy = (light.y - p.y) / monitor_widescreen_compensation;
+
+    return transmittance * PATH_LIGHT_INTENSITY / (1.0 + 4.0 * sqrt(dx * dx + dy * dy));
+}
+
+/*  Estimate the light arriving at p from every direction: the point light directly, plus one path of diffuse bounces off the walls.
+    Directions are traced in widescreen compensated space so the result is isotropic on screen. */
+double tracePath(Point p, Point light, Random* random, long long* rays)
+{
+    double radiance = pathDirectLight(p, light, rays);
+
+    /* Light arriving from the walls, sampled uniformly over the circle */
+    double angle = 2.0 * PI * randomUniform(random);
+    Point dir = {cos(angle), sin(angle) * monitor_widescreen_compensation};
+    Point origin = p;
+    double throughput = 2.0 * PI;
+
+    for(int bounce = 0; bounce < PATH_MAX_BOUNCES; ++bounce)
+    {
+        int wall;
+        ++*rays;
+        double t = castRay(origin, dir, &wall);
+        if(t == INFINITY)
+            break;  // The borders absorb all light
+
+        Point hit = {origin.x + t * dir.x, origin.y + t * dir.y};
+
+        /* Mirrors reflect the path without absorbing or scattering any light */
+        if(wall_materials[wall] == MATERIAL_MIRROR)
+        {
+            dir = reflectDirection(dir, &walls[wall]);
+            origin = (Point){hit.x + dir.x * 10e-7, hit.y + dir.y * 10e-7};
+            continue;
+        }
+
+        /* Translucent walls let the path through unchanged with the probability that light passes them */
+        if(wall_materials[wall] == MATERIAL_TRANSLUCENT && randomUniform(random) >= wall_opacity[wall])
+        {
+            origin = (Point){hit.x + dir.x * 10e-7, hit.y + dir.y * 10e-7};
+            continue;
+        }
+
+        /* Face the wall's normal towards the side the ray arrived from */
+        const Line* w = &walls[wall];
+        Point normal = {-(w->point2.y - w->point1.y) / monitor_widescreen_compensation, w->point2.x - w->point1.x};
+        double length = sqrt(normal.x * normal.x + normal.y * normal.y);
+        normal = (Point){normal.x / length, normal.y / length};
+        if(normal.x * dir.x + normal.y * dir.y / monitor_widescreen_compensation > 0.0)
+            normal = (Point){-normal.x, -normal.y};
+
+        /* Leave the wall slightly on the lit side so the next rays do not hit it again */
+        origin = (Point){hit.x + normal.x * 10e-7, hit.y + normal.y * 10e-7 * monitor_widescreen_compensation};
+
+        /* A Lambertian wall reflects albedo / 2 of the irradiance it receives, and the light's irradiance falls off with its cosine */
+        double lx = light.x - origin.x;
+        double ly = (light.y - origin.y) / monitor_widescreen_compensation;
+        double cosine = (normal.x * lx + normal.y * ly) / sqrt(lx * lx + ly * ly);
+        if(cosine > 0.0)
+            radiance += throughput * PATH_WALL_ALBEDO * 0.5 * cosine * pathDirectLight(origin, light, rays);
+
+        /* Cosine weighted sampling of the next direction cancels the cosine and the 1 / 2 of the BRDF against the pdf */
+        throughput *= PATH_WALL_ALBEDO;
+
+        /* Russian roulette once the path has lost most of its energy */
+        if(bounce >= 2)
+        {
+            if(randomUniform(random) > PATH_WALL_ALBEDO)
+                break;
+            throughput /= PATH_WALL_ALBEDO;
+        }
+
+        double sine = 2.0 * randomUniform(random) - 1.0;
+        double cos_out = sqrt(1.0 - sine * sine);
+        Point out = {normal.x * cos_out - normal.y * sine, normal.y * cos_out + normal.x * sine};
+        dir = (Point){out.x, out.y * monitor_widescreen_compensation};
+    }
+
+    return radiance;
+}
+
+/*  Add one path per pixel to the framebuffer, restarting the accumulation if the light moved or a wall changed.
+    Tiles are traced in parallel, each with its own random stream. */
+void renderPathTracing(Point light)
+{
+    initializeFramebuffer(&framebuffer, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT);
+
+    if(path_samples == 0 || light.x != path_light.x || light.y != path_light.y || wall_revision != path_wall_revision)
+    {
+        memset(framebuffer.pixels, 0, (size_t) framebuffer.width * framebuffer.height * 3 * sizeof(float));
+        path_samples = 0;
+        path_light = light;
+        path_wall_revision = wall_revision;
+    }
+
+    int tiles_x = (framebuffer.width + PATH_TILE_SIZE - 1) / PATH_TILE_SIZE;
+    int tiles_y = (framebuffer.height + PATH_TILE_SIZE - 1) / PATH_TILE_SIZE;
+    long long rays = 0;
+    double start = glfwGetTime();
+
+    #pragma omp parallel for schedule(dynamic) reduction(+:rays)
+    for(int tile = 0; tile < tiles_x * tiles_y; ++tile)
+    {
+        Random random = seedRandom(tile, path_samples);
+        int x0 = (tile % tiles_x) * PATH_TILE_SIZE;
+        int y0 = (tile / tiles_x) * PATH_TILE_SIZE;
+
+        for(int y = y0; y < y0 + PATH_TILE_SIZE && y < framebuffer.height; ++y)
+            for(int x = x0; x < x0 + PATH_TILE_SIZE && x < framebuffer.width; ++x)
+            {
+                /* Jitter the sample within the pixel */
+                Point p = {-1.0 + (x + randomUniform(&random)) * 2.0 / framebuffer.width,
+                           -1.0 + (y + randomUniform(&random)) * 2.0 / framebuffer.height};
+                float v = (float) tracePath(p, light, &random, &rays);
+                float* out = &framebuffer.pixels[((size_t) y * framebuffer.width + x) * 3];
+
+                out[0] += v;
+                out[1] += v;
+                out[2] += v;
+            }
+    }
+
+    double elapsed = glfwGetTime() - start;
+    if(elapsed > 0.0)
+        path_rays_per_second = rays / elapsed;
+
+    ++path_samples;
+}
+
+/*  Trace one interval of a cascade probe through the walls and emitters, from t0 to t1 pixels along the unit direction dir.
+    Writes the radiance found (zero if the interval hit a wall or nothing) and returns the interval's transmittance:
+    1 if it hit nothing, so light from further away can pass through, and 0 otherwise. */
+float traceCascadeInterval(Point probe, Point dir, double t0, double t1, const CascadeEmitter* emitters, float radiance[3])
+{
+    Point start_px = {probe.x + t0 * dir.x, probe.y + t0 * dir.y};
+
+    /* Walk the grids in window coordinates, with the ray parameter still measured in pixels */
+    Point start = {-1.0 + start_px.x * 2.0 / framebuffer.width, -1.0 + start_px.y * 2.0 / framebuffer.height};
+    Point step = {dir.x * 2.0 / framebuffer.width, dir.y * 2.0 / framebuffer.height};
+
+    GridWalk walk = beginGridWalk(start, step);
+    double nearest = t1 - t0;
+    int hit_wall = 0, hit_emitter = -1;
+
+    do
+    {
+        const GridCell* cell = &wall_grid[walk.x][walk.y];
+        for(int i = 0; i < cell->count; ++i)
+        {
+            double t = intersectRayWall(start, step, &walls[cell->items[i]]);
+            if(t < nearest)
+            {
+                nearest = t;
+                hit_wall = 1;
+                hit_emitter = -1;
+            }
+        }
+
+        cell = &emitter_grid[walk.x][walk.y];
+        for(int i = 0; i < cell->count; ++i)
+        {
+            /* Ray against the emitter's disc, in pixels where the disc is round */
+            const CascadeEmitter* e = &emitters[cell->items[i]];
+            double ox = start_px.x - e->center.x;
+            double oy = start_px.y - e->center.y;
+            double b = ox * dir.x + oy * dir.y;
+            double c = ox * ox + oy * oy - RC_EMITTER_RADIUS * RC_EMITTER_RADIUS;
+            double discriminant = b * b - c;
+
+            if(discriminant < 0.0)
+                continue;
+
+            double t = c <= 0.0 ? 0.0 : -b - sqrt(discriminant);
+            if(t >= 0.0 && t < nearest)
+            {
+                nearest = t;
+                hit_emitter = cell->items[i];
+            }
+        }
+
+        if(nearest <= walk.t_exit)
+            break;
+    }
+    while(stepGridWalk(&walk));
+
+    if(hit_emitter >= 0)
+    {
+        radiance[0] = emitters[hit_emitter].r * RC_EMITTER_BRIGHTNESS;
+        radiance[1] = emitters[hit_emitter].g * RC_EMITTER_BRIGHTNESS;
+        radiance[2] = emitters[hit_emitter].b * RC_EMITTER_BRIGHTNESS;
+        return 0.0f;
+    }
+
+    radiance[0] = radiance[1] = radiance[2] = 0.0f;
+    return hit_wall ? 0.0f : 1.0f;
+}
+
+/*  Light the scene with radiance cascades into the framebuffer. Each level is traced from the top down, and every interval that
+    reaches its end without hitting anything is continued by the bilinearly interpolated radiance of the four directions that
+    subdivide it in the level above. The cost depends on the framebuffer size, not on the number of lights. */
+void renderRadianceCascades(Point cursor)
+{
+    static float* cascades[RC_LEVELS];
+    static CascadeEmitter* emitters = NULL;
+
+    initializeFramebuffer(&framebuffer, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT);
+
+    /* Rebuild the emitters from the cursor and every light */
+    if(!emitters)
+        emitters = malloc((MAX_LIGHTS + 1) * sizeof(CascadeEmitter));
+    if(!emitters)
+    {
+        fprintf(stderr, "Out of memory allocating emitters\n");
+        exit(-1);
+    }
+
+    int emitter_count = 0;
+    emitters[emitter_count++] = (CascadeEmitter){cursor, 1.0f, 1.0f, 1.0f};
+    for(int i = 0; i < light_count; ++i)
+        emitters[emitter_count++] = (CascadeEmitter){lights[i].position, lights[i].r, lights[i].g, lights[i].b};
+
+    for(int x = 0; x < GRID_SIZE; ++x)
+        for(int y = 0; y < GRID_SIZE; ++y)
+            emitter_grid[x][y].count = 0;
+
+    double reach_x = RC_EMITTER_RADIUS * 2.0 / framebuffer.width;
+    double reach_y = RC_EMITTER_RADIUS * 2.0 / framebuffer.height;
+
+    for(int i = 0; i < emitter_count; ++i)
+    {
+        Point p = emitters[i].center;
+
+        for(int x = gridCoordinate(p.x - reach_x); x <= gridCoordinate(p.x + reach_x); ++x)
+            for(int y = gridCoordinate(p.y - reach_y); y <= gridCoordinate(p.y + reach_y); ++y)
+                gridCellAppend(&emitter_grid[x][y], i);
+
+        emitters[i].center = (Point){(p.x + 1.0) * framebuffer.width / 2.0, (p.y + 1.0) * framebuffer.height / 2.0};
+    }
+
+    for(int level = RC_LEVELS - 1; level >= 0; --level)
+    {
+        int spacing = RC_PROBE_SPACING << level;
+        int probes_x = (framebuffer.width + spacing - 1) / spacing;
+        int probes_y = (framebuffer.height + spacing - 1) / spacing;
+        int directions = 4 << (2 * level);
+        double t0 = RC_INTERVAL * ((1 << (2 * level)) - 1) / 3.0;
+        double t1 = RC_INTERVAL * ((4 << (2 * level)) - 1) / 3.0;
+
+        if(!cascades[level])
+            cascades[level] = malloc((size_t) probes_x * probes_y * directions * 3 * sizeof(float));
+        if(!cascades[level])
+        {
+            fprintf(stderr, "Out of memory allocating radiance cascades\n");
+            exit(-1);
+        }
+
+        /* The level above, which continues the intervals of this one */
+        int upper_spacing = spacing * 2;
+        int upper_x = (framebuffer.width + upper_spacing - 1) / upper_spacing;
+        int upper_y = (framebuffer.height + upper_spacing - 1) / upper_spacing;
+        const float* upper = level + 1 < RC_LEVELS ? cascades[level + 1] : NULL;
+
+        #pragma omp parallel for schedule(dynamic, 8)
+        for(int probe = 0; probe < probes_x * probes_y; ++probe)
+        {
+            Point center = {((probe % probes_x) + 0.5) * spacing, ((probe / probes_x) + 0.5) * spacing};
+            float* out = &cascades[level][(size_t) probe * directions * 3];
+
+            /* The four upper probes around this one and their bilinear weights */
+            int corners[4];
+            float weights[4];
+            if(upper)
+            {
+                double ux = center.x / upper_spacing - 0.5;
+                double uy = center.y / upper_spacing - 0.5;
+                int x0 = (int) floor(ux), y0 = (int) floor(uy);
+                float fx = (float) (ux - x0), fy = (float) (uy - y0);
+
+                for(int i = 0; i < 4; ++i)
+                {
+                    int cx = x0 + (i & 1), cy = y0 + (i >> 1);
+                    cx = cx < 0 ? 0 : cx >= upper_x ? upper_x - 1 : cx;
+                    cy = cy < 0 ? 0 : cy >= upper_y ? upper_y - 1 : cy;
+
+                    corners[i] = cy * upper_x + cx;
+                    weights[i] = ((i & 1) ? fx : 1.0f - fx) * ((i >> 1) ? fy : 1.0f - fy);
+                }
+            }
+
+            for(int d = 0; d < directions; ++d)
+            {
+                double angle = (d + 0.5) * 2.0 * PI / directions;
+                float transmittance = traceCascadeInterval(center, (Point){cos(angle), sin(angle)}, t0, t1, emitters, &out[d * 3]);
+
+                if(!upper || transmittance == 0.0f)
+                    continue;
+
+                /* Average the four upper directions that subdivide this one, interpolated between the upper probes */
+                float merged[3] = {0.0f, 0.0f, 0.0f};
+                for(int i = 0; i < 4; ++i)
+                {
+                    const float* source = &upper[((size_t) corners[i] * directions * 4 + d * 4) * 3];
+                    for(int j = 0; j < 12; ++j)
+                        merged[j % 3] += weights[i] * 0.25f * source[j];
+                }
+
+                for(int c = 0; c < 3; ++c)
+                    out[d * 3 + c] += transmittance * merged[c];
+            }
+        }
+    }
+
+    /* Every pixel receives the average radiance of the level 0 probes around it */
+    int probes_x = (framebuffer.width + RC_PROBE_SPACING - 1) / RC_PROBE_SPACING;
+    int probes_y = (framebuffer.height + RC_PROBE_SPACING - 1) / RC_PROBE_SPACING;
+
+    #pragma omp parallel for
+    for(int y = 0; y < framebuffer.height; ++y)
+        for(int x = 0; x < framebuffer.width; ++x)
+        {
+            double px = (x + 0.5) / RC_PROBE_SPACING - 0.5;
+            double py = (y + 0.5) / RC_PROBE_SPACING - 0.5;
+            int x0 = (int) floor(px), y0 = (int) floor(py);
+            float fx = (float) (px - x0), fy = (float) (py - y0);
+            float* out = &framebuffer.pixels[((size_t) y * framebuffer.width + x) * 3];
+
+            out[0] = out[1] = out[2] = 0.0f;
+
+            for(int i = 0; i < 4; ++i)
+            {
+                int cx = x0 + (i & 1), cy = y0 + (i >> 1);
+                cx = cx < 0 ? 0 : cx >= probes_x ? probes_x - 1 : cx;
+                cy = cy < 0 ? 0 : cy >= probes_y ? probes_y - 1 : cy;
+
+                float weight = ((i & 1) ? fx : 1.0f - fx) * ((i >> 1) ? fy : 1.0f - fy) * 0.25f;
+                const float* source = &cascades[0][(size_t) (cy * probes_x + cx) * 4 * 3];
+                for(int j = 0; j < 12; ++j)
+                    out[j % 3] += weight * source[j];
+            }
+        }
+}
+
+/* Move the player with the WASD keys */
+void updatePlayer(GLFWwindow* window, double dt)
+{
+    Point offset = {0.0, 0.0};
+
+    /* In first person A and D turn the player, and W and S move it along its heading */
+    if(render_mode == MODE_FIRST_PERSON)
+    {
+        double forward = 0.0;
+
+        if(inputKeyDown(GLFW_KEY_A))
+            player_heading += PLAYER_TURN_SPEED * dt;
+        if(inputKeyDown(GLFW_KEY_D))
+            player_heading -= PLAYER_TURN_SPEED * dt;
+        if(inputKeyDown(GLFW_KEY_W))
+            forward += 1.0;
+        if(inputKeyDown(GLFW_KEY_S))
+            forward -= 1.0;
+
+        offset = (Point){forward * cos(player_heading), forward * sin(player_heading)};
+    }
+    else
+    {
+        if(inputKeyDown(GLFW_KEY_W))
+            offset.y += 1.0;
+        if(inputKeyDown(GLFW_KEY_S))
+            offset.y -= 1.0;
+        if(inputKeyDown(GLFW_KEY_A))
+            offset.x -= 1.0;
+        if(inputKeyDown(GLFW_KEY_D))
+            offset.x += 1.0;
+    }
+
+    if(offset.x == 0.0 && offset.y == 0.0)
+        return;
+
+    player_active = 1;
+    offset = (Point){offset.x * PLAYER_SPEED * dt, offset.y * PLAYER_SPEED * dt * monitor_widescreen_compensation};
+    player_position = moveCircle(player_position, offset, PLAYER_RADIUS);
+
+    /* Keep the player inside the window */
+    player_position.x = fmax(-1.0, fmin(1.0, player_position.x));
+    player_position.y = fmax(-1.0, fmin(1.0, player_position.y));
+}
+
+/* Add agents at random positions with random velocities */
+void spawnAgents(int count)
+{
+    if(!agent_positions)
+    {
+        agent_positions = malloc(MAX_AGENTS * sizeof(Point));
+        agent_velocities = malloc(MAX_AGENTS * sizeof(Point));
+        if(!agent_positions || !agent_velocities)
+        {
+            fprintf(stderr, "Out of memory allocating agents\n");
+            exit(-1);
+        }
+    }
+
+    for(int i = 0; i < count && agent_count < MAX_AGENTS; ++i)
+    {
+        double angle = randomRange(0.0, 2.0 * PI);
+        agent_positions[agent_count] = (Point){randomRange(-1.0, 1.0), randomRange(-1.0, 1.0)};
+        agent_velocities[agent_count++] = (Point){0.2 * cos(angle), 0.2 * sin(angle) * monitor_widescreen_compensation};
+    }
+}
+
+/* Move every agent for one tick with one batch of swept circle queries, bouncing them off the walls they touch */
+void updateAgents(double dt)
+{
+    static SweepQuery* queries = NULL;
+    static SweepHit* hits = NULL;
+
+    if(agent_count == 0)
+        return;
+
+    if(!queries)
+    {
+        queries = malloc(MAX_AGENTS * sizeof(SweepQuery));
+        hits = malloc(MAX_AGENTS * sizeof(SweepHit));
+        if(!queries || !hits)
+        {
+            fprintf(stderr, "Out of memory allocating agent queries\n");
+            exit(-1);
+        }
+    }
+
+    for(int i = 0; i < agent_count; ++i)
+    {
+        Point p = agent_positions[i];
+        Point v = agent_velocities[i];
+        queries[i] = (SweepQuery){p, {p.x + v.x * dt, p.y + v.y * dt}, AGENT_RADIUS};
+    }
+
+    sweepCircleBatch(queries, hits, agent_count);
+
+    for(int i = 0; i < agent_count; ++i)
+    {
+        Point move = {queries[i].to.x - queries[i].from.x, queries[i].to.y - queries[i].from.y};
+        double t = hits[i].wall < 0 ? 1.0 : fmax(hits[i].t - 10e-6, 0.0);
+        Point p = {queries[i].from.x + t * move.x, queries[i].from.y + t * move.y};
+        Point v = agent_velocities[i];
+
+        if(hits[i].wall >= 0)
+        {
+            /* Reflect the velocity about the contact normal, in compensated coordinates */
+            Point n = hits[i].normal;
+            double vy = v.y / monitor_widescreen_compensation;
+            double into = v.x * n.x + vy * n.y;
+            v = (Point){v.x - 2.0 * into * n.x, (vy - 2.0 * into * n.y) * monitor_widescreen_compensation};
+        }
+
+        /* The edges of the window bounce agents too */
+        if(fabs(p.x) > 1.0)
+        {
+            p.x = copysign(1.0, p.x);
+            v.x = -v.x;
+        }
+        if(fabs(p.y) > 1.0)
+        {
+            p.y = copysign(1.0, p.y);
+            v.y = -v.y;
+        }
+
+        agent_positions[i] = p;
+        agent_velocities[i] = v;
+    }
+}
+
+/* Draw the player as a circle and the agents as points */
+void drawBodies(void)
+{
+    if(player_active)
+    {
+        glColor3f(1.0f, 0.9f, 0.2f);
+        glLineWidth(2.0f);
+        glBegin(GL_LINE_LOOP);
+        for(int i = 0; i < 32; ++i)
+            glVertex2d(player_position.x + PLAYER_RADIUS * cos(i * PI / 16.0),
+                       player_position.y + PLAYER_RADIUS * monitor_widescreen_compensation * sin(i * PI / 16.0));
+        glEnd();
+    }
+
+    if(agent_count)
+    {
+        glColor3f(1.0f, 0.4f, 0.2f);
+        glPointSize(3.0f);
+        glBegin(GL_POINTS);
+        for(int i = 0; i < agent_count; ++i)
+            glVertex2d(agent_positions[i].x, agent_positions[i].y);
+        glEnd();
+    }
+}
+
+/* Load the OpenGL buffer functions if the driver has them. Returns 0 if vertex buffers are not available. */
+int loadBufferFunctions(void)
+{
+    glGenBuffersPtr = (PFNGLGENBUFFERSPROC) glfwGetProcAddress("glGenBuffers");
+    glBindBufferPtr = (PFNGLBINDBUFFERPROC) glfwGetProcAddress("glBindBuffer");
+    glBufferDataPtr = (PFNGLBUFFERDATAPROC) glfwGetProcAddress("glBufferData");
+    glBufferSubDataPtr = (PFNGLBUFFERSUBDATAPROC) glfwGetProcAddress("glBufferSubData");
+
+    return glGenBuffersPtr && glBindBufferPtr && glBufferDataPtr && glBufferSubDataPtr;
+}
+
+/* Allocate one set of particle arrays */
+void allocateParticleArrays(ParticleArrays* arrays)
+{
+    arrays->x = malloc(MAX_PARTICLES * sizeof(float));
+    arrays->y = malloc(MAX_PARTICLES * sizeof(float));
+    arrays->vx = malloc(MAX_PARTICLES * sizeof(float));
+    arrays->vy = malloc(MAX_PARTICLES * sizeof(float));
+    if(!arrays->x || !arrays->y || !arrays->vx || !arrays->vy)
+    {
+        fprintf(stderr, "Out of memory allocating particles\n");
+        exit(-1);
+    }
+}
+
+/* Fill the scene with particles spraying out of the given point */
+void spawnParticles(Point origin, int count)
+{
+    if(!particles.x)
+    {
+        allocateParticleArrays(&particles);
+        allocateParticleArrays(&particles_sorted);
+    }
+
+    particle_count = count < MAX_PARTICLES ? count : MAX_PARTICLES;
+
+    for(int i = 0; i < particle_count; ++i)
+    {
+        double angle = randomRange(0.0, 2.0 * PI);
+        double speed = randomRange(0.05, 0.4);
+
+        particles.x[i] = (float) origin.x;
+        particles.y[i] = (float) origin.y;
+        particles.vx[i] = (float) (speed * cos(angle));
+        particles.vy[i] = (float) (speed * sin(angle) * monitor_widescreen_compensation);
+    }
+}
+
+/*  Advance every particle by one tick, reflecting the ones whose step crosses a wall.
+    The particles are first counting-sorted by the grid cell they start in. Each cell then tests its walls against all of its
+    particles at once, in a branchless loop over contiguous floats the compiler vectorizes. Cells are independent and run in
+    parallel. The few particles whose step ends in another cell also test that cell's walls afterwards. */
+void updateParticles(double dt)
+{
+    static int* cell_start = NULL;
+    static int* cell_of = NULL;
+    static float* nearest_t = NULL;
+    static int* nearest_wall = NULL;
+
+    const int cells = GRID_SIZE * GRID_SIZE;
+
+    if(particle_count == 0)
+        return;
+
+    /* Long frames would send particles far in one jump, and make each step walk through many cells */
+    if(dt > 0.05)
+        dt = 0.05;
+
+    if(!cell_start)
+    {
+        cell_start = malloc((cells + 1) * sizeof(int));
+        cell_of = malloc(MAX_PARTICLES * sizeof(int));
+        nearest_t = malloc(MAX_PARTICLES * sizeof(float));
+        nearest_wall = malloc(MAX_PARTICLES * sizeof(int));
+        if(!cell_start || !cell_of || !nearest_t || !nearest_wall)
+        {
+            fprintf(stderr, "Out of memory allocating particle buffers\n");
+            exit(-1);
+        }
+    }
+
+    /* Counting sort by starting cell */
+    memset(cell_start, 0, (cells + 1) * sizeof(int));
+
+    #pragma omp parallel for
+    for(int i = 0; i < particle_count; ++i)
+        cell_of[i] = gridCoordinate(particles.x[i]) * GRID_SIZE + gridCoordinate(particles.y[i]);
+
+    for(int i = 0; i < particle_count; ++i)
+        ++cell_start[cell_of[i] + 1];
+    for(int c = 0; c < cells; ++c)
+        cell_start[c + 1] += cell_start[c];
+
+    for(int i = 0; i < particle_count; ++i)
+    {
+        int j = cell_start[cell_of[i]]++;
+        particles_sorted.x[j] = particles.x[i];
+        particles_sorted.y[j] = particles.y[i];
+        particles_sorted.vx[j] = particles.vx[i];
+        particles_sorted.vy[j] = particles.vy[i];
+    }
+
+    /* The scatter advanced every start to the next cell's, so shift them back */
+    for(int c = cells; c > 0; --c)
+        cell_start[c] = cell_start[c - 1];
+    cell_start[0] = 0;
+
+    ParticleArrays swap = particles;
+    particles = particles_sorted;
+    particles_sorted = swap;
+
+    const float step = (float) dt;
+    float* restrict px = particles.x;
+    float* restrict py = particles.y;
+    float* restrict pvx = particles.vx;
+    float* restrict pvy = particles.vy;
+    float* restrict best_t = nearest_t;
+    int* restrict best_wall = nearest_wall;
+
+    #pragma omp parallel for schedule(dynamic, 4)
+    for(int c = 0; c < cells; ++c)
+    {
+        int begin = cell_start[c], end = cell_start[c + 1];
+        const GridCell* cell = &wall_grid[c / GRID_SIZE][c % GRID_SIZE];
+
+        for(int i = begin; i < end; ++i)
+        {
+            best_t[i] = 2.0f;
+            best_wall[i] = -1;
+        }
+
+        for(int k = 0; k < cell->count; ++k)
+        {
+            const Line* w = &walls[cell->items[k]];
+            const float ax = (float) w->point1.x, ay = (float) w->point1.y;
+            const float ex = (float) (w->point2.x - w->point1.x), ey = (float) (w->point2.y - w->point1.y);
+            const int index = cell->items[k];
+
+            #pragma omp simd
+            for(int i = begin; i < end; ++i)
+            {
+                float dx = pvx[i] * step, dy = pvy[i] * step;
+                float ox = ax - px[i], oy = ay - py[i];
+                float denominator = dx * ey - dy * ex;
+                float t = (ox * ey - oy * ex) / denominator;
+                float u = (ox * dy - oy * dx) / denominator;
+                int crosses = t >= 0.0f && t <= 1.0f && u >= -10e-5f && u <= 1.0f + 10e-5f && t < best_t[i];
+
+                best_t[i] = crosses ? t : best_t[i];
+                best_wall[i] = crosses ? index : best_wall[i];
+            }
+        }
+    }
+
+    #pragma omp parallel for schedule(static, 4096)
+    for(int i = 0; i < particle_count; ++i)
+    {
+        float dx = pvx[i] * step, dy = pvy[i] * step;
+        Point origin = {px[i], py[i]}, dir = {dx, dy};
+        GridWalk walk = beginGridWalk(origin, dir);
+
+        /*  The pass above only checked the cell the step starts in. Walk the others it crosses until it ends, or until the nearest
+            wall found lies before the step leaves the cell it is in. */
+        while(walk.t_exit <= 1.0 && best_t[i] > walk.t_exit && stepGridWalk(&walk))
+        {
+            const GridCell* cell = &wall_grid[walk.x][walk.y];
+
+            for(int k = 0; k < cell->count; ++k)
+            {
+                double t = intersectRayWall(origin, dir, &walls[cell->items[k]]);
+                if(t <= 1.0 && t < best_t[i])
+                {
+                    best_t[i] = (float) t;
+                    best_wall[i] = cell->items[k];
+                }
+            }
+        }
+
+        if(best_wall[i] < 0)
+        {
+            px[i] += dx;
+            py[i] += dy;
+        }
+        else
+        {
+            /* Stop just short of the wall on the path the particle came along, and reflect the velocity in compensated coordinates */
+            const Line* w = &walls[best_wall[i]];
+            float ex = (float) (w->point2.x - w->point1.x);
+            float ey = (float) ((w->point2.y - w->point1.y) / monitor_widescreen_compensation);
+            float vy = pvy[i] / (float) monitor_widescreen_compensation;
+            float scale = 2.0f * (pvx[i] * ex + vy * ey) / (ex * ex + ey * ey);
+
+            float t = fmaxf(best_t[i] - 10e-6f / sqrtf(dx * dx + dy * dy), 0.0f);
+
+            px[i] += t * dx;
+            py[i] += t * dy;
+            pvx[i] = scale * ex - pvx[i];
+            pvy[i] = (scale * ey - vy) * (float) monitor_widescreen_compensation;
+        }
+
+        /* The edges of the window bounce particles too */
+        if(fabsf(px[i]) > 1.0f)
+        {
+            px[i] = copysignf(1.0f, px[i]);
+            pvx[i] = -pvx[i];
+        }
+        if(fabsf(py[i]) > 1.0f)
+        {
+            py[i] = copysignf(1.0f, py[i]);
+            pvy[i] = -pvy[i];
+        }
+    }
+}
+
+/*  Draw the particles as points. Their positions are interleaved into a vertex buffer that is orphaned and refilled every frame,
+    or drawn straight from client memory if the driver has no vertex buffers. */
+void drawParticles(void)
+{
+    static float* vertices = NULL;
+    static GLuint buffer = 0;
+    static int buffers_checked = 0, buffers_available = 0;
+
+    if(particle_count == 0)
+        return;
+
+    if(!buffers_checked)
+    {
+        buffers_available = loadBufferFunctions();
+        buffers_checked = 1;
+
+        vertices = malloc(MAX_PARTICLES * 2 * sizeof(float));
+        if(!vertices)
+        {
+            fprintf(stderr, "Out of memory allocating particle vertices\n");
+            exit(-1);
+        }
+
+        if(buffers_available)
+            glGenBuffersPtr(1, &buffer);
+    }
+
+    #pragma omp parallel for schedule(static, 4096)
+    for(int i = 0; i < particle_count; ++i)
+    {
+        vertices[2 * i] = particles.x[i];
+        vertices[2 * i + 1] = particles.y[i];
+    }
+
+    size_t size = (size_t) particle_count * 2 * sizeof(float);
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+
+    if(buffers_available)
+    {
+        glBindBufferPtr(GL_ARRAY_BUFFER, buffer);
+        glBufferDataPtr(GL_ARRAY_BUFFER, MAX_PARTICLES * 2 * sizeof(float), NULL, GL_STREAM_DRAW);
+        glBufferSubDataPtr(GL_ARRAY_BUFFER, 0, size, vertices);
+        glVertexPointer(2, GL_FLOAT, 0, NULL);
+    }
+    else
+        glVertexPointer(2, GL_FLOAT, 0, vertices);
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glColor3f(0.15f, 0.3f, 0.6f);
+    glPointSize(1.0f);
+    glDrawArrays(GL_POINTS, 0, particle_count);
+    glDisable(GL_BLEND);
+
+    if(buffers_available)
+        glBindBufferPtr(GL_ARRAY_BUFFER, 0);
+
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+/* Allocate the fog of war, with every tile unexplored */
+void allocateFog(void)
+{
+    fog_units = calloc(FOG_MAX_UNITS, sizeof(FogUnit));
+    fog_blocked = calloc(FOG_SIZE * FOG_SIZE / 64, sizeof(uint64_t));
+    fog_visible = calloc(FOG_SIZE * FOG_SIZE / 64, sizeof(uint64_t));
+    fog_explored = calloc(FOG_SIZE * FOG_SIZE / 64, sizeof(uint64_t));
+    fog_counts = calloc(FOG_SIZE * FOG_SIZE, sizeof(unsigned short));
+    fog_texels = malloc(FOG_SIZE * FOG_SIZE);
+    if(!fog_units || !fog_blocked || !fog_visible || !fog_explored || !fog_counts || !fog_texels)
+    {
+        fprintf(stderr, "Out of memory allocating the fog of war\n");
+        exit(-1);
+    }
+
+    for(int i = 0; i < FOG_MAX_UNITS; ++i)
+    {
+        fog_units[i].visible = malloc(2 * FOG_WINDOW_WORDS * sizeof(uint64_t));
+        if(!fog_units[i].visible)
+        {
+            fprintf(stderr, "Out of memory allocating the fog of war\n");
+            exit(-1);
+        }
+        fog_units[i].next = fog_units[i].visible + FOG_WINDOW_WORDS;
+    }
+
+    for(int dy = 0; dy <= FOG_SIGHT_RADIUS_Y; ++dy)
+    {
+        double f = (double) dy / FOG_SIGHT_RADIUS_Y;
+        fog_sight_extent[dy] = (int) floor(FOG_SIGHT_RADIUS * sqrt(1.0 - f * f));
+    }
+}
+
+/* Return the fog tile coordinate of a window coordinate, which may lie outside the grid */
+int fogTile(double coord)
+{
+    return (int) floor((coord + 1.0) * 0.5 * FOG_SIZE);
+}
+
+/* Return 1 if a tile is blocked by a wall. Everything outside the grid is blocked. */
+int fogBlocked(int x, int y)
+{
+    if(x < 0 || y < 0 || x >= FOG_SIZE || y >= FOG_SIZE)
+        return 1;
+
+    int i = y * FOG_SIZE + x;
+    return (int) ((fog_blocked[i / 64] >> (i % 64)) & 1);
+}
+
+/* Mark every tile a wall passes through as blocked, by stepping along the walls in half-tile increments */
+void rasterizeFogWalls(void)
+{
+    memset(fog_blocked, 0, FOG_SIZE * FOG_SIZE / 64 * sizeof(uint64_t));
+
+    for(int w = 0; w < wall_count; ++w)
+    {
+        Point a = walls[w].point1, b = walls[w].point2;
+        double length = fmax(fabs(b.x - a.x), fabs(b.y - a.y)) * 0.5 * FOG_SIZE;
+        int steps = (int) ceil(2.0 * length) + 1;
+
+        for(int s = 0; s <= steps; ++s)
+        {
+            double t = (double) s / steps;
+            int x = fogTile(a.x + t * (b.x - a.x)), y = fogTile(a.y + t * (b.y - a.y));
+
+            if(x >= 0 && y >= 0 && x < FOG_SIZE && y < FOG_SIZE)
+                fog_blocked[(y * FOG_SIZE + x) / 64] |= (uint64_t) 1 << ((y * FOG_SIZE + x) % 64);
+        }
+    }
+}
+
+/* One quadrant of a unit's shadowcast: rows run away from the unit's tile along depth, and across it along col */
+typedef struct{
+    int x, y;
+    int quadrant;   // 0 to 3 for up, down, right and left
+    uint64_t* visible;
+} FogScan;
+
+/* Mark a tile, given relative to the scanning unit, as visible if it lies within the unit's sight radius */
+void revealFogTile(const FogScan* scan, int dx, int dy)
+{
+    if(abs(dy) > FOG_SIGHT_RADIUS_Y || abs(dx) > fog_sight_extent[abs(dy)])
+        return;
+
+    int x = dx + FOG_SIGHT_RADIUS;
+    scan->visible[(dy + FOG_SIGHT_RADIUS_Y) * FOG_WINDOW_ROW_WORDS + x / 64] |= (uint64_t) 1 << (x % 64);
+}
+
+/*  Scan one row of a quadrant between two slopes, and recurse into the next row for every run of open tiles (symmetric
+    shadowcasting). Walls are revealed wherever they are in view, and open tiles only where their center is, which makes the
+    result symmetric: a unit sees a tile exactly when a unit on that tile would see it. */
+void scanFogRow(const FogScan* scan, int depth, double start, double end)
+{
+    int max_depth = scan->quadrant < 2 ? FOG_SIGHT_RADIUS_Y : FOG_SIGHT_RADIUS;
+    if(depth > max_depth)
+        return;
+
+    int min_col = (int) floor(depth * start + 0.5);
+    int max_col = (int) ceil(depth * end - 0.5);
+    int previous = -1;  // Whether the previous tile in the row was a wall, -1 at the start of the row
+
+    for(int col = min_col; col <= max_col; ++col)
+    {
+        int dx = scan->quadrant < 2 ? col : scan->quadrant == 2 ? depth : -depth;
+        int dy = scan->quadrant < 2 ? (scan->quadrant == 0 ? depth : -depth) : col;
+        int wall = fogBlocked(scan->x + dx, scan->y + dy);
+
+        if(wall || (col >= depth * start && col <= depth * end))
+            revealFogTile(scan, dx, dy);
+
+        if(previous == 1 && !wall)
+            start = (2.0 * col - 1.0) / (2.0 * depth);
+        if(previous == 0 && wall)
+            scanFogRow(scan, depth + 1, start, (2.0 * col - 1.0) / (2.0 * depth));
+
+        previous = wall;
+    }
+
+    if(previous == 0)
+        scanFogRow(scan, depth + 1, start, end);
+}
+
+/*  Return 64 bits of a row of a unit's visibility starting at the given bit, which may lie outside the row. Bits outside the
+    row are clear. */
+uint64_t fogRowBits(const uint64_t* row, int bit)
+{
+    int word = bit >= 0 ? bit / 64 : -((63 - bit) / 64);
+    int shift = bit - word * 64;
+    uint64_t low = word >= 0 && word < FOG_WINDOW_ROW_WORDS ? row[word] : 0;
+    uint64_t high = word + 1 >= 0 && word + 1 < FOG_WINDOW_ROW_WORDS ? row[word + 1] : 0;
+
+    return shift ? (low >> shift) | (high << (64 - shift)) : low;
+}
+
+/*  Replace a unit's old visibility around tile (ox, oy) with its new visibility around (nx, ny) in the tile counts of rows
+    row_begin to row_end - 1, updating the bitmaps where a tile gains its first or loses its last viewer. Either visibility may be
+    NULL. The two are compared a row at a time in the window coordinates they share, so a unit that moved a tile or two only
+    touches the tiles that changed. */
+void updateFogCounts(const uint64_t* old, int ox, int oy, const uint64_t* new, int nx, int ny, int row_begin, int row_end)
+{
+    if(old && new && (abs(nx - ox) >= FOG_WINDOW_WIDTH || abs(ny - oy) >= FOG_WINDOW_HEIGHT))
+    {
+        /* No overlap: remove one and add the other */
+        updateFogCounts(old, ox, oy, NULL, 0, 0, row_begin, row_end);
+        updateFogCounts(NULL, 0, 0, new, nx, ny, row_begin, row_end);
+        return;
+    }
+
+    int left = (old && new ? (ox < nx ? ox : nx) : old ? ox : nx) - FOG_SIGHT_RADIUS;
+    int right = (old && new ? (ox > nx ? ox : nx) : old ? ox : nx) + FOG_SIGHT_RADIUS;
+    int bottom = (old && new ? (oy < ny ? oy : ny) : old ? oy : ny) - FOG_SIGHT_RADIUS_Y;
+    int top = (old && new ? (oy > ny ? oy : ny) : old ? oy : ny) + FOG_SIGHT_RADIUS_Y;
+    int words = (right - left + 64) / 64;
+
+    for(int y = bottom > row_begin ? bottom : row_begin; y <= top && y < row_end; ++y)
+    {
+        int old_row = old ? y - (oy - FOG_SIGHT_RADIUS_Y) : -1;
+        int new_row = new ? y - (ny - FOG_SIGHT_RADIUS_Y) : -1;
+        int changed = 0;
+
+        for(int word = 0; word < words; ++word)
+        {
+            int x0 = left + word * 64;
+            uint64_t before = old_row >= 0 && old_row < FOG_WINDOW_HEIGHT ? fogRowBits(&old[old_row * FOG_WINDOW_ROW_WORDS], x0 - (ox - FOG_SIGHT_RADIUS)) : 0;
+            uint64_t after = new_row >= 0 && new_row < FOG_WINDOW_HEIGHT ? fogRowBits(&new[new_row * FOG_WINDOW_ROW_WORDS], x0 - (nx - FOG_SIGHT_RADIUS)) : 0;
+
+            for(uint64_t bits = before ^ after; bits; bits &= bits - 1)
+            {
+                int b = __builtin_ctzll(bits);
+                int x = x0 + b;
+
+                if(x < 0 || x >= FOG_SIZE)
+                    continue;
+
+                int i = y * FOG_SIZE + x;
+                uint64_t bit = (uint64_t) 1 << (i % 64);
+
+                if((after >> b) & 1)
+                {
+                    if(fog_counts[i]++ == 0)
+                    {
+                        fog_visible[i / 64] |= bit;
+                        fog_explored[i / 64] |= bit;
+                        changed = 1;
+                    }
+                }
+                else if(--fog_counts[i] == 0)
+                {
+                    fog_visible[i / 64] &= ~bit;
+                    changed = 1;
+                }
+            }
+        }
+
+        if(changed)
+            fog_dirty_rows[y] = 1;
+    }
+}
+
+/*  Recompute the visibility of every unit that moved to another tile since the last update, in parallel, then swap it into the
+    tile counts. Changing the walls recomputes every unit. */
+void updateFog(void)
+{
+    if(!fog_units)
+        allocateFog();
+
+    int invalidate = fog_wall_revision != wall_revision;
+    if(invalidate)
+    {
+        rasterizeFogWalls();
+        fog_wall_revision = wall_revision;
+    }
+
+    /* The player is the first unit once it is in play, followed by as many agents as there is room for */
+    int unit_count = player_active + (agent_count < FOG_MAX_UNITS - player_active ? agent_count : FOG_MAX_UNITS - player_active);
+
+    #pragma omp parallel for schedule(dynamic, 8)
+    for(int i = 0; i < unit_count; ++i)
+    {
+        FogUnit* unit = &fog_units[i];
+        Point p = player_active && i == 0 ? player_position : agent_positions[i - player_active];
+        int x = fogTile(p.x), y = fogTile(p.y);
+
+        unit->next_x = x;
+        unit->next_y = y;
+        unit->moved = invalidate || !unit->valid || x != unit->x || y != unit->y;
+        if(!unit->moved)
+            continue;
+
+        memset(unit->next, 0, FOG_WINDOW_WORDS * sizeof(uint64_t));
+        if(!fogBlocked(x, y))
+        {
+            for(int quadrant = 0; quadrant < 4; ++quadrant)
+            {
+                FogScan scan = {x, y, quadrant, unit->next};
+                scanFogRow(&scan, 1, -1.0, 1.0);
+            }
+            revealFogTile(&(FogScan){x, y, 0, unit->next}, 0, 0);
+        }
+    }
+
+    /* Every thread owns a band of rows, so the counts can be updated without atomics */
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int band = 0; band < FOG_SIZE; band += FOG_BAND)
+        for(int i = 0; i < FOG_MAX_UNITS; ++i)
+        {
+            const FogUnit* unit = &fog_units[i];
+
+            /* A unit past the count has gone, e.g. because the agents were cleared */
+            if(i >= unit_count && unit->valid)
+                updateFogCounts(unit->visible, unit->x, unit->y, NULL, 0, 0, band, band + FOG_BAND);
+            else if(i < unit_count && unit->moved)
+                updateFogCounts(unit->valid ? unit->visible : NULL, unit->x, unit->y, unit->next, unit->next_x, unit->next_y, band, band + FOG_BAND);
+        }
+
+    fog_recomputed = 0;
+    for(int i = 0; i < FOG_MAX_UNITS; ++i)
+    {
+        FogUnit* unit = &fog_units[i];
+
+        if(i >= unit_count)
+        {
+            unit->valid = 0;
+            continue;
+        }
+
+        if(!unit->moved)
+            continue;
+
+        uint64_t* swap = unit->visible;
+        unit->visible = unit->next;
+        unit->next = swap;
+        unit->x = unit->next_x;
+        unit->y = unit->next_y;
+        unit->valid = 1;
+        ++fog_recomputed;
+    }
+}
+
+/*  Draw the fog over the window: black where no unit has ever looked, darkened where units have looked before, and clear where
+    they are looking now. Only the rows that changed since the last frame are unpacked and uploaded. */
+void drawFog(void)
+{
+    glEnable(GL_TEXTURE_2D);
+
+    if(!fog_texture)
+    {
+        glGenTextures(1, &fog_texture);
+        glBindTexture(GL_TEXTURE_2D, fog_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, FOG_SIZE, FOG_SIZE, 0, GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
+        memset(fog_dirty_rows, 1, FOG_SIZE);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, fog_texture);
+
+    int dirty_min = 0, dirty_max = FOG_SIZE - 1;
+    while(dirty_min < FOG_SIZE && !fog_dirty_rows[dirty_min])
+        ++dirty_min;
+    while(dirty_max >= dirty_min && !fog_dirty_rows[dirty_max])
+        --dirty_max;
+
+    if(dirty_min <= dirty_max)
+    {
+        #pragma omp parallel for schedule(static)
+        for(int y = dirty_min; y <= dirty_max; ++y)
+            for(int x = 0; x < FOG_SIZE; ++x)
+            {
+                int i = y * FOG_SIZE + x;
+                uint64_t bit = (uint64_t) 1 << (i % 64);
+
+                fog_texels[i] = (fog_visible[i / 64] & bit) ? 0 : (fog_explored[i / 64] & bit) ? 160 : 255;
+            }
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, dirty_min, FOG_SIZE, dirty_max - dirty_min + 1, GL_ALPHA, GL_UNSIGNED_BYTE,
+                        fog_texels + (size_t) dirty_min * FOG_SIZE);
+
+        memset(fog_dirty_rows + dirty_min, 0, dirty_max - dirty_min + 1);
+    }
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glColor4f(0.0f, 0.0f, 0.0f, 1.0f);
+
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, -1.0f);
+    glTexCoord2f(1.0f, 0.0f); glVertex2f( 1.0f, -1.0f);
+    glTexCoord2f(1.0f, 1.0f); glVertex2f( 1.0f,  1.0f);
+    glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f,  1.0f);
+    glEnd();
+
+    glDisable(GL_BLEND);
+    glDisable(GL_TEXTURE_2D);
+}
+
+/* Return the texel index of the first texel of a mip level within one wall texture */
+int wallTextureLevelOffset(int level)
+{
+    int offset = 0;
+
+    for(int l = 0; l < level; ++l)
+        offset += (WALL_TEXTURE_SIZE >> l) * (WALL_TEXTURE_SIZE >> l);
+
+    return offset;
+}
+
+/* Return a pseudo-random value from 0 to 1 for an integer position, for procedural textures */
+float textureNoise(int x, int y, int seed)
+{
+    unsigned int h = (unsigned int) x * 374761393u + (unsigned int) y * 668265263u + (unsigned int) seed * 2246822519u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+
+    return (float) ((h ^ (h >> 16)) & 0xffff) / 65535.0f;
+}
+
+/*  Fill the wall texture atlas: bricks and stone blocks for opaque walls, brushed metal for mirrors and framed glass for
+    translucent walls, each followed by its mip levels. Every level is box filtered from the one above it. */
+void generateWallTextures(void)
+{
+    for(int k = 0; k < WALL_TEXTURE_COUNT; ++k)
+    {
+        float* texture = &wall_atlas[(size_t) k * WALL_TEXTURE_TEXELS * 3];
+
+        for(int u = 0; u < WALL_TEXTURE_SIZE; ++u)
+            for(int v = 0; v < WALL_TEXTURE_SIZE; ++v)
+            {
+                float* texel = &texture[(u * WALL_TEXTURE_SIZE + v) * 3];
+                float n = textureNoise(u, v, k);
+                float r, g, b;
+
+                if(k == WALL_TEXTURE_BRICK)
+                {
+                    int row = v / 16, offset = (row % 2) * 16;
+                    int mortar = v % 16 < 2 || (u + offset) % 32 < 2;
+                    float shade = 0.8f + 0.2f * textureNoise((u + offset) / 32, row, k);
+
+                    r = mortar ? 0.75f : shade * (0.65f + 0.1f * n);
+                    g = mortar ? 0.72f : shade * (0.30f + 0.05f * n);
+                    b = mortar ? 0.68f : shade * (0.22f + 0.05f * n);
+                }
+                else if(k == WALL_TEXTURE_STONE)
+                {
+                    int joint = u % 32 < 1 || v % 32 < 1;
+                    float block = 0.6f + 0.3f * textureNoise(u / 32, v / 32, k);
+
+                    r = g = b = joint ? 0.3f : block * (0.85f + 0.15f * n);
+                    b *= 1.05f;
+                }
+                else if(k == WALL_TEXTURE_METAL)
+                {
+                    float brushed = 0.85f + 0.15f * textureNoise(0, v, k);
+
+                    r = 0.5f * brushed;
+                    g = 0.8f * brushed;
+                    b = 1.0f * brushed;
+                }
+                else
+                {
+                    int frame = u < 4 || u >= WALL_TEXTURE_SIZE - 4 || v < 4 || v >= WALL_TEXTURE_SIZE - 4;
+
+                    r = frame ? 0.25f : 0.4f + 0.1f * (u + v) / (2.0f * WALL_TEXTURE_SIZE);
+                    g = frame ? 0.45f : 0.9f;
+                    b = frame ? 0.30f : 0.5f + 0.05f * n;
+                }
+
+                texel[0] = r;
+                texel[1] = g;
+                texel[2] = b;
+            }
+
+        for(int level = 1; level < WALL_TEXTURE_LEVELS; ++level)
+        {
+            int size = WALL_TEXTURE_SIZE >> level;
+            const float* above = &texture[wallTextureLevelOffset(level - 1) * 3];
+            float* below = &texture[wallTextureLevelOffset(level) * 3];
+
+            for(int u = 0; u < size; ++u)
+                for(int v = 0; v < size; ++v)
+                    for(int c = 0; c < 3; ++c)
+                        below[(u * size + v) * 3 + c] = 0.25f * (above[((2 * u) * 2 * size + 2 * v) * 3 + c] +
+                                                                 above[((2 * u) * 2 * size + 2 * v + 1) * 3 + c] +
+                                                                 above[((2 * u + 1) * 2 * size + 2 * v) * 3 + c] +
+                                                                 above[((2 * u + 1) * 2 * size + 2 * v + 1) * 3 + c]);
+        }
+    }
+}
+
+/* Return the texture a wall is drawn with in first person */
+int wallTexture(int wall)
+{
+    if(wall_materials[wall] == MATERIAL_MIRROR)
+        return WALL_TEXTURE_METAL;
+    if(wall_materials[wall] == MATERIAL_TRANSLUCENT)
+        return WALL_TEXTURE_GLASS;
+
+    return wall_textures[wall];
+}
+
+/*  Render the view from the player's position along its heading into the framebuffer. The rays of all columns are cast as one
+    parallel batch, and the columns are then filled in parallel: ceiling above each wall span and floor below it. Walls are
+    textured by where along the wall the ray hit, from the mip level whose texels are closest to the span's pixels in size, and
+    shaded by how squarely the ray hits them and darkened with distance. */
+void renderFirstPerson(void)
+{
+    static Ray rays[FIRST_PERSON_COLUMN_BUDGET];
+    static RayHit hits[FIRST_PERSON_COLUMN_BUDGET];
+    static int textures_generated = 0;
+
+    if(!textures_generated)
+    {
+        generateWallTextures();
+        textures_generated = 1;
+    }
+
+    initializeFramebuffer(&framebuffer, FIRST_PERSON_WIDTH, FIRST_PERSON_HEIGHT);
+
+    const int width = framebuffer.width, height = framebuffer.height;
+    int columns = width < FIRST_PERSON_COLUMN_BUDGET ? width : FIRST_PERSON_COLUMN_BUDGET;
+    double plane_scale = tan(FIRST_PERSON_FOV / 2.0);
+    Point forward = {cos(player_heading), sin(player_heading)};
+    Point plane = {forward.y * plane_scale, -forward.x * plane_scale};  // Points to the right of the heading
+
+    /*  Ray directions run from the left to the right edge of the view plane one unit ahead of the player, so the hit parameter
+        is the wall's distance along the heading, which keeps straight walls straight */
+    for(int c = 0; c < columns; ++c)
+    {
+        double x = 2.0 * (c + 0.5) / columns - 1.0;
+        Point dir = {forward.x + x * plane.x, forward.y + x * plane.y};
+
+        rays[c] = (Ray){player_position, {dir.x, dir.y * monitor_widescreen_compensation}};
+    }
+
+    castRayBatch(rays, hits, columns);
+
+    #pragma omp parallel for schedule(static, 16)
+    for(int c = 0; c < columns; ++c)
+    {
+        double span = 0.0;
+        float brightness = 0.0f;
+        const float* texels = NULL;     // The column of the texture that the wall span shows
+        int texture_size = 1;
+
+        if(hits[c].wall >= 0)
+        {
+            const Line* w = &walls[hits[c].wall];
+            Point e = {w->point2.x - w->point1.x, (w->point2.y - w->point1.y) / monitor_widescreen_compensation};
+            Point d = {rays[c].dir.x, rays[c].dir.y / monitor_widescreen_compensation};
+            double e_length = sqrt(e.x * e.x + e.y * e.y);
+            double facing = fabs(d.x * e.y - d.y * e.x) / (sqrt(d.x * d.x + d.y * d.y) * e_length);
+
+            span = height * FIRST_PERSON_WALL_HEIGHT / hits[c].t;
+            brightness = (float) ((0.35 + 0.65 * facing) / (1.0 + 1.5 * hits[c].t));
+
+            /* The level whose texels are about one pixel tall */
+            int level = 0;
+            while(level + 1 < WALL_TEXTURE_LEVELS && (WALL_TEXTURE_SIZE >> (level + 1)) >= span)
+                ++level;
+            texture_size = WALL_TEXTURE_SIZE >> level;
+
+            /* The texture repeats along the wall every FIRST_PERSON_WALL_HEIGHT, so texels are square */
+            Point hit = {rays[c].origin.x + hits[c].t * rays[c].dir.x - w->point1.x,
+                         (rays[c].origin.y + hits[c].t * rays[c].dir.y - w->point1.y) / monitor_widescreen_compensation};
+            double along = sqrt(hit.x * hit.x + hit.y * hit.y) / FIRST_PERSON_WALL_HEIGHT;
+            int u = (int) ((along - floor(along)) * texture_size);
+
+            texels = &wall_atlas[((size_t) wallTexture(hits[c].wall) * WALL_TEXTURE_TEXELS + wallTextureLevelOffset(level) +
+                                  (size_t) (u < texture_size ? u : texture_size - 1) * texture_size) * 3];
+        }
+
+        double wall_bottom = (height - span) / 2.0;
+        int bottom = (int) fmax(0.0, ceil(wall_bottom - 0.5)), top = (int) fmin(height, ceil(wall_bottom + span - 0.5));
+        int x0 = c * width / columns, x1 = (c + 1) * width / columns;
+
+        for(int y = 0; y < height; ++y)
+        {
+            float r, g, b;
+
+            if(y >= bottom && y < top)
+            {
+                /* Rows of the texture are contiguous within its column, so the span reads them in order */
+                int v = (int) ((y + 0.5 - wall_bottom) / span * texture_size);
+                const float* texel = &texels[(v < texture_size ? v : texture_size - 1) * 3];
+
+                r = texel[0] * brightness;
+                g = texel[1] * brightness;
+                b = texel[2] * brightness;
+            }
+            else
+            {
+                /* The floor and ceiling fade towards the horizon */
+                float horizon = fabsf(2.0f * (y + 0.5f) / height - 1.0f);
+
+                r = y < bottom ? 0.30f * horizon : 0.10f * horizon;
+                g = y < bottom ? 0.25f * horizon : 0.12f * horizon;
+                b = y < bottom ? 0.20f * horizon : 0.20f * horizon;
+            }
+
+            float* pixel = &framebuffer.pixels[((size_t) y * width + x0) * 3];
+            for(int x = x0; x < x1; ++x, pixel += 3)
+            {
+                pixel[0] = r;
+                pixel[1] = g;
+                pixel[2] = b;
+            }
+        }
+    }
+}
+
+/*  Image sources for the acoustic impulse response. Every node is the mirror image of its parent across one wall, and is only
+    reachable through its window: the part of that wall the parent's image can see through the parent's own window.
+    Positions are in widescreen compensated coordinates, where distances are isotropic. */
+#define ACOUSTIC_METERS_PER_UNIT 10.0   // The window is 20 m wide
+#define ACOUSTIC_SPEED_OF_SOUND 343.0   // In m/s
+#define ACOUSTIC_SAMPLE_RATE 48000
+#define ACOUSTIC_DURATION 1.0           // Length of the impulse response in seconds
+#define ACOUSTIC_REFLECTION 0.8         // Fraction of the amplitude a wall reflects
+
+typedef struct{
+    Point image;
+    Point window[2];
+    int wall;       // The wall the image is mirrored across, -1 for the source
+    int parent;
+    float gain;     // Product of the reflection coefficients along the path
+} ImageSource;
+
+/* Convert between window and widescreen compensated coordinates */
+Point toCompensated(Point p)
+{
+    return (Point){p.x, p.y / monitor_widescreen_compensation};
+}
+
+Point fromCompensated(Point p)
+{
+    return (Point){p.x, p.y * monitor_widescreen_compensation};
+}
+
+/* Return which side of the line through a and b the point p is on: positive on the left, negative on the right */
+double lineSide(Point a, Point b, Point p)
+{
+    return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+}
+
+/*  Clip the segment [p0, p1] to the half-plane where lineSide(a, b, p) has the given sign, in place.
+    Returns 0 if nothing of the segment is left. */
+int clipSegmentToHalfPlane(Point* p0, Point* p1, Point a, Point b, double sign)
+{
+    double d0 = sign * lineSide(a, b, *p0);
+    double d1 = sign * lineSide(a, b, *p1);
+
+    if(d0 < 0.0 && d1 < 0.0)
+        return 0;
+
+    if(d0 < 0.0 || d1 < 0.0)
+    {
+        double t = d0 / (d0 - d1);
+        Point cut = {p0->x + t * (p1->x - p0->x), p0->y + t * (p1->y - p0->y)};
+
+        if(d0 < 0.0)
+            *p0 = cut;
+        else
+            *p1 = cut;
+    }
+
+    return 1;
+}
+
+/*  Clip the segment [p0, p1] to the part beyond the window w0-w1 as seen from apex, inside the wedge from apex through the window.
+    Returns 0 if nothing of the segment is left. */
+int clipSegmentToWedge(Point* p0, Point* p1, Point apex, Point w0, Point w1)
+{
+    double orientation = lineSide(apex, w0, w1) >= 0.0 ? 1.0 : -1.0;
+
+    return clipSegmentToHalfPlane(p0, p1, apex, w0, orientation) &&
+           clipSegmentToHalfPlane(p0, p1, w1, apex, orientation) &&
+           clipSegmentToHalfPlane(p0, p1, w0, w1, lineSide(w0, w1, apex) >= 0.0 ? -1.0 : 1.0);
+}
+
+/*  Find the part of a wall that the parent image sees through its window, and write it to window. This is the visibility window
+    pruning of the image tree: a wall outside the parent's window can never take part in a path through the parent.
+    Returns 0 if the wall is not visible at all. */
+int imageSourceWindow(const ImageSource* parent, int wall, Point window[2])
+{
+    if(wall == parent->wall)
+        return 0;
+
+    window[0] = toCompensated(walls[wall].point1);
+    window[1] = toCompensated(walls[wall].point2);
+
+    /* The source sees everything */
+    if(parent->wall < 0)
+        return 1;
+
+    return clipSegmentToWedge(&window[0], &window[1], parent->image, parent->window[0], parent->window[1]);
+}
+
+/* Return the mirror image of a point across the line through a wall's endpoints, in compensated coordinates */
+Point mirrorPoint(Point p, Point a, Point b)
+{
+    Point e = {b.x - a.x, b.y - a.y};
+    double t = ((p.x - a.x) * e.x + (p.y - a.y) * e.y) / (e.x * e.x + e.y * e.y);
+    Point foot = {a.x + t * e.x, a.y + t * e.y};
+
+    return (Point){2.0 * foot.x - p.x, 2.0 * foot.y - p.y};
+}
+
+/*  Return the attenuation of sound travelling between two points in compensated coordinates: 0 if an opaque wall is in the way.
+    The ends are pulled in slightly so the walls a path reflects off do not count as blocking it. */
+double acousticTransmittance(Point from, Point to)
+{
+    Point a = fromCompensated(from), b = fromCompensated(to);
+    Point inset = {(b.x - a.x) * 10e-7, (b.y - a.y) * 10e-7};
+
+    return segmentTransmittance((Point){a.x + inset.x, a.y + inset.y}, (Point){b.x - inset.x, b.y - inset.y});
+}
+
+/*  Check the path from the listener back to the source through an image source and its ancestors, reflecting at the window of
+    each one in turn. Returns the path's amplitude gain (0 if the path is invalid or blocked) and writes its length. */
+double validateImagePath(const ImageSource* tree, int node, Point listener, double* length)
+{
+    const ImageSource* n = &tree[node];
+    Point from = listener;
+    double gain = n->gain;
+
+    *length = sqrt((n->image.x - listener.x) * (n->image.x - listener.x) + (n->image.y - listener.y) * (n->image.y - listener.y));
+
+    for(; n->wall >= 0; n = &tree[n->parent])
+    {
+        /* The path towards this image has to cross its window */
+        Point dir = {n->image.x - from.x, n->image.y - from.y};
+        double t = intersectRayWall(from, dir, &(Line){n->window[0], n->window[1]});
+        if(t > 1.0)
+            return 0.0;
+
+        Point reflection = {from.x + t * dir.x, from.y + t * dir.y};
+        gain *= acousticTransmittance(from, reflection);
+        if(gain == 0.0)
+            return 0.0;
+
+        from = reflection;
+    }
+
+    return gain * acousticTransmittance(from, n->image);
+}
+
+/*  Compute the impulse response from a source to a listener with the image source method up to the given reflection order, and
+    write it to a file as raw native-endian 32-bit floats at ACOUSTIC_SAMPLE_RATE. The tree is grown one order at a time, with the
+    children of every node and the validation of every path computed in parallel. Nodes whose image is already farther from
+    the listener than sound travels in ACOUSTIC_DURATION are pruned along with their subtrees, since reflecting only lengthens a path.
+    Returns 0 on failure. */
+int computeImpulseResponse(Point source, Point listener, int order, const char* path)
+{
+    const double max_length = ACOUSTIC_SPEED_OF_SOUND * ACOUSTIC_DURATION / ACOUSTIC_METERS_PER_UNIT;
+    const int samples = (int) (ACOUSTIC_SAMPLE_RATE * ACOUSTIC_DURATION);
+
+    source = toCompensated(source);
+    listener = toCompensated(listener);
+
+    ImageSource* tree = malloc(sizeof(ImageSource));
+    float* response = calloc(samples, sizeof(float));
+    if(!tree || !response)
+    {
+        fprintf(stderr, "Out of memory computing the impulse response\n");
+        return 0;
+    }
+
+    tree[0] = (ImageSource){source, {source, source}, -1, -1, 1.0f};
+    int level_start = 0, level_end = 1;
+    long long paths = 0;
+
+    for(int level = 0; level <= order; ++level)
+    {
+        /* Add every valid path of this order to the response */
+        #pragma omp parallel for schedule(dynamic, 64) reduction(+:paths)
+        for(int i = level_start; i < level_end; ++i)
+        {
+            double length;
+            double gain = validateImagePath(tree, i, listener, &length);
+            if(gain == 0.0)
+                continue;
+
+            double meters = fmax(length * ACOUSTIC_METERS_PER_UNIT, 0.1);
+            int sample = (int) (meters / ACOUSTIC_SPEED_OF_SOUND * ACOUSTIC_SAMPLE_RATE + 0.5);
+            if(sample >= samples)
+                continue;
+
+            #pragma omp atomic
+            response[sample] += (float) (gain / meters);
+            ++paths;
+        }
+
+        if(level == order)
+            break;
+
+        /* Count the children of every node of this order, then place them */
+        int parents = level_end - level_start;
+        int* offsets = malloc((parents + 1) * sizeof(int));
+        if(!offsets)
+        {
+            fprintf(stderr, "Out of memory growing the image source tree\n");
+            free(tree);
+            free(response);
+            return 0;
+        }
+
+        #pragma omp parallel for schedule(dynamic, 64)
+        for(int i = 0; i < parents; ++i)
+        {
+            const ImageSource* parent = &tree[level_start + i];
+            Point window[2];
+            int children = 0;
+
+            for(int w = 0; w < wall_count; ++w)
+                if(imageSourceWindow(parent, w, window))
+                {
+                    Point image = mirrorPoint(parent->image, toCompensated(walls[w].point1), toCompensated(walls[w].point2));
+                    double dx = image.x - listener.x, dy = image.y - listener.y;
+
+                    children += dx * dx + dy * dy <= max_length * max_length;
+                }
+
+            offsets[i + 1] = children;
+        }
+
+        offsets[0] = 0;
+        for(int i = 0; i < parents; ++i)
+            offsets[i + 1] += offsets[i];
+
+        if(offsets[parents] == 0)
+        {
+            free(offsets);
+            break;
+        }
+
+        ImageSource* grown = realloc(tree, (size_t) (level_end + offsets[parents]) * sizeof(ImageSource));
+        if(!grown)
+        {
+            fprintf(stderr, "Out of memory growing the image source tree (%d nodes)\n", level_end + offsets[parents]);
+            free(offsets);
+            free(tree);
+            free(response);
+            return 0;
+        }
+        tree = grown;
+
+        #pragma omp parallel for schedule(dynamic, 64)
+        for(int i = 0; i < parents; ++i)
+        {
+            const ImageSource* parent = &tree[level_start + i];
+            ImageSource* child = &tree[level_end + offsets[i]];
+
+            for(int w = 0; w < wall_count; ++w)
+            {
+                Point window[2];
+                if(!imageSourceWindow(parent, w, window))
+                    continue;
+
+                Point image = mirrorPoint(parent->image, toCompensated(walls[w].point1), toCompensated(walls[w].point2));
+                double dx = image.x - listener.x, dy = image.y - listener.y;
+                if(dx * dx + dy * dy > max_length * max_length)
+                    continue;
+
+                *child++ = (ImageSource){image, {window[0], window[1]}, w, level_start + i, parent->gain * ACOUSTIC_REFLECTION * wall_opacity[w]};
+            }
+        }
+
+        level_start = level_end;
+        level_end += offsets[parents];
+        free(offsets);
+    }
+
+    printf("%d image sources, %lld audible paths\n", level_end, paths);
+    free(tree);
+
+    FILE* file = fopen(path, "wb");
+    if(!file)
+    {
+        fprintf(stderr, "Could not write impulse response %s\n", path);
+        free(response);
+        return 0;
+    }
+
+    size_t written = fwrite(response, sizeof(float), samples, file);
+    free(response);
+
+    return fclose(file) == 0 && written == (size_t) samples;
+}
+
+/*  Append a beam to the work queue. Must be called holding beam_queue_lock. Returns 0 if the queue is full, counting the beam
+    as dropped. */
+int pushBeam(Beam beam)
+{
+    if(beam_queue_count == MAX_BEAMS)
+    {
+        ++beam_queue_dropped;
+        return 0;
+    }
+
+    if(beam_queue_count == beam_queue_capacity)
+    {
+        int capacity = beam_queue_capacity ? 2 * beam_queue_capacity : 64;
+        Beam* grown = realloc(beam_queue, capacity * sizeof(Beam));
+        if(!grown)
+        {
+            fprintf(stderr, "Out of memory growing the beam queue\n");
+            exit(-1);
+        }
+        beam_queue = grown;
+        beam_queue_capacity = capacity;
+    }
+
+    beam_queue[beam_queue_count++] = beam;
+    return 1;
+}
+
+/* Append a traced part of a beam. Must be called holding beam_fragments_lock. */
+void pushBeamFragment(BeamFragment fragment)
+{
+    if(beam_fragment_count == beam_fragment_capacity)
+    {
+        int capacity = beam_fragment_capacity ? 2 * beam_fragment_capacity : 256;
+        BeamFragment* grown = realloc(beam_fragments, capacity * sizeof(BeamFragment));
+        if(!grown)
+        {
+            fprintf(stderr, "Out of memory growing the beam fragments\n");
+            exit(-1);
+        }
+        beam_fragments = grown;
+        beam_fragment_capacity = capacity;
+    }
+
+    beam_fragments[beam_fragment_count++] = fragment;
+}
+
+/* Return one side of the border, in window coordinates: 0 and 1 are the right and left sides, 2 and 3 the top and bottom */
+Line borderSide(int side)
+{
+    static const Line sides[4] = {  {{ BORDER, -BORDER}, { BORDER,  BORDER}},
+                                    {{-BORDER,  BORDER}, {-BORDER, -BORDER}},
+                                    {{ BORDER,  BORDER}, {-BORDER,  BORDER}},
+                                    {{-BORDER, -BORDER}, { BORDER, -BORDER}}   };
+
+    return sides[side];
+}
+
+/* Return the line a beam target stands for, in window coordinates */
+Line beamTargetLine(int target)
+{
+    return target >= 0 ? walls[target] : borderSide(-1 - target);
+}
+
+/* Return the point at parameter s along a beam's window, from 0 at its first end to 1 at its second */
+Point beamWindowPoint(const Beam* beam, double s)
+{
+    return (Point){beam->window[0].x + s * (beam->window[1].x - beam->window[0].x),
+                   beam->window[0].y + s * (beam->window[1].y - beam->window[0].y)};
+}
+
+/* Return the parameter along a beam's window of the point where the line from the apex to p crosses it, clamped to the window */
+double beamWindowParameter(const Beam* beam, Point p)
+{
+    Point v = {p.x - beam->apex.x, p.y - beam->apex.y};
+    Point a = {beam->window[0].x - beam->apex.x, beam->window[0].y - beam->apex.y};
+    Point e = {beam->window[1].x - beam->window[0].x, beam->window[1].y - beam->window[0].y};
+    double denominator = e.x * v.y - e.y * v.x;
+
+    if(fabs(denominator) < 10e-15)
+        return 0.0;
+
+    return fmin(fmax((v.x * a.y - v.y * a.x) / denominator, 0.0), 1.0);
+}
+
+/* Return where the line through p along dir crosses the line through a and b, or p itself if they are parallel */
+Point lineCrossing(Point p, Point dir, Point a, Point b)
+{
+    Point e = {b.x - a.x, b.y - a.y};
+    double denominator = dir.x * e.y - dir.y * e.x;
+
+    if(fabs(denominator) < 10e-15)
+        return p;
+
+    double t = ((a.x - p.x) * e.y - (a.y - p.y) * e.x) / denominator;
+    return (Point){p.x + t * dir.x, p.y + t * dir.y};
+}
+
+/* Return the wall that the ray from a beam's apex through parameter s of its window reaches first, or -1 - side for a side of the border */
+int beamTarget(const Beam* beam, double s)
+{
+    Point q = beamWindowPoint(beam, s);
+    Point dir = fromCompensated((Point){q.x - beam->apex.x, q.y - beam->apex.y});
+    double length = sqrt(dir.x * dir.x + dir.y * dir.y);
+
+    dir.x /= length;
+    dir.y /= length;
+
+    /* Start just past the window so the wall it lies on is not hit again */
+    Point origin = fromCompensated(q);
+    origin.x += dir.x * 10e-7;
+    origin.y += dir.y * 10e-7;
+
+    int wall;
+    double t = castRay(origin, dir, &wall);
+    if(t < borderExit(origin, dir))
+        return wall;
+
+    double tx = dir.x != 0.0 ? ((dir.x > 0.0 ? BORDER : -BORDER) - origin.x) / dir.x : INFINITY;
+    double ty = dir.y != 0.0 ? ((dir.y > 0.0 ? BORDER : -BORDER) - origin.y) / dir.y : INFINITY;
+
+    return -1 - (tx < ty ? (dir.x > 0.0 ? 0 : 1) : (dir.y > 0.0 ? 2 : 3));
+}
+
+/* Record the part of a beam between window parameters s0 and s1 that ends on the given target, and queue the beam it turns into there */
+void finishBeamPart(const Beam* beam, double s0, double s1, int target)
+{
+    Line l = beamTargetLine(target);
+    Point a = toCompensated(l.point1), b = toCompensated(l.point2);
+    Point n0 = beamWindowPoint(beam, s0), n1 = beamWindowPoint(beam, s1);
+    Point f0 = lineCrossing(beam->apex, (Point){n0.x - beam->apex.x, n0.y - beam->apex.y}, a, b);
+    Point f1 = lineCrossing(beam->apex, (Point){n1.x - beam->apex.x, n1.y - beam->apex.y}, a, b);
+
+    BeamFragment fragment = {{fromCompensated(n0), fromCompensated(n1), fromCompensated(f1), fromCompensated(f0)},
+                             beam->reflections, beam->crossings, beam->intensity};
+
+    pthread_mutex_lock(&beam_fragments_lock);
+    pushBeamFragment(fragment);
+    pthread_mutex_unlock(&beam_fragments_lock);
+
+    if(target < 0 || pointDistance(f0, f1) < 10e-9)
+        return;
+
+    Beam next;
+    if(wall_materials[target] == MATERIAL_MIRROR && beam->reflections < REFLECTION_DEPTH)
+        next = (Beam){mirrorPoint(beam->apex, a, b), {f0, f1}, target, beam->reflections + 1, beam->crossings, beam->intensity * BEAM_MIRROR_REFLECTANCE};
+    else if(wall_materials[target] == MATERIAL_TRANSLUCENT && beam->crossings + 1 < MAX_RAY_HITS)
+        next = (Beam){beam->apex, {f0, f1}, target, beam->reflections, beam->crossings + 1, beam->intensity * (1.0f - wall_opacity[target])};
+    else
+        return;
+
+    if(next.intensity < BEAM_MIN_INTENSITY)
+        return;
+
+    pthread_mutex_lock(&beam_queue_lock);
+    if(pushBeam(next))
+        pthread_cond_signal(&beam_queue_ready);
+    pthread_mutex_unlock(&beam_queue_lock);
+}
+
+/* Order doubles for qsort */
+int compareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+
+    return (x > y) - (x < y);
+}
+
+/*  Working memory for traceBeam, one per thread. segments and candidates have room for every wall and the four sides of the
+    border, and wall_marks holds the beam each wall was last gathered for. */
+typedef struct{
+    double* params;
+    int param_count, param_capacity;
+    Line* segments;
+    int* candidates;
+    int* wall_marks;
+    int mark;
+} BeamScratch;
+
+/* Add a split to a beam's scratch memory, growing it as needed */
+void appendBeamParam(BeamScratch* scratch, double s)
+{
+    if(scratch->param_count == scratch->param_capacity)
+    {
+        int capacity = scratch->param_capacity ? 2 * scratch->param_capacity : 64;
+        double* grown = realloc(scratch->params, capacity * sizeof(double));
+        if(!grown)
+        {
+            fprintf(stderr, "Out of memory tracing beams\n");
+            exit(-1);
+        }
+        scratch->params = grown;
+        scratch->param_capacity = capacity;
+    }
+
+    scratch->params[scratch->param_count++] = s;
+}
+
+/*  Gather the walls in the grid cells a beam's wedge overlaps into the scratch memory's candidates, each once, and return how
+    many there are. The wedge is bounded by what is left of the border's sides inside it, and cells wholly outside one of its
+    sides are skipped. */
+int gatherBeamWalls(const Beam* beam, BeamScratch* scratch)
+{
+    Point apex = beam->apex, w0 = beam->window[0], w1 = beam->window[1];
+    double min_x = fmin(w0.x, w1.x), max_x = fmax(w0.x, w1.x);
+    double min_y = fmin(w0.y, w1.y), max_y = fmax(w0.y, w1.y);
+
+    for(int side = 0; side < 4; ++side)
+    {
+        Line l = borderSide(side);
+        Point p0 = toCompensated(l.point1), p1 = toCompensated(l.point2);
+
+        if(!clipSegmentToWedge(&p0, &p1, apex, w0, w1))
+            continue;
+
+        min_x = fmin(min_x, fmin(p0.x, p1.x));
+        max_x = fmax(max_x, fmax(p0.x, p1.x));
+        min_y = fmin(min_y, fmin(p0.y, p1.y));
+        max_y = fmax(max_y, fmax(p0.y, p1.y));
+    }
+
+    /* The wedge's sides, as lines and the sign of lineSide on their inner side, the same as in clipSegmentToWedge */
+    double orientation = lineSide(apex, w0, w1) >= 0.0 ? 1.0 : -1.0;
+    Point side_a[3] = {apex, w1, w0}, side_b[3] = {w0, apex, w1};
+    double side_sign[3] = {orientation, orientation, lineSide(w0, w1, apex) >= 0.0 ? -1.0 : 1.0};
+
+    int x0 = gridCoordinate(min_x), x1 = gridCoordinate(max_x);
+    int y0 = gridCoordinate(min_y * monitor_widescreen_compensation), y1 = gridCoordinate(max_y * monitor_widescreen_compensation);
+    int count = 0;
+
+    ++scratch->mark;
+    for(int x = x0; x <= x1; ++x)
+        for(int y = y0; y <= y1; ++y)
+        {
+            double left = -BORDER + x * GRID_CELL_SIZE, bottom = (-BORDER + y * GRID_CELL_SIZE) / monitor_widescreen_compensation;
+            double right = left + GRID_CELL_SIZE, top = bottom + GRID_CELL_SIZE / monitor_widescreen_compensation;
+            Point corners[4] = {{left, bottom}, {right, bottom}, {right, top}, {left, top}};
+            int outside = 0;
+
+            for(int i = 0; i < 3 && !outside; ++i)
+            {
+                outside = 1;
+                for(int j = 0; j < 4 && outside; ++j)
+                    outside = side_sign[i] * lineSide(side_a[i], side_b[i], corners[j]) < 0.0;
+            }
+
+            if(outside)
+                continue;
+
+            const GridCell* cell = &wall_grid[x][y];
+
+            for(int i = 0; i < cell->count; ++i)
+                if(scratch->wall_marks[cell->items[i]] != scratch->mark)
+                {
+                    scratch->wall_marks[cell->items[i]] = scratch->mark;
+                    scratch->candidates[count++] = cell->items[i];
+                }
+        }
+
+    return count;
+}
+
+/*  Split a beam at the endpoints of every wall it sees, where those walls cross each other, and at the corners of the border, then
+    follow each stretch between two splits to the wall it reaches first. Within a stretch the nearest wall cannot change.
+    Neighbouring stretches that end on the same wall are joined back into one part. Only the walls in the grid cells the beam
+    covers are considered. */
+void traceBeam(const Beam* beam, BeamScratch* scratch)
+{
+    int segment_count = 0;
+    int candidate_count = gatherBeamWalls(beam, scratch);
+
+    scratch->param_count = 0;
+    appendBeamParam(scratch, 0.0);
+    appendBeamParam(scratch, 1.0);
+
+    /* The border's sides come first, as targets -4 to -1 */
+    for(int k = -4; k < candidate_count; ++k)
+    {
+        int target = k < 0 ? k : scratch->candidates[k];
+
+        if(target == beam->wall)
+            continue;
+
+        Line l = beamTargetLine(target);
+        Point p0 = toCompensated(l.point1), p1 = toCompensated(l.point2);
+
+        if(!clipSegmentToWedge(&p0, &p1, beam->apex, beam->window[0], beam->window[1]))
+            continue;
+
+        appendBeamParam(scratch, beamWindowParameter(beam, p0));
+        appendBeamParam(scratch, beamWindowParameter(beam, p1));
+        scratch->segments[segment_count++] = (Line){p0, p1};
+    }
+
+    for(int i = 0; i < segment_count; ++i)
+        for(int j = i + 1; j < segment_count; ++j)
+        {
+            Point crossing;
+            if(findLineSegmentIntersection(scratch->segments[i], scratch->segments[j], &crossing))
+                appendBeamParam(scratch, beamWindowParameter(beam, crossing));
+        }
+
+    double* params = scratch->params;
+    int count = scratch->param_count;
+
+    qsort(params, count, sizeof(double), compareDoubles);
+
+    int part_target = 0;
+    double part_start = -1.0;
+
+    for(int i = 0; i + 1 < count; ++i)
+    {
+        if(params[i + 1] - params[i] < 10e-9)
+            continue;
+
+        int target = beamTarget(beam, 0.5 * (params[i] + params[i + 1]));
+
+        if(part_start < 0.0)
+            part_start = params[i];
+        else if(target != part_target)
+        {
+            finishBeamPart(beam, part_start, params[i], part_target);
+            part_start = params[i];
+        }
+        part_target = target;
+    }
+
+    if(part_start >= 0.0)
+        finishBeamPart(beam, part_start, 1.0, part_target);
+}
+
+/*  Trace beams from a light until every reflection and crossing has been followed, replacing the previous fragments.
+    Threads take beams from the shared queue and add the beams they produce back to it, finishing once the queue is empty
+    and no thread is still tracing a beam that could add more. */
+void traceBeams(Point light)
+{
+    Point apex = toCompensated(light);
+    int next = 0, active = 0;
+
+    beam_queue_count = 0;
+    beam_queue_dropped = 0;
+    beam_fragment_count = 0;
+
+    for(int i = 0; i < BEAM_PRIMARY_COUNT; ++i)
+    {
+        double a0 = 2.0 * PI * i / BEAM_PRIMARY_COUNT, a1 = 2.0 * PI * (i + 1) / BEAM_PRIMARY_COUNT;
+
+        pushBeam((Beam){apex, {{apex.x + 10e-7 * cos(a0), apex.y + 10e-7 * sin(a0)}, {apex.x + 10e-7 * cos(a1), apex.y + 10e-7 * sin(a1)}},
+                        BEAM_NO_WALL, 0, 0, 1.0f});
+    }
+
+    #pragma omp parallel
+    {
+        BeamScratch scratch = {NULL, 0, 0, malloc((wall_count + 4) * sizeof(Line)), malloc((wall_count + 4) * sizeof(int)),
+                               calloc(wall_count + 1, sizeof(int)), 0};
+        if(!scratch.segments || !scratch.candidates || !scratch.wall_marks)
+        {
+            fprintf(stderr, "Out of memory tracing beams\n");
+            exit(-1);
+        }
+
+        for(;;)
+        {
+            Beam beam;
+
+            /* Sleep until another thread queues a beam, or until the last beam being traced is done without queueing any */
+            pthread_mutex_lock(&beam_queue_lock);
+            while(next == beam_queue_count && active > 0)
+                pthread_cond_wait(&beam_queue_ready, &beam_queue_lock);
+
+            if(next == beam_queue_count)
+            {
+                pthread_mutex_unlock(&beam_queue_lock);
+                break;
+            }
+
+            beam = beam_queue[next++];
+            ++active;
+            pthread_mutex_unlock(&beam_queue_lock);
+
+            traceBeam(&beam, &scratch);
+
+            pthread_mutex_lock(&beam_queue_lock);
+            if(--active == 0 && next == beam_queue_count)
+                pthread_cond_broadcast(&beam_queue_ready);
+            pthread_mutex_unlock(&beam_queue_lock);
+        }
+
+        free(scratch.params);
+        free(scratch.segments);
+        free(scratch.candidates);
+        free(scratch.wall_marks);
+    }
+
+    /* The area the primary beams cover before any reflection is the part of the scene the light sees */
+    double area = 0.0;
+
+    for(int i = 0; i < beam_fragment_count; ++i)
+    {
+        const BeamFragment* f = &beam_fragments[i];
+        if(f->reflections || f->crossings)
+            continue;
+
+        for(int j = 0; j < 4; ++j)
+        {
+            Point p = f->corners[j], q = f->corners[(j + 1) % 4];
+            area += 0.5 * (p.x * q.y - q.x * p.y);
+        }
+    }
+
+    beam_coverage = fabs(area) / (4.0 * BORDER * BORDER);
+}
+
+/* Draw the traced beams as quads, blended additively so reflected beams brighten what they fall on */
+void drawBeams(void)
+{
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+
+    glBegin(GL_QUADS);
+    for(int i = 0; i < beam_fragment_count; ++i)
+    {
+        const BeamFragment* f = &beam_fragments[i];
+        float brightness = 0.35f * f->intensity;
+
+        glColor3f(brightness, brightness, brightness);
+        for(int j = 0; j < 4; ++j)
+            glVertex2d(f->corners[j].x, f->corners[j].y);
+    }
+    glEnd();
+
+    glDisable(GL_BLEND);
+}
+
+/*  Coverage analysis. The visible area is computed for the center of every cell of a grid over the window, from a fan of
+    COVERAGE_RAYS rays cast as one batch. Rows are cut into tiles of COVERAGE_TILE cells that are dealt out evenly to the threads
+    up front; a thread that runs out steals the back half of another thread's tiles. Every cell casts the same fan of directions,
+    and a thread works along neighbouring cells, whose rays walk mostly the same grid cells and walls while they are in cache. */
+#define COVERAGE_RAYS 360
+#define COVERAGE_TILE 16
+
+typedef struct{
+    int next, end;      // The tiles still to do. The owner takes them from next, other threads steal from end.
+    omp_lock_t lock;
+} CoverageQueue;
+
+/* Take a tile from the front of a queue. Returns -1 if it is empty. */
+int takeCoverageTile(CoverageQueue* queue)
+{
+    int tile = -1;
+
+    omp_set_lock(&queue->lock);
+    if(queue->next < queue->end)
+        tile = queue->next++;
+    omp_unset_lock(&queue->lock);
+
+    return tile;
+}
+
+/* Move the back half of another thread's tiles into a thread's own empty queue. Returns 0 if there was nothing left to steal. */
+int stealCoverageTiles(CoverageQueue* queues, int count, int self)
+{
+    for(int i = 1; i < count; ++i)
+    {
+        CoverageQueue* victim = &queues[(self + i) % count];
+        int begin = 0, end = 0;
+
+        omp_set_lock(&victim->lock);
+        if(victim->next < victim->end)
+        {
+            end = victim->end;
+            begin = victim->end - (victim->end - victim->next + 1) / 2;
+            victim->end = begin;
+        }
+        omp_unset_lock(&victim->lock);
+
+        if(begin < end)
+        {
+            omp_set_lock(&queues[self].lock);
+            queues[self].next = begin;
+            queues[self].end = end;
+            omp_unset_lock(&queues[self].lock);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*  Fill in the COVERAGE_RAYS hits of the fan of rays from a point along the given directions, cast as one batch on the calling
+    thread. Fans are cast by many threads at once, one point each. */
+void castVisibilityFan(Point p, const Point* directions, Ray* rays, RayHit* hits)
+{
+    for(int i = 0; i < COVERAGE_RAYS; ++i)
+        rays[i] = (Ray){p, directions[i]};
+
+    castRayBatchSerial(rays, hits, COVERAGE_RAYS);
+}
+
+/* Fill in the COVERAGE_RAYS evenly spaced directions of a fan, which have unit length with the widescreen compensation removed */
+void fanDirections(Point* directions)
+{
+    for(int i = 0; i < COVERAGE_RAYS; ++i)
+    {
+        double angle = 2.0 * PI * i / COVERAGE_RAYS;
+        directions[i] = (Point){cos(angle), sin(angle) * monitor_widescreen_compensation};
+    }
+}
+
+/*  Return the area visible from a point, as a fraction of the area inside the borders. directions holds the COVERAGE_RAYS evenly
+    spaced directions of the fan, and rays and hits are room for the batch. */
+double visibleArea(Point p, const Point* directions, Ray* rays, RayHit* hits)
+{
+    castVisibilityFan(p, directions, rays, hits);
+
+    /* With unit directions in compensated coordinates, the fan is made of triangles with sides t[i] and t[i + 1] */
+    double sum = 0.0;
+    for(int i = 0; i < COVERAGE_RAYS; ++i)
+        sum += hits[i].t * hits[(i + 1) % COVERAGE_RAYS].t;
+
+    return 0.5 * sin(2.0 * PI / COVERAGE_RAYS) * sum / (4.0 * BORDER * BORDER / monitor_widescreen_compensation);
+}
+
+/* Map a value from 0 to 1 onto a black-blue-red-yellow-white color ramp */
+void heatmapColor(double value, unsigned char rgb[3])
+{
+    static const double ramp[5][3] = {{0.0, 0.0, 0.0}, {0.1, 0.1, 0.8}, {0.9, 0.1, 0.2}, {1.0, 0.8, 0.0}, {1.0, 1.0, 1.0}};
+    double x = fmin(fmax(value, 0.0), 1.0) * 4.0;
+    int i = (int) fmin(x, 3.0);
+    double f = x - i;
+
+    for(int c = 0; c < 3; ++c)
+        rgb[c] = (unsigned char) (255.0 * (ramp[i][c] + f * (ramp[i + 1][c] - ramp[i][c])) + 0.5);
+}
+
+/*  Compute the visible area from every cell of a width by height grid over the window, and write it both as a heatmap image (binary
+    PPM, scaled to the largest value) and as raw native-endian 32-bit floats, row by row from the top. Returns 0 on failure. */
+int computeCoverage(int width, int height, const char* image_path, const char* raw_path)
+{
+    int tiles_per_row = (width + COVERAGE_TILE - 1) / COVERAGE_TILE;
+    int tiles = tiles_per_row * height;
+    int threads = omp_get_max_threads();
+    float* coverage = malloc((size_t) width * height * sizeof(float));
+    CoverageQueue* queues = malloc(threads * sizeof(CoverageQueue));
+    long long rays_cast = 0;
+    Point directions[COVERAGE_RAYS];
+
+    fanDirections(directions);
+
+    if(!coverage || !queues)
+    {
+        fprintf(stderr, "Out of memory computing coverage\n");
+        return 0;
+    }
+
+    for(int i = 0; i < threads; ++i)
+    {
+        queues[i].next = (int) ((long long) tiles * i / threads);
+        queues[i].end = (int) ((long long) tiles * (i + 1) / threads);
+        omp_init_lock(&queues[i].lock);
+    }
+
+    double start = omp_get_wtime();
+
+    #pragma omp parallel num_threads(threads) reduction(+:rays_cast)
+    {
+        int self = omp_get_thread_num();
+        Ray* rays = malloc(COVERAGE_RAYS * sizeof(Ray));
+        RayHit* hits = malloc(COVERAGE_RAYS * sizeof(RayHit));
+        if(!rays || !hits)
+        {
+            fprintf(stderr, "Out of memory computing coverage\n");
+            exit(-1);
+        }
+
+        for(;;)
+        {
+            int tile = takeCoverageTile(&queues[self]);
+            if(tile < 0)
+            {
+                if(!stealCoverageTiles(queues, threads, self))
+                    break;
+                continue;
+            }
+
+            int y = tile / tiles_per_row;
+            int x0 = (tile % tiles_per_row) * COVERAGE_TILE;
+            int x1 = x0 + COVERAGE_TILE < width ? x0 + COVERAGE_TILE : width;
+
+            for(int x = x0; x < x1; ++x)
+            {
+                Point p = {-1.0 + (x + 0.5) * 2.0 / width, 1.0 - (y + 0.5) * 2.0 / height};
+                coverage[(size_t) y * width + x] = (float) visibleArea(p, directions, rays, hits);
+            }
+            rays_cast += (long long) (x1 - x0) * COVERAGE_RAYS;
+        }
+
+        free(rays);
+        free(hits);
+    }
+
+    double elapsed = omp_get_wtime() - start;
+
+    for(int i = 0; i < threads; ++i)
+        omp_destroy_lock(&queues[i].lock);
+    free(queues);
+
+    printf("%d viewpoints, %lld rays on %d threads in %.2f s (%.2f Mrays/s)\n", width * height, rays_cast, threads, elapsed, rays_cast / elapsed / 1e6);
+
+    float largest = 0.0f;
+    for(size_t i = 0; i < (size_t) width * height; ++i)
+        largest = fmaxf(largest, coverage[i]);
+
+    FILE* image = fopen(image_path, "wb");
+    FILE* raw = fopen(raw_path, "wb");
+    int ok = image && raw;
+
+    if(ok)
+    {
+        fprintf(image, "P6\n%d %d\n255\n", width, height);
+        for(size_t i = 0; i < (size_t) width * height; ++i)
+        {
+            unsigned char rgb[3];
+            heatmapColor(largest > 0.0f ? coverage[i] / largest : 0.0, rgb);
+            fwrite(rgb, 1, 3, image);
+        }
+
+        ok = fwrite(coverage, sizeof(float), (size_t) width * height, raw) == (size_t) width * height;
+    }
+    else
+        fprintf(stderr, "Could not write coverage to %s and %s\n", image_path, raw_path);
+
+    if(image && fclose(image) != 0)
+        ok = 0;
+    if(raw && fclose(raw) != 0)
+        ok = 0;
+
+    free(coverage);
+    return ok;
+}
+
+/*  Guard placement. Every cell center of a grid over the window is both a candidate position and a target to cover. Each candidate's
+    visibility fan is turned into the runs of targets inside it, in parallel, and guards are then picked greedily by how many
+    still uncovered targets they add, counted against a bitset of the covered targets. Gains can only shrink as guards are added, so candidates are kept in a max-heap by their last
+    known gain and only the top one is re-evaluated (lazy greedy): if it stays on top with a fresh gain, it is the best choice. */
+typedef struct{
+    int gain;
+    int candidate;
+    int round;      // The guard count when the gain was last computed
+} GuardCandidate;
+
+/* A run of targets a candidate sees, from first to last along one row of the grid */
+typedef struct{
+    int row, first, last;
+} GuardSpan;
+
+/*  The targets a candidate sees, as the runs of each row inside its visibility fan. A fan only crosses a row a few times, so this
+    takes memory for the rows a candidate sees into rather than a bit for every target. */
+typedef struct{
+    GuardSpan* spans;
+    int count;
+} GuardVisibility;
+
+/*  Working memory for scan-converting fans, one per thread. row_starts has room for every row of the grid and one more, and spans
+    holds the runs of the fan being scanned. */
+typedef struct{
+    Point outline[COVERAGE_RAYS];
+    int* row_starts;
+    double* crossings;
+    int crossing_capacity;
+    GuardSpan* spans;
+    int span_count, span_capacity;
+} GuardScratch;
+
+/* Set the bits from first to last of a bitset */
+void setBitRange(uint64_t* bits, int first, int last)
+{
+    int first_word = first / 64, last_word = last / 64;
+    uint64_t first_mask = ~(uint64_t) 0 << (first % 64);
+    uint64_t last_mask = ~(uint64_t) 0 >> (63 - last % 64);
+
+    if(first_word == last_word)
+    {
+        bits[first_word] |= first_mask & last_mask;
+        return;
+    }
+
+    bits[first_word] |= first_mask;
+    for(int i = first_word + 1; i < last_word; ++i)
+        bits[i] = ~(uint64_t) 0;
+    bits[last_word] |= last_mask;
+}
+
+/* Count the bits from first to last of a bitset that are clear. The loop vectorizes on targets with a vector popcount instruction. */
+int countClearBits(const uint64_t* bits, int first, int last)
+{
+    int first_word = first / 64, last_word = last / 64;
+    uint64_t first_mask = ~(uint64_t) 0 << (first % 64);
+    uint64_t last_mask = ~(uint64_t) 0 >> (63 - last % 64);
+
+    if(first_word == last_word)
+        return __builtin_popcountll(~bits[first_word] & first_mask & last_mask);
+
+    int count = __builtin_popcountll(~bits[first_word] & first_mask) + __builtin_popcountll(~bits[last_word] & last_mask);
+
+    #pragma omp simd reduction(+:count)
+    for(int i = first_word + 1; i < last_word; ++i)
+        count += __builtin_popcountll(~bits[i]);
+
+    return count;
+}
+
+/*  Find the runs of targets inside a candidate's visibility fan, whose outline joining the hits of its rays is in the scratch
+    memory, for a width by height grid. The outline is scan-converted row by row: a target is inside between alternate crossings
+    of its row with the outline's edges, so a candidate costs the rows its outline crosses rather than a test per target. */
+void scanFanVisibility(GuardScratch* scratch, int width, int height)
+{
+    int* row_starts = scratch->row_starts;
+
+    memset(row_starts, 0, (height + 1) * sizeof(int));
+    scratch->span_count = 0;
+
+    /*  Count the crossings of every row, then place them. A row crosses an edge if its center is at or above the lower end and
+        below the upper end, so a vertex between two edges is crossed once and a flat edge not at all. */
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        for(int i = 0; i < COVERAGE_RAYS; ++i)
+        {
+            Point a = scratch->outline[i], b = scratch->outline[(i + 1) % COVERAGE_RAYS];
+            int first = (int) fmax(0.0, floor((1.0 - fmax(a.y, b.y)) * height / 2.0 - 0.5) + 1.0);
+            int last = (int) fmin(height - 1.0, floor((1.0 - fmin(a.y, b.y)) * height / 2.0 - 0.5));
+
+            for(int y = first; y <= last; ++y)
+            {
+                double py = 1.0 - (y + 0.5) * 2.0 / height;
+
+                if(pass == 0)
+                    ++row_starts[y + 1];
+                else
+                    scratch->crossings[row_starts[y]++] = a.x + (py - a.y) / (b.y - a.y) * (b.x - a.x);
+            }
+        }
+
+        if(pass == 0)
+        {
+            for(int y = 0; y < height; ++y)
+                row_starts[y + 1] += row_starts[y];
+
+            if(row_starts[height] > scratch->crossing_capacity)
+            {
+                free(scratch->crossings);
+                scratch->crossing_capacity = 2 * row_starts[height];
+                scratch->crossings = malloc(scratch->crossing_capacity * sizeof(double));
+                if(!scratch->crossings)
+                {
+                    fprintf(stderr, "Out of memory placing guards\n");
+                    exit(-1);
+                }
+            }
+        }
+    }
+
+    /* Placing advanced every start to the next row's, so shift them back */
+    for(int y = height; y > 0; --y)
+        row_starts[y] = row_starts[y - 1];
+    row_starts[0] = 0;
+
+    for(int y = 0; y < height; ++y)
+    {
+        double* x = &scratch->crossings[row_starts[y]];
+        int count = row_starts[y + 1] - row_starts[y];
+
+        qsort(x, count, sizeof(double), compareDoubles);
+
+        for(int k = 0; k + 1 < count; k += 2)
+        {
+            int first = (int) fmax(0.0, ceil((x[k] + 1.0) * width / 2.0 - 0.5));
+            int last = (int) fmin(width - 1.0, floor((x[k + 1] + 1.0) * width / 2.0 - 0.5));
+
+            if(first > last)
+                continue;
+
+            if(scratch->span_count == scratch->span_capacity)
+            {
+                scratch->span_capacity *= 2;
+                scratch->spans = realloc(scratch->spans, scratch->span_capacity * sizeof(GuardSpan));
+                if(!scratch->spans)
+                {
+                    fprintf(stderr, "Out of memory placing guards\n");
+                    exit(-1);
+                }
+            }
+
+            scratch->spans[scratch->span_count++] = (GuardSpan){y, first, last};
+        }
+    }
+}
+
+/* Count the targets a candidate sees that are not covered yet. Rows of the grid are row_words words apart in covered. */
+int guardGain(const GuardVisibility* v, const uint64_t* covered, int row_words)
+{
+    int gain = 0;
+
+    for(int i = 0; i < v->count; ++i)
+        gain += countClearBits(&covered[(size_t) v->spans[i].row * row_words], v->spans[i].first, v->spans[i].last);
+
+    return gain;
+}
+
+/* Move a candidate down the max-heap until neither child has a larger gain */
+void siftGuardCandidate(GuardCandidate* heap, int count, int slot)
+{
+    GuardCandidate moved = heap[slot];
+
+    for(;;)
+    {
+        int child = 2 * slot + 1;
+        if(child >= count)
+            break;
+        if(child + 1 < count && heap[child + 1].gain > heap[child].gain)
+            ++child;
+        if(heap[child].gain <= moved.gain)
+            break;
+
+        heap[slot] = heap[child];
+        slot = child;
+    }
+
+    heap[slot] = moved;
+}
+
+/* Order candidates by descending gain for qsort. A sorted array is also a valid max-heap. */
+int compareGuardCandidates(const void* a, const void* b)
+{
+    return ((const GuardCandidate*) b)->gain - ((const GuardCandidate*) a)->gain;
+}
+
+/*  Pick up to count guard positions among the cell centers of a width by height grid over the window that together see as many
+    cells as possible, and print them. Returns 0 on failure. */
+int placeGuards(int count, int width, int height)
+{
+    int cells = width * height;
+    int row_words = (width + 63) / 64;
+    GuardVisibility* visible = calloc(cells, sizeof(GuardVisibility));
+    uint64_t* covered = calloc((size_t) height * row_words, sizeof(uint64_t));
+    GuardCandidate* heap = malloc(cells * sizeof(GuardCandidate));
+    Point* centers = malloc(cells * sizeof(Point));
+    Point directions[COVERAGE_RAYS];
+    int ok = 1;
+
+    if(!visible || !covered || !heap || !centers)
+    {
+        fprintf(stderr, "Out of memory placing guards (%d cells)\n", cells);
+        free(visible);
+        free(covered);
+        free(heap);
+        free(centers);
+        return 0;
+    }
+
+    fanDirections(directions);
+
+    for(int y = 0; y < height; ++y)
+        for(int x = 0; x < width; ++x)
+            centers[y * width + x] = (Point){-1.0 + (x + 0.5) * 2.0 / width, 1.0 - (y + 0.5) * 2.0 / height};
+
+    double start = omp_get_wtime();
+
+    /* Evaluate every candidate from scratch */
+    #pragma omp parallel
+    {
+        Ray* rays = malloc(COVERAGE_RAYS * sizeof(Ray));
+        RayHit* hits = malloc(COVERAGE_RAYS * sizeof(RayHit));
+        GuardScratch* scratch = malloc(sizeof(GuardScratch));
+        if(!rays || !hits || !scratch)
+        {
+            fprintf(stderr, "Out of memory placing guards\n");
+            exit(-1);
+        }
+
+        scratch->row_starts = malloc((height + 1) * sizeof(int));
+        scratch->crossing_capacity = 4 * COVERAGE_RAYS;
+        scratch->crossings = malloc(scratch->crossing_capacity * sizeof(double));
+        scratch->span_capacity = 4 * COVERAGE_RAYS;
+        scratch->spans = malloc(scratch->span_capacity * sizeof(GuardSpan));
+        if(!scratch->row_starts || !scratch->crossings || !scratch->spans)
+        {
+            fprintf(stderr, "Out of memory placing guards\n");
+            exit(-1);
+        }
+
+        #pragma omp for schedule(dynamic, 16)
+        for(int c = 0; c < cells; ++c)
+        {
+            GuardVisibility* v = &visible[c];
+            Point center = centers[c];
+
+            castVisibilityFan(center, directions, rays, hits);
+            for(int i = 0; i < COVERAGE_RAYS; ++i)
+                scratch->outline[i] = (Point){center.x + hits[i].t * directions[i].x, center.y + hits[i].t * directions[i].y};
+
+            scanFanVisibility(scratch, width, height);
+
+            v->spans = malloc((scratch->span_count + 1) * sizeof(GuardSpan));
+            if(!v->spans)
+            {
+                heap[c] = (GuardCandidate){0, c, 0};
+                #pragma omp atomic write
+                ok = 0;
+                continue;
+            }
+
+            memcpy(v->spans, scratch->spans, scratch->span_count * sizeof(GuardSpan));
+            v->count = scratch->span_count;
+            heap[c] = (GuardCandidate){guardGain(v, covered, row_words), c, 0};
+        }
+
+        free(rays);
+        free(hits);
+        free(scratch->row_starts);
+        free(scratch->crossings);
+        free(scratch->spans);
+        free(scratch);
+    }
+
+    if(!ok)
+    {
+        fprintf(stderr, "Out of memory placing guards: what the %d by %d cells see does not fit, try a coarser grid\n", width, height);
+        count = 0;
+    }
+
+    double evaluated = omp_get_wtime();
+    qsort(heap, cells, sizeof(GuardCandidate), compareGuardCandidates);
+
+    int heap_count = cells;
+    int covered_count = 0;
+    long long evaluations = cells;
+
+    for(int guard = 0; guard < count && heap_count > 0; )
+    {
+        GuardCandidate* top = &heap[0];
+        const GuardVisibility* v = &visible[top->candidate];
+
+        if(top->round != guard)
+        {
+            /* Stale: refresh the gain and let the candidate sink to its place */
+            top->gain = guardGain(v, covered, row_words);
+            top->round = guard;
+            ++evaluations;
+            siftGuardCandidate(heap, heap_count, 0);
+            continue;
+        }
+
+        if(top->gain == 0)
+            break;
+
+        for(int i = 0; i < v->count; ++i)
+            setBitRange(&covered[(size_t) v->spans[i].row * row_words], v->spans[i].first, v->spans[i].last);
+        covered_count += top->gain;
+
+        Point p = centers[top->candidate];
+        printf("guard %d at %.4f %.4f sees %d more cells, %.1f%% covered\n", guard + 1, p.x, p.y, top->gain, 100.0 * covered_count / cells);
+
+        heap[0] = heap[--heap_count];
+        siftGuardCandidate(heap, heap_count, 0);
+        ++guard;
+    }
+
+    if(ok)
+        printf("%d candidates evaluated in %.2f s, then %lld lazy evaluations in %.3f s\n", cells, evaluated - start, evaluations - cells, omp_get_wtime() - evaluated);
+
+    for(int c = 0; c < cells; ++c)
+        free(visible[c].spans);
+    free(visible);
+    free(covered);
+    free(heap);
+    free(centers);
+    return ok;
+}
+
+#ifdef __linux__
+
+/*  The query server loads a scene once and answers queries from other processes over a Unix domain socket. A request is a header
+    of two uint32s, the query type and the number of queries, followed by the queries. Every request is answered, in order, by a
+    uint32 status and the uint32 size in bytes of the results that follow. The status is SERVER_OK, or SERVER_ERROR for a request
+    of an unknown type or with too many queries, after which the connection is closed. All values are packed, in the machine's
+    byte order.
+        SERVER_NEAREST      Queries are 4 doubles, ox oy dx dy. Each result is a double t, clipped to the borders, and the int32
+                            index of the wall hit (-1 for the borders) by the ray origin + t * dir.
+        SERVER_OCCLUSION    Queries are 4 doubles, x1 y1 x2 y2. Each result is one byte, 1 if a wall crosses the segment.
+        SERVER_POLYGON      Queries are 2 doubles, x y, and a uint32 ray count. Each result is the ray count followed by that many
+                            points as 2 doubles, the visibility polygon around the point, cast the same way as for a light.
+    The event loop reads every request that has arrived from every client before answering any, and casts all of their rays as
+    one batch, so many clients sending small requests keep every core busy. */
+#define SERVER_NEAREST 1
+#define SERVER_OCCLUSION 2
+#define SERVER_POLYGON 3
+#define SERVER_INVALID 4     // Stands in for a request that cannot be answered in the batch
+#define SERVER_OK 0
+#define SERVER_ERROR 1
+#define SERVER_MAX_QUERIES (1 << 20)    // Rays or segments in one request
+#define SERVER_BATCH_QUERIES (1 << 22)  // Rays and segments in one batch. Requests past this wait for the next batch.
+#define SERVER_MAX_CONNECTIONS 1024
+#define SERVER_READ_SIZE 65536
+
+typedef struct{
+    int fd;             // -1 for an unused connection
+    unsigned char* in;
+    size_t in_length, in_parsed, in_capacity;
+    unsigned char* out;
+    size_t out_length, out_sent, out_capacity;
+    int closing;        // The client hung up or sent a bad request. The connection is closed once its requests are answered.
+    int writing;        // Waiting for the socket to take more output
+} ServerConnection;
+
+typedef struct{
+    ServerConnection* connection;
+    uint32_t type, count;
+    const unsigned char* queries;
+    int first;          // Index of the request's first ray or segment in the batch
+} ServerRequest;
+
+static ServerConnection server_connections[SERVER_MAX_CONNECTIONS];
+static int server_epoll = -1;
+static ServerRequest* server_requests = NULL;
+static int server_request_count = 0;
+static int server_request_capacity = 0;
+static long long server_batch_queries = 0;
+
+/* Grow a connection buffer to hold at least size bytes */
+void reserveServerBuffer(unsigned char** buffer, size_t* capacity, size_t size)
+{
+    if(*capacity >= size)
+        return;
+
+    size_t grown = *capacity ? *capacity : SERVER_READ_SIZE;
+    while(grown < size)
+        grown *= 2;
+
+    unsigned char* resized = realloc(*buffer, grown);
+    if(!resized)
+    {
+        fprintf(stderr, "Out of memory allocating a connection buffer\n");
+        exit(-1);
+    }
+
+    *buffer = resized;
+    *capacity = grown;
+}
+
+/* Append bytes to a connection's output */
+void appendServerOutput(ServerConnection* c, const void* bytes, size_t size)
+{
+    reserveServerBuffer(&c->out, &c->out_capacity, c->out_length + size);
+    memcpy(c->out + c->out_length, bytes, size);
+    c->out_length += size;
+}
+
+/* Append the status and size that start every answer */
+void appendServerHeader(ServerConnection* c, uint32_t status, uint32_t size)
+{
+    appendServerOutput(c, &status, sizeof(status));
+    appendServerOutput(c, &size, sizeof(size));
+}
+
+/* Accept every client waiting on the listening socket */
+void acceptServerConnections(int listener)
+{
+    for(;;)
+    {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "Could not accept a connection: %s\n", strerror(errno));
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+
+        int id = 0;
+        while(id < SERVER_MAX_CONNECTIONS && server_connections[id].fd >= 0)
+            ++id;
+
+        if(id == SERVER_MAX_CONNECTIONS)
+        {
+            fprintf(stderr, "Too many connections, turning one away\n");
+            close(fd);
+            continue;
+        }
+
+        ServerConnection* c = &server_connections[id];
+        c->fd = fd;
+        c->in_length = c->in_parsed = 0;
+        c->out_length = c->out_sent = 0;
+        c->closing = c->writing = 0;
+
+        struct epoll_event event = {EPOLLIN, {.u32 = (uint32_t) id}};
+        if(epoll_ctl(server_epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            fprintf(stderr, "Could not watch a connection: %s\n", strerror(errno));
+            close(fd);
+            c->fd = -1;
+        }
+    }
+}
+
+/* Read everything a client has sent so far */
+void readServerConnection(ServerConnection* c)
+{
+    for(;;)
+    {
+        reserveServerBuffer(&c->in, &c->in_capacity, c->in_length + SERVER_READ_SIZE);
+
+        ssize_t received = read(c->fd, c->in + c->in_length, c->in_capacity - c->in_length);
+        if(received > 0)
+            c->in_length += received;
+        else if(received < 0 && errno == EINTR)
+            continue;
+        else
+        {
+            if(received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                c->closing = 1;
+            return;
+        }
+    }
+}
+
+/* Send as much of a connection's output as the socket takes, and wait for it to take more if anything is left */
+void flushServerConnection(ServerConnection* c)
+{
+    while(c->out_sent < c->out_length)
+    {
+        ssize_t sent = send(c->fd, c->out + c->out_sent, c->out_length - c->out_sent, MSG_NOSIGNAL);
+        if(sent > 0)
+            c->out_sent += sent;
+        else if(sent < 0 && errno == EINTR)
+            continue;
+        else if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+        {
+            /* The client is gone, so nothing more can be sent to it */
+            c->closing = 1;
+            c->out_sent = c->out_length;
+        }
+    }
+
+    int writing = c->out_sent < c->out_length;
+    if(writing != c->writing)
+    {
+        struct epoll_event event = {writing ? EPOLLIN | EPOLLOUT : EPOLLIN, {.u32 = (uint32_t) (c - server_connections)}};
+        epoll_ctl(server_epoll, EPOLL_CTL_MOD, c->fd, &event);
+        c->writing = writing;
+    }
+
+    if(!writing)
+        c->out_length = c->out_sent = 0;
+}
+
+void closeServerConnection(ServerConnection* c)
+{
+    epoll_ctl(server_epoll, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* Add a request to the batch */
+void addServerRequest(ServerConnection* c, uint32_t type, uint32_t count, const unsigned char* queries)
+{
+    if(server_request_count == server_request_capacity)
+    {
+        server_request_capacity = server_request_capacity ? 2 * server_request_capacity : 256;
+        server_requests = realloc(server_requests, server_request_capacity * sizeof(ServerRequest));
+        if(!server_requests)
+        {
+            fprintf(stderr, "Out of memory allocating requests\n");
+            exit(-1);
+        }
+    }
+
+    server_requests[server_request_count++] = (ServerRequest){c, type, count, queries, 0};
+}
+
+/*  Add the complete requests a connection has sent to the batch. Returns 0 if the batch filled up before every request could be
+    added. A request that cannot be answered is added as SERVER_INVALID, to be answered with an error in its turn, and closes
+    the connection. */
+int parseServerRequests(ServerConnection* c)
+{
+    while(c->in_length - c->in_parsed >= 2 * sizeof(uint32_t))
+    {
+        const unsigned char* header = c->in + c->in_parsed;
+        uint32_t type, count;
+        memcpy(&type, header, sizeof(type));
+        memcpy(&count, header + sizeof(type), sizeof(count));
+
+        size_t query_size = type == SERVER_POLYGON ? 2 * sizeof(double) + sizeof(uint32_t) : 4 * sizeof(double);
+        if((type != SERVER_NEAREST && type != SERVER_OCCLUSION && type != SERVER_POLYGON) || count > SERVER_MAX_QUERIES)
+        {
+            addServerRequest(c, SERVER_INVALID, 0, NULL);
+            c->in_parsed = c->in_length;
+            c->closing = 1;
+            break;
+        }
+
+        size_t size = 2 * sizeof(uint32_t) + count * query_size;
+        if(c->in_length - c->in_parsed < size)
+            break;
+
+        /* A polygon request casts as many rays as its polygons have points */
+        long long queries = count;
+        if(type == SERVER_POLYGON)
+        {
+            queries = 0;
+            for(uint32_t i = 0; i < count; ++i)
+            {
+                uint32_t rays;
+                memcpy(&rays, header + 2 * sizeof(uint32_t) + i * query_size + 2 * sizeof(double), sizeof(rays));
+                queries += rays;
+            }
+
+            if(queries > SERVER_MAX_QUERIES)
+            {
+                addServerRequest(c, SERVER_INVALID, 0, NULL);
+                c->in_parsed = c->in_length;
+                c->closing = 1;
+                break;
+            }
+        }
+
+        if(server_request_count && server_batch_queries + queries > SERVER_BATCH_QUERIES)
+            return 0;
+
+        addServerRequest(c, type, count, header + 2 * sizeof(uint32_t));
+        server_batch_queries += queries;
+        c->in_parsed += size;
+    }
+
+    return 1;
+}
+
+/*  Answer every request in the batch. The rays of all nearest hit and polygon requests are cast as one batch, and the segments of
+    all occlusion requests are tested in parallel, before the answers are appended to each connection's output in order. */
+void runServerBatch(void)
+{
+    static Ray* rays = NULL;
+    static RayHit* hits = NULL;
+    static int ray_capacity = 0;
+    static Point* segments = NULL;
+    static unsigned char* occluded = NULL;
+    static int segment_capacity = 0;
+
+    int ray_count = 0, segment_count = 0;
+
+    for(int i = 0; i < server_request_count; ++i)
+    {
+        ServerRequest* r = &server_requests[i];
+
+        if(r->type == SERVER_OCCLUSION)
+        {
+            r->first = segment_count;
+            segment_count += r->count;
+            continue;
+        }
+
+        r->first = ray_count;
+        if(r->type == SERVER_NEAREST)
+            ray_count += r->count;
+        else if(r->type == SERVER_POLYGON)
+            for(uint32_t k = 0; k < r->count; ++k)
+            {
+                uint32_t polygon_rays;
+                memcpy(&polygon_rays, r->queries + k * (2 * sizeof(double) + sizeof(uint32_t)) + 2 * sizeof(double), sizeof(polygon_rays));
+                ray_count += polygon_rays;
+            }
+    }
+
+    if(ray_capacity < ray_count)
+    {
+        free(rays);
+        free(hits);
+        ray_capacity = ray_count;
+        rays = malloc(ray_capacity * sizeof(Ray));
+        hits = malloc(ray_capacity * sizeof(RayHit));
+        if(!rays || !hits)
+        {
+            fprintf(stderr, "Out of memory allocating rays\n");
+            exit(-1);
+        }
+    }
+
+    if(segment_capacity < segment_count)
+    {
+        free(segments);
+        free(occluded);
+        segment_capacity = segment_count;
+        segments = malloc(segment_capacity * 2 * sizeof(Point));
+        occluded = malloc(segment_capacity);
+        if(!segments || !occluded)
+        {
+            fprintf(stderr, "Out of memory allocating segments\n");
+            exit(-1);
+        }
+    }
+
+    /* Unpack the queries */
+    for(int i = 0; i < server_request_count; ++i)
+    {
+        const ServerRequest* r = &server_requests[i];
+        const unsigned char* query = r->queries;
+
+        if(r->type == SERVER_NEAREST || r->type == SERVER_OCCLUSION)
+        {
+            for(uint32_t k = 0; k < r->count; ++k, query += 4 * sizeof(double))
+            {
+                double v[4];
+                memcpy(v, query, sizeof(v));
+
+                if(r->type == SERVER_NEAREST)
+                    rays[r->first + k] = (Ray){{v[0], v[1]}, {v[2], v[3]}};
+                else
+                {
+                    segments[2 * (r->first + k)] = (Point){v[0], v[1]};
+                    segments[2 * (r->first + k) + 1] = (Point){v[2], v[3]};
+                }
+            }
+            continue;
+        }
+
+        int next = r->first;
+        for(uint32_t k = 0; k < r->count && r->type == SERVER_POLYGON; ++k, query += 2 * sizeof(double) + sizeof(uint32_t))
+        {
+            Point origin;
+            uint32_t polygon_rays;
+            memcpy(&origin.x, query, sizeof(double));
+            memcpy(&origin.y, query + sizeof(double), sizeof(double));
+            memcpy(&polygon_rays, query + 2 * sizeof(double), sizeof(polygon_rays));
+
+            double inc = 2.0 * PI / polygon_rays;
+            for(uint32_t j = 0; j < polygon_rays; ++j)
+                rays[next++] = (Ray){origin, {cos(j * inc), monitor_widescreen_compensation * sin(j * inc)}};
+        }
+    }
+
+    castRayBatch(rays, hits, ray_count);
+
+    #pragma omp parallel for schedule(dynamic, 64) if(segment_count > 256)
+    for(int i = 0; i < segment_count; ++i)
+        occluded[i] = (unsigned char) segmentOccluded(segments[2 * i], segments[2 * i + 1]);
+
+    /* Answer each request */
+    for(int i = 0; i < server_request_count; ++i)
+    {
+        const ServerRequest* r = &server_requests[i];
+        ServerConnection* c = r->connection;
+
+        if(r->type == SERVER_NEAREST)
+        {
+            appendServerHeader(c, SERVER_OK, r->count * (sizeof(double) + sizeof(int32_t)));
+            for(uint32_t k = 0; k < r->count; ++k)
+            {
+                const RayHit* hit = &hits[r->first + k];
+                int32_t wall = hit->wall;
+
+                appendServerOutput(c, &hit->t, sizeof(double));
+                appendServerOutput(c, &wall, sizeof(wall));
+            }
+        }
+        else if(r->type == SERVER_OCCLUSION)
+        {
+            appendServerHeader(c, SERVER_OK, r->count);
+            appendServerOutput(c, &occluded[r->first], r->count);
+        }
+        else if(r->type == SERVER_INVALID)
+            appendServerHeader(c, SERVER_ERROR, 0);
+        else
+        {
+            const unsigned char* query = r->queries;
+            int next = r->first;
+            uint32_t size = 0;
+
+            for(uint32_t k = 0; k < r->count; ++k)
+            {
+                uint32_t polygon_rays;
+                memcpy(&polygon_rays, query + k * (2 * sizeof(double) + sizeof(uint32_t)) + 2 * sizeof(double), sizeof(polygon_rays));
+                size += sizeof(uint32_t) + polygon_rays * 2 * sizeof(double);
+            }
+
+            appendServerHeader(c, SERVER_OK, size);
+            for(uint32_t k = 0; k < r->count; ++k, query += 2 * sizeof(double) + sizeof(uint32_t))
+            {
+                uint32_t polygon_rays;
+                memcpy(&polygon_rays, query + 2 * sizeof(double), sizeof(polygon_rays));
+                appendServerOutput(c, &polygon_rays, sizeof(polygon_rays));
+
+                for(uint32_t j = 0; j < polygon_rays; ++j, ++next)
+                {
+                    double p[2] = {rays[next].origin.x + hits[next].t * rays[next].dir.x, rays[next].origin.y + hits[next].t * rays[next].dir.y};
+                    appendServerOutput(c, p, sizeof(p));
+                }
+            }
+        }
+    }
+
+    server_request_count = 0;
+    server_batch_queries = 0;
+}
+
+/* Answer queries on a Unix domain socket at the given path until the process is stopped */
+int runServer(const char* socket_path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if(strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long\n", socket_path);
+        return 0;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    /* Replace the socket a previous server left behind, but nothing else */
+    struct stat status;
+    if(stat(socket_path, &status) == 0 && S_ISSOCK(status.st_mode))
+        unlink(socket_path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Could not listen on %s: %s\n", socket_path, strerror(errno));
+        return 0;
+    }
+
+    server_epoll = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {EPOLLIN, {.u32 = SERVER_MAX_CONNECTIONS}};
+    if(server_epoll < 0 || epoll_ctl(server_epoll, EPOLL_CTL_ADD, listener, &event) != 0)
+    {
+        fprintf(stderr, "Could not create an epoll instance: %s\n", strerror(errno));
+        return 0;
+    }
+
+    for(int i = 0; i < SERVER_MAX_CONNECTIONS; ++i)
+        server_connections[i].fd = -1;
+
+    printf("Answering queries on %s\n", socket_path);
+    fflush(stdout);
+
+    int pending = 0;    // Whether requests that did not fit in the last batch are still waiting
+
+    for(;;)
+    {
+        struct epoll_event events[64];
+        int ready = epoll_wait(server_epoll, events, 64, pending ? 0 : -1);
+        if(ready < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "Waiting for clients failed: %s\n", strerror(errno));
+            return 0;
+        }
+
+        for(int i = 0; i < ready; ++i)
+        {
+            if(events[i].data.u32 == SERVER_MAX_CONNECTIONS)
+            {
+                acceptServerConnections(listener);
+                continue;
+            }
+
+            ServerConnection* c = &server_connections[events[i].data.u32];
+            if(events[i].events & EPOLLOUT)
+                flushServerConnection(c);
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                readServerConnection(c);
+        }
+
+        /* Batch up everything that has arrived, answer it, and send the answers */
+        pending = 0;
+        for(int i = 0; i < SERVER_MAX_CONNECTIONS; ++i)
+            if(server_connections[i].fd >= 0 && !parseServerRequests(&server_connections[i]))
+                pending = 1;
+
+        if(server_request_count)
+            runServerBatch();
+
+        for(int i = 0; i < SERVER_MAX_CONNECTIONS; ++i)
+        {
+            ServerConnection* c = &server_connections[i];
+            if(c->fd < 0)
+                continue;
+
+            if(c->in_parsed)
+            {
+                memmove(c->in, c->in + c->in_parsed, c->in_length - c->in_parsed);
+                c->in_length -= c->in_parsed;
+                c->in_parsed = 0;
+            }
+
+            if(c->out_length > c->out_sent)
+                flushServerConnection(c);
+
+            /* Whatever is left once every complete request is answered is a request the client never finished */
+            if(c->closing && c->out_sent == c->out_length && (c->in_length == 0 || !pending))
+                closeServerConnection(c);
+        }
+    }
+}
+
+#else
+
+int runServer(const char* socket_path)
+{
+    fprintf(stderr, "The query server is only available on Linux\n");
+    return 0;
+}
+
+#endif
+
+#ifdef __linux__
+
+/*  Shared memory queries let processes on the same machine cast rays without going through a socket. The server creates a shared
+    memory object laid out as a ShmHeader followed by SHM_SLOTS slots. A client claims a free slot by swapping its state from
+    SHM_FREE to SHM_CLAIMED, writes its queries straight into the slot, marks it SHM_READY and pushes the slot's index onto the
+    request ring, a lock-free multi-producer multi-consumer queue. A worker thread takes the index, casts the queries straight into
+    the slot's results and marks it SHM_DONE. The client then reads the results in place and frees the slot, so nothing is copied
+    on either side.
+
+    Both sides spin for a while before sleeping on a futex. A client that sleeps sets SHM_WAITER in the slot's state so the worker
+    knows to wake it, and a worker that sleeps counts itself in sleepers so clients know to wake one through work. All of it is
+    address-free, so the two processes may map the object at different addresses.
+
+    A slot holds up to SHM_SLOT_QUERIES queries of 4 doubles, followed by as many results of a double and two int32s:
+        SHM_NEAREST     Queries are ox oy dx dy. The result is t, clipped to the borders, and the index of the wall hit by the ray
+                        origin + t * dir (-1 for the borders).
+        SHM_OCCLUSION   Queries are x1 y1 x2 y2. The result's wall is 1 if a wall crosses the segment and 0 if not.
+    The second int32 of each result is unused. --shm-bench is a client that doubles as an example. */
+#define SHM_MAGIC 0x4d485352        // "RSHM"
+#define SHM_VERSION 1
+#define SHM_SLOTS 32                // A power of two, so the ring can be indexed with a mask
+#define SHM_SLOT_QUERIES 32768
+#define SHM_SPIN 20000              // Times to check for work or results before sleeping, when there is a core to spare
+#define SHM_PARALLEL_QUERIES 4096   // Requests larger than this are cast by the worker's share of the cores rather than by it alone
+
+#define SHM_NEAREST 1
+#define SHM_OCCLUSION 2
+
+enum{
+    SHM_FREE,
+    SHM_CLAIMED,
+    SHM_READY,
+    SHM_DONE,
+    SHM_WAITER = 0x100
+};
+
+typedef struct{
+    _Atomic uint64_t sequence;
+    uint32_t slot;
+} ShmRingCell;
+
+typedef struct{
+    uint32_t magic, version;
+    uint32_t slot_count, slot_queries;
+    uint64_t slots_offset, slot_size;   // Where the first slot starts and the distance between slots, in bytes
+
+    alignas(64) _Atomic uint64_t enqueue_position;
+    alignas(64) _Atomic uint64_t dequeue_position;
+    alignas(64) _Atomic uint32_t work;  // Futex word, bumped whenever a request is pushed
+    _Atomic uint32_t sleepers;          // Workers sleeping on work
+    alignas(64) ShmRingCell ring[SHM_SLOTS];
+} ShmHeader;
+
+typedef struct{
+    alignas(64) _Atomic uint32_t state; // Futex word for the client waiting on the results
+    uint32_t type, count;
+} ShmSlot;
+
+typedef struct{
+    double t;
+    int32_t wall, unused;
+} ShmResult;
+
+#define SHM_SLOT_HEADER 64
+#define SHM_SLOT_SIZE (SHM_SLOT_HEADER + (uint64_t) SHM_SLOT_QUERIES * (4 * sizeof(double) + sizeof(ShmResult)))
+#define SHM_SLOTS_OFFSET ((sizeof(ShmHeader) + 4095) / 4096 * 4096)
+#define SHM_SIZE (SHM_SLOTS_OFFSET + SHM_SLOTS * SHM_SLOT_SIZE)
+
+static ShmHeader* shm_header = NULL;
+static int shm_spin = 0;    // SHM_SPIN on machines with more than one core. With one, spinning only delays the other side.
+static int shm_team_size = 1;   // Threads each worker casts a large request with, so the workers together fill the cores once
+
+long futexWait(_Atomic uint32_t* word, uint32_t expected)
+{
+    return syscall(SYS_futex, word, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+long futexWake(_Atomic uint32_t* word, int count)
+{
+    return syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+/*  The layout written into the header is for other clients to read. Both sides here use the constants it was written from, so
+    the server never follows offsets a client could have changed. */
+ShmSlot* shmSlot(ShmHeader* header, uint32_t index)
+{
+    return (ShmSlot*) ((unsigned char*) header + SHM_SLOTS_OFFSET + index * SHM_SLOT_SIZE);
+}
+
+double* shmQueries(ShmSlot* slot)
+{
+    return (double*) ((unsigned char*) slot + SHM_SLOT_HEADER);
+}
+
+ShmResult* shmResults(ShmSlot* slot)
+{
+    return (ShmResult*) ((unsigned char*) slot + SHM_SLOT_HEADER + (size_t) SHM_SLOT_QUERIES * 4 * sizeof(double));
+}
+
+/* Push a slot index onto the request ring. There are never more slots in flight than the ring holds, so it cannot be full. */
+void pushShmRequest(ShmHeader* header, uint32_t slot)
+{
+    uint64_t position = atomic_load_explicit(&header->enqueue_position, memory_order_relaxed);
+    ShmRingCell* cell;
+
+    for(;;)
+    {
+        cell = &header->ring[position & (SHM_SLOTS - 1)];
+        int64_t difference = (int64_t) atomic_load_explicit(&cell->sequence, memory_order_acquire) - (int64_t) position;
+
+        if(difference == 0 && atomic_compare_exchange_weak_explicit(&header->enqueue_position, &position, position + 1,
+                                                                      memory_order_relaxed, memory_order_relaxed))
+            break;
+        if(difference != 0)
+            position = atomic_load_explicit(&header->enqueue_position, memory_order_relaxed);
+    }
+
+    cell->slot = slot;
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+
+    /* Wake a worker if they are all asleep */
+    atomic_fetch_add(&header->work, 1);
+    if(atomic_load(&header->sleepers))
+        futexWake(&header->work, 1);
+}
+
+/* Take a slot index off the request ring, as the client wrote it. Returns -1 if the ring is empty. */
+int64_t popShmRequest(ShmHeader* header)
+{
+    uint64_t position = atomic_load_explicit(&header->dequeue_position, memory_order_relaxed);
+    ShmRingCell* cell;
+
+    for(;;)
+    {
+        cell = &header->ring[position & (SHM_SLOTS - 1)];
+        int64_t difference = (int64_t) atomic_load_explicit(&cell->sequence, memory_order_acquire) - (int64_t) (position + 1);
+
+        if(difference < 0)
+            return -1;
+        if(difference == 0 && atomic_compare_exchange_weak_explicit(&header->dequeue_position, &position, position + 1,
+                                                                      memory_order_relaxed, memory_order_relaxed))
+            break;
+        if(difference != 0)
+            position = atomic_load_explicit(&header->dequeue_position, memory_order_relaxed);
+    }
+
+    uint32_t slot = cell->slot;
+    atomic_store_explicit(&cell->sequence, position + SHM_SLOTS, memory_order_release);
+    return slot;
+}
+
+/* Cast the queries in a slot into its results, and wake the client if it is asleep */
+void answerShmRequest(ShmSlot* slot)
+{
+    const double* queries = shmQueries(slot);
+    ShmResult* results = shmResults(slot);
+    int count = (int) (slot->count < SHM_SLOT_QUERIES ? slot->count : SHM_SLOT_QUERIES);
+    uint32_t type = slot->type;
+
+    #pragma omp parallel for schedule(static, 256) num_threads(shm_team_size) if(count > SHM_PARALLEL_QUERIES)
+    for(int i = 0; i < count; ++i)
+    {
+        const double* q = &queries[4 * i];
+
+        if(type == SHM_NEAREST)
+        {
+            Point origin = {q[0], q[1]}, dir = {q[2], q[3]};
+            int wall;
+            double t = castRay(origin, dir, &wall);
+            double border = borderExit(origin, dir);
+
+            results[i] = t < border ? (ShmResult){t, wall, 0} : (ShmResult){border, -1, 0};
+        }
+        else
+            results[i] = (ShmResult){0.0, type == SHM_OCCLUSION ? segmentOccluded((Point){q[0], q[1]}, (Point){q[2], q[3]}) : 0, 0};
+    }
+
+    if(atomic_exchange_explicit(&slot->state, SHM_DONE, memory_order_release) & SHM_WAITER)
+        futexWake(&slot->state, 1);
+}
+
+/* A worker thread. Answers requests from the ring, spinning for a while when it is empty before going to sleep. */
+void* shmWorker(void* unused)
+{
+    ShmHeader* header = shm_header;
+
+    for(;;)
+    {
+        int64_t slot = -1;
+
+        for(int spin = 0; spin < shm_spin && slot < 0; ++spin)
+            slot = popShmRequest(header);
+
+        if(slot < 0)
+        {
+            uint32_t seen = atomic_load(&header->work);
+            atomic_fetch_add(&header->sleepers, 1);
+
+            slot = popShmRequest(header);
+            if(slot < 0)
+                futexWait(&header->work, seen);
+
+            atomic_fetch_sub(&header->sleepers, 1);
+            if(slot < 0)
+                continue;
+        }
+
+        if(slot >= SHM_SLOTS)
+        {
+            fprintf(stderr, "Ignoring a request for slot %lld, there are only %d\n", (long long) slot, SHM_SLOTS);
+            continue;
+        }
+
+        answerShmRequest(shmSlot(header, (uint32_t) slot));
+    }
+
+    return NULL;
+}
+
+/* Create the shared memory object and answer queries through it with the given number of worker threads until stopped */
+int runShmServer(const char* name, int worker_count)
+{
+    shm_spin = omp_get_num_procs() > 1 ? SHM_SPIN : 0;
+    shm_team_size = omp_get_max_threads() / worker_count > 1 ? omp_get_max_threads() / worker_count : 1;
+    shm_unlink(name);
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0 || ftruncate(fd, SHM_SIZE) != 0)
+    {
+        fprintf(stderr, "Could not create shared memory %s: %s\n", name, strerror(errno));
+        return 0;
+    }
+
+    shm_header = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(shm_header == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map shared memory %s: %s\n", name, strerror(errno));
+        shm_unlink(name);
+        return 0;
+    }
+
+    shm_header->slot_count = SHM_SLOTS;
+    shm_header->slot_queries = SHM_SLOT_QUERIES;
+    shm_header->slots_offset = SHM_SLOTS_OFFSET;
+    shm_header->slot_size = SHM_SLOT_SIZE;
+    atomic_init(&shm_header->enqueue_position, 0);
+    atomic_init(&shm_header->dequeue_position, 0);
+    atomic_init(&shm_header->work, 0);
+    atomic_init(&shm_header->sleepers, 0);
+    for(uint32_t i = 0; i < SHM_SLOTS; ++i)
+    {
+        atomic_init(&shm_header->ring[i].sequence, i);
+        atomic_init(&shmSlot(shm_header, i)->state, SHM_FREE);
+    }
+    shm_header->version = SHM_VERSION;
+
+    /* Clients check the magic number last, once the rest is set up */
+    atomic_thread_fence(memory_order_release);
+    shm_header->magic = SHM_MAGIC;
+
+    pthread_t* workers = malloc(worker_count * sizeof(pthread_t));
+    if(!workers)
+    {
+        fprintf(stderr, "Out of memory allocating workers\n");
+        exit(-1);
+    }
+
+    for(int i = 0; i < worker_count; ++i)
+        if(pthread_create(&workers[i], NULL, shmWorker, NULL) != 0)
+        {
+            fprintf(stderr, "Could not start a worker thread\n");
+            exit(-1);
+        }
+
+    printf("Answering queries in shared memory %s with %d workers\n", name, worker_count);
+    fflush(stdout);
+
+    for(int i = 0; i < worker_count; ++i)
+        pthread_join(workers[i], NULL);
+
+    return 1;
+}
+
+/*  Send count random nearest hit queries through the shared memory of a running server iterations times, and print how long the
+    round trips took, from handing the request over to reading the results. This is also an example of a client. */
+int benchmarkShm(const char* name, int count, int iterations)
+{
+    shm_spin = omp_get_num_procs() > 1 ? SHM_SPIN : 0;
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Could not open shared memory %s: %s\n", name, strerror(errno));
+        return 0;
+    }
+
+    ShmHeader* header = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(header == MAP_FAILED || header->magic != SHM_MAGIC || header->version != SHM_VERSION)
+    {
+        fprintf(stderr, "%s is not a version %d query server\n", name, SHM_VERSION);
+        return 0;
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    if(count <= 0 || iterations <= 0 || count > SHM_SLOT_QUERIES)
+    {
+        fprintf(stderr, "The number of rays must be from 1 to %d and the number of round trips positive\n", SHM_SLOT_QUERIES);
+        return 0;
+    }
+
+    double* times = malloc(iterations * sizeof(double));
+    if(!times)
+    {
+        fprintf(stderr, "Out of memory allocating timings\n");
+        exit(-1);
+    }
+
+    long long walls_hit = 0;
+
+    for(int iteration = 0; iteration < iterations; ++iteration)
+    {
+        /* Claim any free slot */
+        uint32_t index = 0;
+        for(;; index = (index + 1) % header->slot_count)
+        {
+            uint32_t expected = SHM_FREE;
+            if(atomic_compare_exchange_weak(&shmSlot(header, index)->state, &expected, SHM_CLAIMED))
+                break;
+        }
+
+        ShmSlot* slot = shmSlot(header, index);
+        double* queries = shmQueries(slot);
+        for(int i = 0; i < count; ++i)
+        {
+            double angle = randomRange(0.0, 2.0 * PI);
+            queries[4 * i] = randomRange(-1.0, 1.0);
+            queries[4 * i + 1] = randomRange(-1.0, 1.0);
+            queries[4 * i + 2] = cos(angle);
+            queries[4 * i + 3] = sin(angle);
+        }
+        slot->type = SHM_NEAREST;
+        slot->count = (uint32_t) count;
+
+        double start = omp_get_wtime();
+        atomic_store_explicit(&slot->state, SHM_READY, memory_order_release);
+        pushShmRequest(header, index);
+
+        /* Wait for the results, spinning first and then sleeping */
+        uint32_t state = SHM_READY;
+        for(int spin = 0; spin < shm_spin && (state = atomic_load_explicit(&slot->state, memory_order_acquire)) != SHM_DONE; ++spin)
+            ;
+        if(state != SHM_DONE)
+        {
+            uint32_t ready = SHM_READY;
+            if(atomic_compare_exchange_strong(&slot->state, &ready, SHM_READY | SHM_WAITER))
+                while(atomic_load_explicit(&slot->state, memory_order_acquire) != SHM_DONE)
+                    futexWait(&slot->state, SHM_READY | SHM_WAITER);
+            atomic_thread_fence(memory_order_acquire);
+        }
+
+        const ShmResult* results = shmResults(slot);
+        for(int i = 0; i < count; ++i)
+            walls_hit += results[i].wall >= 0;
+
+        atomic_store_explicit(&slot->state, SHM_FREE, memory_order_release);
+        times[iteration] = omp_get_wtime() - start;
+    }
+
+    qsort(times, iterations, sizeof(double), compareDoubles);
+
+    double total = 0.0;
+    for(int i = 0; i < iterations; ++i)
+        total += times[i];
+
+    printf("%d round trips of %d rays: mean %.2f us, median %.2f us, 99th percentile %.2f us, %.1f%% of rays hit a wall\n",
+           iterations, count, 1e6 * total / iterations, 1e6 * times[iterations / 2], 1e6 * times[(int) (iterations * 0.99)],
+           100.0 * walls_hit / ((double) count * iterations));
+
+    free(times);
+    munmap(header, SHM_SIZE);
+    return 1;
+}
+
+#else
+
+int runShmServer(const char* name, int worker_count)
+{
+    fprintf(stderr, "Shared memory queries are only available on Linux\n");
+    return 0;
+}
+
+int benchmarkShm(const char* name, int count, int iterations)
+{
+    fprintf(stderr, "Shared memory queries are only available on Linux\n");
+    return 0;
+}
+
+#endif
+
+/*  The batch tool answers queries read from a file, for jobs that need ray casts outside of the window. The file is either a CSV
+    file, if its name ends in .csv, or packed binary records in the machine's byte order:
+        hits        ox oy dx dy as 4 doubles (CSV: ox,oy,dx,dy). The output for each is a double t, clipped to the borders, and the
+                    int32 index of the wall hit by the ray origin + t * dir (-1 for the borders).
+        polygons    x y as 2 doubles and the number of rays as a uint32 (CSV: x,y,rays). The output for each is the ray count as a
+                    uint32 followed by that many hit points as 2 doubles, the visibility polygon cast the same way as for a light.
+    Blank lines and lines starting with # are skipped in CSV files. The output is packed binary, in the order of the queries.
+    Queries are read and answered BATCH_CHUNK at a time, each chunk in parallel, so files of any size can be processed. */
+#define BATCH_CHUNK 65536
+#define BATCH_CHUNK_RAYS (1 << 22)      // Polygon rays per chunk. A chunk ends early once its polygons have this many.
+#define BATCH_MAX_POLYGON_RAYS (1 << 20)
+
+typedef struct{
+    const unsigned char* data;
+    size_t size, position;
+    int csv;
+    long long line;     // Of a CSV file, for error messages
+} BatchReader;
+
+/* Map a whole file into memory, read only. Returns NULL if it cannot be read. Empty files are mapped as a zero length buffer. */
+const unsigned char* mapFile(const char* path, size_t* size)
+{
+    static const unsigned char empty[1] = {0};
+
+#ifdef __linux__
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if(fd < 0 || fstat(fd, &status) != 0)
+    {
+        fprintf(stderr, "Could not open %s\n", path);
+        if(fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    *size = (size_t) status.st_size;
+    if(*size == 0)
+    {
+        close(fd);
+        return empty;
+    }
+
+    void* data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    /* The file is read from start to end exactly once */
+    madvise(data, *size, MADV_SEQUENTIAL);
+    return data;
+#else
+    FILE* file = fopen(path, "rb");
+    if(!file)
+    {
+        fprintf(stderr, "Could not open %s\n", path);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    *size = (size_t) ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if(*size == 0)
+    {
+        fclose(file);
+        return empty;
+    }
+
+    unsigned char* data = malloc(*size);
+    if(!data)
+    {
+        fprintf(stderr, "Out of memory reading %s\n", path);
+        exit(-1);
+    }
+
+    if(fread(data, 1, *size, file) != *size)
+    {
+        fprintf(stderr, "Could not read %s\n", path);
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file);
+    return data;
+#endif
+}
+
+void unmapFile(const unsigned char* data, size_t size)
+{
+    if(size == 0)
+        return;
+
+#ifdef __linux__
+    munmap((void*) data, size);
+#else
+    free((void*) data);
+#endif
+}
+
+/*  Read the next query's values: 4 for a hit query, 3 for a polygon query with the ray count last. Returns 1 if a query was read,
+    0 at the end of the file and -1 if the file is malformed. */
+int readBatchQuery(BatchReader* reader, int polygons, double* values)
+{
+    int value_count = polygons ? 3 : 4;
+
+    if(!reader->csv)
+    {
+        size_t record = polygons ? 2 * sizeof(double) + sizeof(uint32_t) : 4 * sizeof(double);
+        if(reader->position == reader->size)
+            return 0;
+        if(reader->size - reader->position < record)
+        {
+            fprintf(stderr, "The queries end with a partial record\n");
+            return -1;
+        }
+
+        const unsigned char* p = reader->data + reader->position;
+        memcpy(values, p, (polygons ? 2 : 4) * sizeof(double));
+        if(polygons)
+        {
+            uint32_t rays;
+            memcpy(&rays, p + 2 * sizeof(double), sizeof(rays));
+            values[2] = rays;
+        }
+
+        reader->position += record;
+        return 1;
+    }
+
+    /* Lines are copied out so the numbers can be parsed with strtod without reading past the end of the mapping */
+    while(reader->position < reader->size)
+    {
+        char line[256];
+        size_t length = 0;
+
+        while(reader->position < reader->size && reader->data[reader->position] != '\n')
+        {
+            if(length == sizeof(line) - 1)
+            {
+                fprintf(stderr, "Line %lld of the queries is longer than %d characters\n", reader->line + 1, (int) sizeof(line) - 1);
+                return -1;
+            }
+            line[length++] = (char) reader->data[reader->position++];
+        }
+        ++reader->position;
+        ++reader->line;
+        line[length] = '\0';
+
+        char* p = line;
+        while(*p == ' ' || *p == '\t' || *p == '\r')
+            ++p;
+        if(*p == '\0' || *p == '#')
+            continue;
+
+        for(int i = 0; i < value_count; ++i)
+        {
+            char* end;
+            values[i] = strtod(p, &end);
+            if(end == p)
+            {
+                fprintf(stderr, "Line %lld of the queries should have %d numbers\n", reader->line, value_count);
+                return -1;
+            }
+
+            p = end;
+            while(*p == ' ' || *p == '\t')
+                ++p;
+            if(i + 1 < value_count && *p++ != ',')
+            {
+                fprintf(stderr, "Line %lld of the queries should have %d numbers\n", reader->line, value_count);
+                return -1;
+            }
+        }
+
+        while(*p == ' ' || *p == '\t' || *p == '\r')
+            ++p;
+        if(*p != '\0')
+        {
+            fprintf(stderr, "Line %lld of the queries should have %d numbers\n", reader->line, value_count);
+            return -1;
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Answer every query in a file, casting rays for nearest hits or visibility polygons, and write the results to another */
+int runBatch(int polygons, const char* input_path, const char* output_path)
+{
+    size_t input_size;
+    const unsigned char* input = mapFile(input_path, &input_size);
+    if(!input)
+        return 0;
+
+    FILE* output = fopen(output_path, "wb");
+    if(!output)
+    {
+        fprintf(stderr, "Could not open %s for writing\n", output_path);
+        unmapFile(input, input_size);
+        return 0;
+    }
+
+    size_t length = strlen(input_path);
+    BatchReader reader = {input, input_size, 0, length >= 4 && !strcmp(input_path + length - 4, ".csv"), 0};
+
+    Ray* rays = malloc(BATCH_CHUNK * sizeof(Ray));
+    RayHit* hits = malloc(BATCH_CHUNK * sizeof(RayHit));
+    uint32_t* ray_counts = malloc(BATCH_CHUNK * sizeof(uint32_t));
+    size_t* offsets = malloc((BATCH_CHUNK + 1) * sizeof(size_t));
+    if(!rays || !hits || !ray_counts || !offsets)
+    {
+        fprintf(stderr, "Out of memory allocating queries\n");
+        exit(-1);
+    }
+
+    unsigned char* bytes = NULL;
+    size_t byte_capacity = 0;
+    long long query_count = 0, ray_total = 0;
+    int ok = 1;
+    double start = omp_get_wtime();
+
+    for(;;)
+    {
+        /* Read a chunk of queries */
+        int count = 0, result = 1;
+        long long chunk_rays = 0;
+        double values[4];
+
+        while(count < BATCH_CHUNK && chunk_rays < BATCH_CHUNK_RAYS && (result = readBatchQuery(&reader, polygons, values)) > 0)
+        {
+            if(polygons && (values[2] < 0.0 || values[2] > BATCH_MAX_POLYGON_RAYS || values[2] != floor(values[2])))
+            {
+                fprintf(stderr, "Polygons can have from 0 to %d rays\n", BATCH_MAX_POLYGON_RAYS);
+                result = -1;
+                break;
+            }
+
+            // Polygon queries are only x y rays, so only the origin of their ray is filled in
+            if(polygons)
+                rays[count] = (Ray){{values[0], values[1]}, {0.0, 0.0}};
+            else
+                rays[count] = (Ray){{values[0], values[1]}, {values[2], values[3]}};
+            ray_counts[count] = polygons ? (uint32_t) values[2] : 1;
+            chunk_rays += ray_counts[count];
+            ++count;
+        }
+
+        if(result < 0)
+        {
+            ok = 0;
+            break;
+        }
+        if(count == 0)
+            break;
+
+        /* Lay out the chunk's results, so every query knows where to write */
+        offsets[0] = 0;
+        for(int i = 0; i < count; ++i)
+            offsets[i + 1] = offsets[i] + (polygons ? sizeof(uint32_t) + ray_counts[i] * 2 * sizeof(double) : sizeof(double) + sizeof(int32_t));
+
+        if(byte_capacity < offsets[count])
+        {
+            free(bytes);
+            byte_capacity = offsets[count];
+            bytes = malloc(byte_capacity);
+            if(!bytes)
+            {
+                fprintf(stderr, "Out of memory allocating results\n");
+                exit(-1);
+            }
+        }
+
+        if(polygons)
+        {
+            #pragma omp parallel for schedule(dynamic, 16)
+            for(int i = 0; i < count; ++i)
+            {
+                unsigned char* out = bytes + offsets[i];
+                uint32_t polygon_rays = ray_counts[i];
+                double inc = 2.0 * PI / polygon_rays;
+
+                memcpy(out, &polygon_rays, sizeof(polygon_rays));
+                out += sizeof(polygon_rays);
+
+                for(uint32_t j = 0; j < polygon_rays; ++j, out += 2 * sizeof(double))
+                {
+                    Point dir = {cos(j * inc), monitor_widescreen_compensation * sin(j * inc)};
+                    double t = fmin(castRay(rays[i].origin, dir, NULL), borderExit(rays[i].origin, dir));
+                    double p[2] = {rays[i].origin.x + t * dir.x, rays[i].origin.y + t * dir.y};
+
+                    memcpy(out, p, sizeof(p));
+                }
+            }
+        }
+        else
+        {
+            castRayBatch(rays, hits, count);
+
+            #pragma omp parallel for schedule(static, 4096)
+            for(int i = 0; i < count; ++i)
+            {
+                int32_t wall = hits[i].wall;
+                memcpy(bytes + offsets[i], &hits[i].t, sizeof(double));
+                memcpy(bytes + offsets[i] + sizeof(double), &wall, sizeof(wall));
+            }
+        }
+
+        if(fwrite(bytes, 1, offsets[count], output) != offsets[count])
+        {
+            fprintf(stderr, "Could not write %s\n", output_path);
+            ok = 0;
+            break;
+        }
+
+        query_count += count;
+        ray_total += chunk_rays;
+    }
+
+    if(fclose(output) != 0 && ok)
+    {
+        fprintf(stderr, "Could not write %s\n", output_path);
+        ok = 0;
+    }
+
+    double elapsed = omp_get_wtime() - start;
+    if(ok)
+        printf("Answered %lld queries with %lld rays in %.3f s (%.2f Mrays/s)\n", query_count, ray_total, elapsed,
+               elapsed > 0.0 ? ray_total / elapsed / 1e6 : 0.0);
+
+    free(rays);
+    free(hits);
+    free(ray_counts);
+    free(offsets);
+    free(bytes);
+    unmapFile(input, input_size);
+    return ok;
+}
+
+/* Snap a point to the nearest wall endpoint within EDITOR_PICK_RADIUS pixels, except those of the wall exclude, so walls can meet exactly */
+Point snapToEndpoint(Point p, int exclude)
+{
+    int endpoint;
+    int wall = pickWall(p, exclude, &endpoint);
+
+    if(wall >= 0 && endpoint >= 0)
+        return endpoint ? walls[wall].point2 : walls[wall].point1;
+    return p;
+}
+
+/* Stop editing whatever the left mouse button is holding */
+void cancelEditorDrag(void)
+{
+    editor_drag_wall = -1;
+    editor_drawing = 0;
+}
+
+/* Start an edit where the left mouse button was pressed: grab the endpoint under it, or start drawing a wall from empty space */
+void editorPress(Point p)
+{
+    int endpoint;
+    int wall = pickWall(p, -1, &endpoint);
+
+    if(wall >= 0 && endpoint >= 0)
+    {
+        editor_drag_wall = wall;
+        editor_drag_endpoint = endpoint;
+    }
+    else if(wall < 0)
+    {
+        editor_drawing = 1;
+        editor_draw_start = snapToEndpoint(p, -1);
+    }
+}
+
+/*  Move the dragged endpoint to p. A wall being drawn is only added once p is EDITOR_PICK_RADIUS pixels from its start, and is
+    then dragged by its second endpoint. Walls are never collapsed to a point. */
+void editorDrag(Point p)
+{
+    if(editor_drawing)
+    {
+        if(pixelDistance(p, editor_draw_start) < EDITOR_PICK_RADIUS)
+            return;
+
+        addWall((Line){editor_draw_start, snapToEndpoint(p, -1)}, MATERIAL_OPAQUE, 1.0f);
+        editor_drawing = 0;
+        editor_drag_wall = wall_count - 1;
+        editor_drag_endpoint = 1;
+        return;
+    }
+
+    if(editor_drag_wall < 0)
+        return;
+
+    Line w = walls[editor_drag_wall];
+    Point* moved = editor_drag_endpoint ? &w.point2 : &w.point1;
+    const Point* fixed = editor_drag_endpoint ? &w.point1 : &w.point2;
+    Point q = snapToEndpoint(p, editor_drag_wall);
+
+    /* Leave the wall alone while the cursor rests, so the lights around it keep their cached polygons */
+    if((q.x == moved->x && q.y == moved->y) || (q.x == fixed->x && q.y == fixed->y))
+        return;
+
+    *moved = q;
+    replaceWall(editor_drag_wall, w, wall_materials[editor_drag_wall], wall_opacity[editor_drag_wall]);
+}
+
+/* Follow the cursor once per frame: drag whatever is being dragged, or find the wall under the cursor to highlight */
+void updateEditor(void)
+{
+    if(!editor_active || render_mode == MODE_FIRST_PERSON)
+        return;
+
+    double xpos, ypos;
+    inputCursorPos(&xpos, &ypos);
+    Point p = normalizeMonitorCoordinates(xpos, ypos);
+
+    if(editor_drag_wall >= 0 || editor_drawing)
+    {
+        editorDrag(p);
+        editor_hover_wall = editor_drag_wall;
+        editor_hover_endpoint = editor_drag_wall >= 0 ? editor_drag_endpoint : -1;
+    }
+    else
+        editor_hover_wall = pickWall(p, -1, &editor_hover_endpoint);
+}
+
+/* Highlight the wall under the cursor and the endpoint the cursor is on, or where the wall being drawn starts */
+void drawEditor(void)
+{
+    if(!editor_active)
+        return;
+
+    glColor3f(1.0f, 0.8f, 0.2f);
+    glPointSize(12.0f);
+
+    if(editor_hover_wall >= 0)
+    {
+        const Line* w = &walls[editor_hover_wall];
+
+        glLineWidth(5.0f);
+        glBegin(GL_LINES);
+        glVertex2d(w->point1.x, w->point1.y);
+        glVertex2d(w->point2.x, w->point2.y);
+        glEnd();
+
+        if(editor_hover_endpoint >= 0)
+        {
+            const Point* end = editor_hover_endpoint ? &w->point2 : &w->point1;
+
+            glBegin(GL_POINTS);
+            glVertex2d(end->x, end->y);
+            glEnd();
+        }
+    }
+    else if(editor_drawing)
+    {
+        glBegin(GL_POINTS);
+        glVertex2d(editor_draw_start.x, editor_draw_start.y);
+        glEnd();
+    }
+}
+
+/* Scrolling the mousewheel down reduces the number of rays projected. Scrolling up increases the number. */
+void handleScroll(double yoffset)
+{
+    RAY_DENSITY += yoffset;
+    
+    if(RAY_DENSITY < 0.0)
+        RAY_DENSITY = 0.0;
+    else  if(RAY_DENSITY > 1080.0) // An arbitrary limit. Can go higher, but begins to make your eyes hurt.
+        RAY_DENSITY = 1080.0;
+}
+
+/* Clicking the left mouse button places a light at the cursor, or starts an edit in the editor */
+void handleClick(double xpos, double ypos)
+{
+    if(editor_active && render_mode != MODE_FIRST_PERSON)
+    {
+        editorPress(normalizeMonitorCoordinates(xpos, ypos));
+        return;
+    }
+
+    addLight(normalizeMonitorCoordinates(xpos, ypos), (Point){0.0, 0.0}, (float) randomRange(0.2, 0.6), (float) randomRange(0.2, 0.6), (float) randomRange(0.2, 0.6), 0.5);
+}
+
+/*  The number keys switch the render mode.
+    L adds 100 fixed lights at random positions, holding shift makes them move instead.
+    B adds 1000 agents that wander around, bouncing off the walls.
+    C removes every light and agent.
+    [ and ] decrease and increase the number of reflections off mirrors.
+    E toggles the wall editor, where Delete or Backspace removes the wall under the cursor. */
+void handleKey(int key, int mods)
+{
+    if(key == GLFW_KEY_1)
+        render_mode = MODE_RAYS;
+    else if(key == GLFW_KEY_2)
+        render_mode = MODE_SOFT_SHADOWS;
+    else if(key == GLFW_KEY_3)
+    {
+        render_mode = MODE_PATH_TRACING;
+        path_samples = 0;
+    }
+    else if(key == GLFW_KEY_4)
+        render_mode = MODE_CASCADES;
+    else if(key == GLFW_KEY_5)
+    {
+        double xpos, ypos;
+        inputCursorPos(&xpos, &ypos);
+
+        /* Entering the mode (again) sprays a fresh set of particles from the cursor */
+        render_mode = MODE_PARTICLES;
+        spawnParticles(normalizeMonitorCoordinates(xpos, ypos), MAX_PARTICLES);
+    }
+    else if(key == GLFW_KEY_6)
+        render_mode = MODE_BEAMS;
+    else if(key == GLFW_KEY_7)
+        render_mode = MODE_FOG;
+    else if(key == GLFW_KEY_8)
+    {
+        render_mode = MODE_FIRST_PERSON;
+        player_active = 1;
+    }
+    else if(key == GLFW_KEY_L)
+        spawnRandomLights(100, mods & GLFW_MOD_SHIFT);
+    else if(key == GLFW_KEY_B)
+        spawnAgents(1000);
+    else if(key == GLFW_KEY_C)
+    {
+        clearLights();
+        agent_count = 0;
+    }
+    else if(key == GLFW_KEY_LEFT_BRACKET && REFLECTION_DEPTH > 0)
+        --REFLECTION_DEPTH;
+    else if(key == GLFW_KEY_RIGHT_BRACKET)
+        ++REFLECTION_DEPTH;
+    else if(key == GLFW_KEY_E)
+    {
+        editor_active = !editor_active;
+        editor_hover_wall = -1;
+        cancelEditorDrag();
+    }
+    else if((key == GLFW_KEY_DELETE || key == GLFW_KEY_BACKSPACE) && editor_active && editor_hover_wall >= 0 &&
+            editor_drag_wall < 0 && !editor_drawing)
+    {
+        removeWall(editor_hover_wall);
+        editor_hover_wall = -1;
+    }
+}
+
+/* Releasing the left mouse button finishes the edit it started */
+void handleRelease(double xpos, double ypos)
+{
+    if(!editor_active || render_mode == MODE_FIRST_PERSON)
+        return;
+
+    editorDrag(normalizeMonitorCoordinates(xpos, ypos));
+    cancelEditorDrag();
+}
+
+/*  Add an event to the current input frame. Events are handled when the frame ends, the same way whether they came from GLFW or
+    from a trace, and live input is ignored while a trace is replayed. */
+void queueInputEvent(InputEventType type, int key, int mods, double x, double y)
+{
+    if(input_mode == INPUT_REPLAY)
+        return;
+
+    if(input_frame.event_count == INPUT_MAX_EVENTS)
+    {
+        fprintf(stderr, "Too many input events in one frame, dropping one\n");
+        return;
+    }
+
+    InputEvent* e = &input_frame.events[input_frame.event_count++];
+    e->type = (unsigned char) type;
+    e->mods = (unsigned char) mods;
+    e->key = (short) key;
+    e->x = (float) x;
+    e->y = (float) y;
+}
+
+void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
+{
+    queueInputEvent(INPUT_EVENT_SCROLL, 0, 0, 0.0, yoffset);
+}
+
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+    if(button != GLFW_MOUSE_BUTTON_LEFT)
+        return;
+
+    double xpos, ypos;
+    glfwGetCursorPos(window, &xpos, &ypos);
+
+    queueInputEvent(action == GLFW_PRESS ? INPUT_EVENT_CLICK : INPUT_EVENT_RELEASE, 0, 0, xpos, ypos);
+}
+
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    if(action != GLFW_PRESS)
+        return;
+
+    queueInputEvent(INPUT_EVENT_KEY, key, mods, 0.0, 0.0);
+}
+
+/* Open the trace file for recording or replaying input. Must be called after GLFW is initialized. */
+int startInput(InputMode mode, const char* path)
+{
+    input_mode = mode;
+    input_clock = glfwGetTime();
+    input_replay_start = input_clock;
+
+    if(mode == INPUT_LIVE)
+        return 1;
+
+    input_trace = fopen(path, mode == INPUT_RECORD ? "wb" : "rb");
+    if(!input_trace)
+    {
+        fprintf(stderr, "Could not open input trace %s\n", path);
+        return 0;
+    }
+
+    unsigned int version = INPUT_TRACE_VERSION;
+    if(mode == INPUT_RECORD)
+    {
+        fwrite(INPUT_TRACE_MAGIC, 1, 4, input_trace);
+        fwrite(&version, sizeof(version), 1, input_trace);
+        return 1;
+    }
+
+    char magic[4];
+    if(fread(magic, 1, 4, input_trace) != 4 || memcmp(magic, INPUT_TRACE_MAGIC, 4) ||
+       fread(&version, sizeof(version), 1, input_trace) != 1 || version != INPUT_TRACE_VERSION)
+    {
+        fprintf(stderr, "%s is not a version %d input trace\n", path, INPUT_TRACE_VERSION);
+        fclose(input_trace);
+        input_trace = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Read the next frame of the trace being replayed. Returns 0 at the end of the trace. */
+int readInputFrame(void)
+{
+    unsigned char event_count;
+    float cursor_x, cursor_y;
+
+    if(fread(&input_frame.dt, sizeof(float), 1, input_trace) != 1)
+        return 0;
+
+    if(fread(&cursor_x, sizeof(float), 1, input_trace) != 1 ||
+       fread(&cursor_y, sizeof(float), 1, input_trace) != 1 ||
+       fread(&input_frame.held, 1, 1, input_trace) != 1 ||
+       fread(&event_count, 1, 1, input_trace) != 1)
+    {
+        fprintf(stderr, "Input trace ends in the middle of a frame\n");
+        return 0;
+    }
+
+    input_frame.cursor_x = cursor_x;
+    input_frame.cursor_y = cursor_y;
+
+    for(input_frame.event_count = 0; input_frame.event_count < event_count; ++input_frame.event_count)
+    {
+        InputEvent* e = &input_frame.events[input_frame.event_count];
+
+        if(fread(&e->type, 1, 1, input_trace) != 1 || fread(&e->mods, 1, 1, input_trace) != 1 ||
+           fread(&e->key, sizeof(short), 1, input_trace) != 1 ||
+           fread(&e->x, sizeof(float), 1, input_trace) != 1 || fread(&e->y, sizeof(float), 1, input_trace) != 1)
+        {
+            fprintf(stderr, "Input trace ends in the middle of a frame\n");
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Append the current frame to the trace being recorded */
+void writeInputFrame(void)
+{
+    float cursor_x = (float) input_frame.cursor_x, cursor_y = (float) input_frame.cursor_y;
+    unsigned char event_count = (unsigned char) input_frame.event_count;
+
+    fwrite(&input_frame.dt, sizeof(float), 1, input_trace);
+    fwrite(&cursor_x, sizeof(float), 1, input_trace);
+    fwrite(&cursor_y, sizeof(float), 1, input_trace);
+    fwrite(&input_frame.held, 1, 1, input_trace);
+    fwrite(&event_count, 1, 1, input_trace);
+
+    for(int i = 0; i < input_frame.event_count; ++i)
+    {
+        const InputEvent* e = &input_frame.events[i];
+
+        fwrite(&e->type, 1, 1, input_trace);
+        fwrite(&e->mods, 1, 1, input_trace);
+        fwrite(&e->key, sizeof(short), 1, input_trace);
+        fwrite(&e->x, sizeof(float), 1, input_trace);
+        fwrite(&e->y, sizeof(float), 1, input_trace);
+    }
+}
+
+/*  Start a new input frame, either by sampling the time, the cursor and the held keys from GLFW or by reading them from the trace.
+    Returns 0 once a replayed trace has run out of frames. */
+int beginInputFrame(GLFWwindow* window)
+{
+    input_frame.event_count = 0;
+
+    if(input_mode == INPUT_REPLAY)
+    {
+        if(!readInputFrame())
+            return 0;
+    }
+    else
+    {
+        double now = glfwGetTime();
+        double xpos, ypos;
+        glfwGetCursorPos(window, &xpos, &ypos);
+
+        input_frame.dt = (float) (now - input_clock);
+        input_frame.cursor_x = (float) xpos;
+        input_frame.cursor_y = (float) ypos;
+        input_frame.held = 0;
+        for(int i = 0; i < (int) (sizeof(input_held_keys) / sizeof(input_held_keys[0])); ++i)
+            if(glfwGetKey(window, input_held_keys[i]) == GLFW_PRESS)
+                input_frame.held |= 1 << i;
+
+        input_clock = now;
+    }
+
+    input_frame.time += input_frame.dt;
+    ++input_frames;
+    return 1;
+}
+
+/*  Finish the current input frame once GLFW's events have been polled: record it, handle its events, and when replaying in a
+    window wait until the frame is due so the trace plays back at the speed it was recorded. */
+void endInputFrame(void)
+{
+    if(input_mode == INPUT_RECORD)
+        writeInputFrame();
+
+    for(int i = 0; i < input_frame.event_count; ++i)
+    {
+        const InputEvent* e = &input_frame.events[i];
+
+        if(e->type == INPUT_EVENT_KEY)
+            handleKey(e->key, e->mods);
+        else if(e->type == INPUT_EVENT_SCROLL)
+            handleScroll(e->y);
+        else if(e->type == INPUT_EVENT_CLICK)
+            handleClick(e->x, e->y);
+        else if(e->type == INPUT_EVENT_RELEASE)
+            handleRelease(e->x, e->y);
+    }
+
+    if(input_mode == INPUT_REPLAY && !input_headless)
+    {
+        double wait;
+        while((wait = input_frame.time - (glfwGetTime() - input_replay_start)) > 0.0)
+            glfwWaitEventsTimeout(wait);
+    }
+}
+
+/* Close the trace, reporting how long a replay took so builds can be compared */
+void finishInput(void)
+{
+    if(input_mode == INPUT_REPLAY)
+    {
+        double elapsed = glfwGetTime() - input_replay_start;
+        printf("Replayed %lld frames in %.3f s, %.3f ms per frame\n", input_frames, elapsed, input_frames ? 1000.0 * elapsed / input_frames : 0.0);
+    }
+
+    if(input_trace)
+        fclose(input_trace);
+    input_trace = NULL;
+}
+
+/* Write one captured frame as a binary PPM, flipping it so the top row comes first */
+int writeCaptureImage(const CaptureSlot* slot)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s%05lld.ppm", capture_prefix, slot->index);
+
+    FILE* file = fopen(path, "wb");
+    if(!file)
+    {
+        fprintf(stderr, "Could not open %s for writing\n", path);
+        return 0;
+    }
+
+    fprintf(file, "P6\n%d %d\n255\n", slot->width, slot->height);
+    for(int y = slot->height - 1; y >= 0; --y)
+        fwrite(slot->pixels + (size_t) y * slot->width * 3, 3, slot->width, file);
+
+    int ok = !ferror(file);
+    if(fclose(file) != 0)
+        ok = 0;
+    if(!ok)
+        fprintf(stderr, "Could not write %s\n", path);
+
+    return ok;
+}
+
+/* A writer thread. Takes pending slots in order and writes them out until capture stops and nothing is left. */
+void* captureWriter(void* unused)
+{
+    pthread_mutex_lock(&capture_lock);
+
+    for(;;)
+    {
+        while(capture_slots[capture_take].state != CAPTURE_SLOT_PENDING && !capture_stopping)
+            pthread_cond_wait(&capture_pending, &capture_lock);
+
+        if(capture_slots[capture_take].state != CAPTURE_SLOT_PENDING)
+            break;
+
+        CaptureSlot* slot = &capture_slots[capture_take];
+        slot->state = CAPTURE_SLOT_WRITING;
+        capture_take = (capture_take + 1) % CAPTURE_QUEUE_SIZE;
+
+        pthread_mutex_unlock(&capture_lock);
+        int ok = writeCaptureImage(slot);
+        pthread_mutex_lock(&capture_lock);
+
+        if(!ok)
+            capture_failed = 1;
+        slot->state = CAPTURE_SLOT_FREE;
+        pthread_cond_broadcast(&capture_freed);
+    }
+
+    pthread_mutex_unlock(&capture_lock);
+    return NULL;
+}
+
+/* Start the writer threads and create the pixel buffers. Must be called with the window's context current. */
+void startCapture(void)
+{
+    glMapBufferPtr = (PFNGLMAPBUFFERPROC) glfwGetProcAddress("glMapBuffer");
+    glUnmapBufferPtr = (PFNGLUNMAPBUFFERPROC) glfwGetProcAddress("glUnmapBuffer");
+    capture_pbos_available = loadBufferFunctions() && glMapBufferPtr && glUnmapBufferPtr;
+
+    if(capture_pbos_available)
+        glGenBuffersPtr(CAPTURE_PBO_COUNT, capture_pbos);
+    else
+        fprintf(stderr, "Pixel buffer objects are not available, reading captured frames synchronously\n");
+
+    for(int i = 0; i < CAPTURE_THREADS; ++i)
+        if(pthread_create(&capture_threads[i], NULL, captureWriter, NULL) != 0)
+        {
+            fprintf(stderr, "Could not start a capture thread\n");
+            exit(-1);
+        }
+}
+
+/*  Wait for the next slot in the queue to be free and make sure it can hold a frame of the given size. The slot is filled by the
+    caller and handed to the writers with queueCaptureSlot. */
+CaptureSlot* claimCaptureSlot(int width, int height)
+{
+    pthread_mutex_lock(&capture_lock);
+
+    CaptureSlot* slot = &capture_slots[capture_fill];
+    if(slot->state != CAPTURE_SLOT_FREE)
+    {
+        ++capture_waits;
+        while(slot->state != CAPTURE_SLOT_FREE)
+            pthread_cond_wait(&capture_freed, &capture_lock);
+    }
+
+    pthread_mutex_unlock(&capture_lock);
+
+    if(!slot->pixels || slot->width != width || slot->height != height)
+    {
+        free(slot->pixels);
+        slot->pixels = malloc((size_t) width * height * 3);
+        if(!slot->pixels)
+        {
+            fprintf(stderr, "Out of memory allocating a captured frame\n");
+            exit(-1);
+        }
+        slot->width = width;
+        slot->height = height;
+    }
+
+    return slot;
+}
+
+/* Hand a filled slot to the writer threads */
+void queueCaptureSlot(CaptureSlot* slot, long long index)
+{
+    pthread_mutex_lock(&capture_lock);
+
+    slot->index = index;
+    slot->state = CAPTURE_SLOT_PENDING;
+    capture_fill = (capture_fill + 1) % CAPTURE_QUEUE_SIZE;
+    pthread_cond_signal(&capture_pending);
+
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/* Copy the frame read into a pixel buffer earlier out to the queue */
+void flushCapturePbo(int pbo, long long index)
+{
+    CaptureSlot* slot = claimCaptureSlot(capture_pbo_width[pbo], capture_pbo_height[pbo]);
+    size_t size = (size_t) slot->width * slot->height * 3;
+
+    glBindBufferPtr(GL_PIXEL_PACK_BUFFER, capture_pbos[pbo]);
+    const unsigned char* pixels = glMapBufferPtr(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if(pixels)
+    {
+        memcpy(slot->pixels, pixels, size);
+        glUnmapBufferPtr(GL_PIXEL_PACK_BUFFER);
+    }
+    else
+        memset(slot->pixels, 0, size);
+    glBindBufferPtr(GL_PIXEL_PACK_BUFFER, 0);
+
+    queueCaptureSlot(slot, index);
+}
+
+/*  Capture the frame in the back buffer if it is one of the frames being kept. With pixel buffer objects the frame is only queued
+    for reading here, and the frame read CAPTURE_PBO_COUNT - 1 captures ago is passed on to the writers. */
+void captureFrame(GLFWwindow* window)
+{
+    if(!capture_prefix || capture_frame++ % capture_interval != 0)
+        return;
+
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    if(!capture_pbos_available)
+    {
+        CaptureSlot* slot = claimCaptureSlot(width, height);
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, slot->pixels);
+        queueCaptureSlot(slot, capture_reads++);
+        return;
+    }
+
+    int pbo = (int) (capture_reads % CAPTURE_PBO_COUNT);
+    if(capture_reads >= CAPTURE_PBO_COUNT)
+        flushCapturePbo(pbo, capture_reads - CAPTURE_PBO_COUNT);
+
+    glBindBufferPtr(GL_PIXEL_PACK_BUFFER, capture_pbos[pbo]);
+    if(capture_pbo_width[pbo] != width || capture_pbo_height[pbo] != height)
+    {
+        glBufferDataPtr(GL_PIXEL_PACK_BUFFER, (GLsizeiptr) width * height * 3, NULL, GL_STREAM_READ);
+        capture_pbo_width[pbo] = width;
+        capture_pbo_height[pbo] = height;
+    }
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    glBindBufferPtr(GL_PIXEL_PACK_BUFFER, 0);
+
+    ++capture_reads;
+}
+
+/* Pass on the frames still in pixel buffers, wait for every file to be written and report what was captured */
+void finishCapture(void)
+{
+    if(!capture_prefix)
+        return;
+
+    if(capture_pbos_available)
+    {
+        long long first = capture_reads > CAPTURE_PBO_COUNT ? capture_reads - CAPTURE_PBO_COUNT : 0;
+        for(long long i = first; i < capture_reads; ++i)
+            flushCapturePbo((int) (i % CAPTURE_PBO_COUNT), i);
+    }
+
+    pthread_mutex_lock(&capture_lock);
+    capture_stopping = 1;
+    pthread_cond_broadcast(&capture_pending);
+    pthread_mutex_unlock(&capture_lock);
+
+    for(int i = 0; i < CAPTURE_THREADS; ++i)
+        pthread_join(capture_threads[i], NULL);
+
+    for(int i = 0; i < CAPTURE_QUEUE_SIZE; ++i)
+        free(capture_slots[i].pixels);
+
+    printf("Captured %lld frames to %s*.ppm, waited for the writers %lld times%s\n", capture_reads, capture_prefix, capture_waits,
+           capture_failed ? " (some frames could not be written)" : "");
+}
+
+/* Write v as a varint: 7 bits per byte, low bits first, with the top bit set on every byte but the last. Returns the bytes written. */
+int putVarint(unsigned char* out, uint32_t v)
+{
+    int length = 0;
+
+    while(v >= 0x80)
+    {
+        out[length++] = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+    out[length++] = (unsigned char) v;
+
+    return length;
+}
+
+/* Map signed values to unsigned ones so that small values of either sign get short varints: 0, -1, 1, -2, ... become 0, 1, 2, 3, ... */
+uint32_t zigzag(int v)
+{
+    return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+/* Open the file or pipe the visibility polygon is streamed to and write the stream's header */
+int startStream(const char* path)
+{
+    stream_file = fopen(path, "wb");
+    if(!stream_file)
+    {
+        fprintf(stderr, "Could not open %s for writing\n", path);
+        return 0;
+    }
+
+    unsigned char header[16];
+    int length = 4;
+    memcpy(header, STREAM_MAGIC, 4);
+    length += putVarint(header + length, STREAM_VERSION);
+    length += putVarint(header + length, STREAM_SCALE);
+
+    fwrite(header, 1, length, stream_file);
+    stream_bytes_written = length;
+    return 1;
+}
+
+/*  Write this frame's visibility polygon to the stream, as changes from the last frame's. The polygon drawRays cast this frame is
+    used if there is one, and otherwise the same rays are cast here. */
+void streamVisibility(void)
+{
+    if(!stream_file)
+        return;
+
+    if(stream_points_frame != input_frames)
+    {
+        static Ray* rays = NULL;
+        static RayHit* hits = NULL;
+        static int capacity = 0;
+
+        double xpos, ypos;
+        inputCursorPos(&xpos, &ypos);
+
+        Point origin = normalizeMonitorCoordinates(xpos, ypos);
+        int count = (int) RAY_DENSITY;
+        double inc = 2.0 * PI / RAY_DENSITY;
+
+        if(capacity < count)
+        {
+            free(rays);
+            free(hits);
+            capacity = count;
+            rays = malloc(capacity * sizeof(Ray));
+            hits = malloc(capacity * sizeof(RayHit));
+            if(!rays || !hits)
+            {
+                fprintf(stderr, "Out of memory allocating rays\n");
+                exit(-1);
+            }
+        }
+
+        for(int i = 0; i < count; ++i)
+            rays[i] = (Ray){origin, {CIRCLE_RADIUS * cos(i * inc), CIRCLE_RADIUS * monitor_widescreen_compensation * sin(i * inc)}};
+        castRayBatch(rays, hits, count);
+
+        Point* polygon = streamPolygonBuffer(origin, count);
+        for(int i = 0; i < count; ++i)
+            polygon[i] = (Point){origin.x + hits[i].t * rays[i].dir.x, origin.y + hits[i].t * rays[i].dir.y};
+    }
+
+    int count = stream_point_count;
+    int origin[2] = {(int) lround(stream_origin.x * STREAM_SCALE), (int) lround(stream_origin.y * STREAM_SCALE)};
+    int key = count != stream_previous_count || stream_frames % STREAM_KEYFRAME_INTERVAL == 0;
+    unsigned char* out = stream_bytes;
+
+    if(key)
+        stream_previous_origin[0] = stream_previous_origin[1] = 0;
+
+    *out++ = (unsigned char) key;
+    out += putVarint(out, (uint32_t) count);
+    out += putVarint(out, zigzag(origin[0] - stream_previous_origin[0]));
+    out += putVarint(out, zigzag(origin[1] - stream_previous_origin[1]));
+
+    if(key)
+    {
+        int last[2] = {origin[0], origin[1]};
+
+        for(int i = 0; i < count; ++i)
+        {
+            int q[2] = {(int) lround(stream_points[i].x * STREAM_SCALE), (int) lround(stream_points[i].y * STREAM_SCALE)};
+
+            out += putVarint(out, zigzag(q[0] - last[0]));
+            out += putVarint(out, zigzag(q[1] - last[1]));
+            stream_previous[2 * i] = last[0] = q[0];
+            stream_previous[2 * i + 1] = last[1] = q[1];
+        }
+    }
+    else
+    {
+        int i = 0;
+
+        while(i < count)
+        {
+            int q[2];
+            int unchanged = 0, changed = 0;
+
+            while(i + unchanged < count &&
+                  (int) lround(stream_points[i + unchanged].x * STREAM_SCALE) == stream_previous[2 * (i + unchanged)] &&
+                  (int) lround(stream_points[i + unchanged].y * STREAM_SCALE) == stream_previous[2 * (i + unchanged) + 1])
+                ++unchanged;
+
+            out += putVarint(out, (uint32_t) unchanged);
+            i += unchanged;
+            if(i == count)
+                break;
+
+            /* The run of changed points ends at the next point that did not move */
+            unsigned char* changed_count = out;
+            out += 5;
+            for(; i < count; ++i, ++changed)
+            {
+                q[0] = (int) lround(stream_points[i].x * STREAM_SCALE);
+                q[1] = (int) lround(stream_points[i].y * STREAM_SCALE);
+                if(q[0] == stream_previous[2 * i] && q[1] == stream_previous[2 * i + 1])
+                    break;
+
+                out += putVarint(out, zigzag(q[0] - stream_previous[2 * i]));
+                out += putVarint(out, zigzag(q[1] - stream_previous[2 * i + 1]));
+                stream_previous[2 * i] = q[0];
+                stream_previous[2 * i + 1] = q[1];
+            }
+
+            /* Now that the run's length is known, write it and move the run's points back against it */
+            int length = putVarint(changed_count, (uint32_t) changed);
+            memmove(changed_count + length, changed_count + 5, out - (changed_count + 5));
+            out -= 5 - length;
+        }
+    }
+
+    stream_previous_count = count;
+    stream_previous_origin[0] = origin[0];
+    stream_previous_origin[1] = origin[1];
+
+    fwrite(stream_bytes, 1, out - stream_bytes, stream_file);
+    fflush(stream_file);
+
+    ++stream_frames;
+    stream_bytes_written += out - stream_bytes;
+    stream_raw_bytes += (long long) count * 2 * sizeof(double);
+}
+
+/* Close the stream and report how much it was compressed */
+void finishStream(void)
+{
+    if(!stream_file)
+        return;
+
+    fclose(stream_file);
+    stream_file = NULL;
+
+    printf("Streamed %lld frames in %lld bytes, %.1f%% of the size of the raw polygons\n", stream_frames, stream_bytes_written,
+           stream_raw_bytes ? 100.0 * stream_bytes_written / stream_raw_bytes : 0.0);
+}
+
+void initializeWindow(GLFWwindow** window)
+{
+    /* Set the window to be non-resizable by the user */
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+
+    /* A headless replay renders into a hidden window */
+    if(input_headless)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+    /* Create a windowed mode window and its OpenGL context */
+    *window = glfwCreateWindow(1920, 1080, "Raycaster", NULL, NULL);
+    if (!(*window))
+    {
+        glfwTerminate();
+        exit(-1);
+    }
+
+    /* Make the window's context current */
+    glfwMakeContextCurrent(*window);
+
+    /* Don't wait for the display when replaying as fast as possible */
+    if(input_headless)
+        glfwSwapInterval(0);
+
+    /* Turn on scrolling input */
+    glfwSetScrollCallback(*window, scroll_callback);
+
+    /* Turn on mouse button and keyboard input */
+    glfwSetMouseButtonCallback(*window, mouse_button_callback);
+    glfwSetKeyCallback(*window, key_callback);
+}
+
+/* Load the built-in walls */
+void loadDefaultScene(void)
+{
+    for(int i = 0; i < (sizeof(default_walls) / sizeof(default_walls[0])); ++i)
+        addWall(default_walls[i], default_materials[i], 1.0f);
+}
+
+/*  Usage:
+        raycaster                       run with the built-in walls
+        raycaster scene.txt             run with the walls and lights of a scene file
+        raycaster --watch scene.txt     run, reloading the scene's walls whenever the file is saved
+        raycaster --record trace.bin [scene.txt]
+                                        run, recording the input to a trace file
+        raycaster --replay trace.bin [--headless] [scene.txt]
+                                        run with the input from a trace file, in a hidden window as fast as possible with --headless
+        raycaster --capture frames/frame [--capture-every n] [scene.txt]
+                                        write every frame, or every nth, to frames/frame00000.ppm, frames/frame00001.ppm, ...
+                                        Can be combined with --record or --replay.
+        raycaster --stream visibility.bin [scene.txt]
+                                        stream the cursor's visibility polygon to a file or pipe every frame
+        raycaster --bake scene.txt      bake the scene's static lights into its lightmap and save it back to the file
+        raycaster --acoustics scene.txt sx sy lx ly order out.raw
+                                        write the impulse response from a source to a listener up to the given reflection order
+        raycaster --coverage scene.txt width height heatmap.ppm coverage.raw
+                                        write the area visible from every cell of a grid over the window
+        raycaster --guards scene.txt count width height
+                                        pick up to count guard positions on a grid over the window that together see the most of it
+        raycaster --serve scene.txt socket
+                                        answer ray queries from other processes on a Unix domain socket (Linux only)
+        raycaster --shm scene.txt /name [workers]
+                                        answer ray queries from other processes through shared memory (Linux only)
+        raycaster --shm-bench /name rays round_trips
+                                        time round trips of random rays through a running shared memory server
+        raycaster --batch hits|polygons scene.txt queries.bin|queries.csv results.bin
+                                        cast the nearest hit or visibility polygon of every query in a file
+    Tools that take a scene file use the built-in walls when it is given as "-". */
+int main(int argc, char** argv)
+{
+    GLFWwindow* window;
+
+    if(argc == 3 && !strcmp(argv[1], "--bake"))
+    {
+        if(!loadScene(argv[2]))
+            return -1;
+
+        bakeLightmap(LIGHTMAP_WIDTH, LIGHTMAP_HEIGHT);
+        return saveScene(argv[2]) ? 0 : -1;
+    }
+
+    if(argc == 9 && !strcmp(argv[1], "--acoustics"))
+    {
+        if(!strcmp(argv[2], "-"))
+            loadDefaultScene();
+        else if(!loadScene(argv[2]))
+            return -1;
+
+        Point source = {atof(argv[3]), atof(argv[4])};
+        Point listener = {atof(argv[5]), atof(argv[6])};
+
+        return computeImpulseResponse(source, listener, atoi(argv[7]), argv[8]) ? 0 : -1;
+    }
+
+    if(argc == 7 && !strcmp(argv[1], "--coverage"))
+    {
+        int width = atoi(argv[3]), height = atoi(argv[4]);
+
+        if(width <= 0 || height <= 0)
+        {
+            fprintf(stderr, "Coverage grid size must be positive\n");
+            return -1;
+        }
+
+        if(!strcmp(argv[2], "-"))
+            loadDefaultScene();
+        else if(!loadScene(argv[2]))
+            return -1;
+
+        return computeCoverage(width, height, argv[5], argv[6]) ? 0 : -1;
+    }
+
+    if(argc == 6 && !strcmp(argv[1], "--guards"))
+    {
+        int count = atoi(argv[3]), width = atoi(argv[4]), height = atoi(argv[5]);
+
+        if(count <= 0 || width <= 0 || height <= 0)
+        {
+            fprintf(stderr, "Guard count and grid size must be positive\n");
+            return -1;
+        }
+
+        if(!strcmp(argv[2], "-"))
+            loadDefaultScene();
+        else if(!loadScene(argv[2]))
+            return -1;
+
+        return placeGuards(count, width, height) ? 0 : -1;
+    }
+
+    if(argc == 4 && !strcmp(argv[1], "--serve"))
+    {
+        if(!strcmp(argv[2], "-"))
+            loadDefaultScene();
+        else if(!loadScene(argv[2]))
+            return -1;
+
+        return runServer(argv[3]) ? 0 : -1;
+    }
+
+    if((argc == 4 || argc == 5) && !strcmp(argv[1], "--shm"))
+    {
+        int workers = argc == 5 ? atoi(argv[4]) : 2;
+
+        if(workers <= 0)
+        {
+            fprintf(stderr, "The number of workers must be positive\n");
+            return -1;
+        }
+
+        if(!strcmp(argv[2], "-"))
+            loadDefaultScene();
+        else if(!loadScene(argv[2]))
+            return -1;
+
+        return runShmServer(argv[3], workers) ? 0 : -1;
+    }
+
+    if(argc == 5 && !strcmp(argv[1], "--shm-bench"))
+        return benchmarkShm(argv[2], atoi(argv[3]), atoi(argv[4])) ? 0 : -1;
+
+    if(argc == 6 && !strcmp(argv[1], "--batch"))
+    {
+        if(strcmp(argv[2], "hits") && strcmp(argv[2], "polygons"))
+        {
+            fprintf(stderr, "The batch query type must be hits or polygons\n");
+            return -1;
+        }
+
+        if(!strcmp(argv[3], "-"))
+            loadDefaultScene();
+        else if(!loadScene(argv[3]))
+            return -1;
+
+        return runBatch(!strcmp(argv[2], "polygons"), argv[4], argv[5]) ? 0 : -1;
+    }
+
+    InputMode input = INPUT_LIVE;
+    const char* trace_path = NULL;
+    const char* scene_path = NULL;
+    const char* stream_path = NULL;
+    int watch = 0;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        if((!strcmp(argv[i], "--record") || !strcmp(argv[i], "--replay")) && i + 1 < argc)
+        {
+            input = !strcmp(argv[i], "--record") ? INPUT_RECORD : INPUT_REPLAY;
+            trace_path = argv[++i];
+        }
+        else if(!strcmp(argv[i], "--headless"))
+            input_headless = 1;
+        else if(!strcmp(argv[i], "--capture") && i + 1 < argc)
+            capture_prefix = argv[++i];
+        else if(!strcmp(argv[i], "--capture-every") && i + 1 < argc)
+            capture_interval = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--stream") && i + 1 < argc)
+            stream_path = argv[++i];
+        else if(!strcmp(argv[i], "--watch"))
+            watch = 1;
+        else
+            scene_path = argv[i];
+    }
+
+    if(input_headless && input != INPUT_REPLAY)
+    {
+        fprintf(stderr, "--headless only works with --replay\n");
+        return -1;
+    }
+
+    if(capture_interval <= 0)
+    {
+        fprintf(stderr, "--capture-every must be positive\n");
+        return -1;
+    }
+
+    if(watch && !scene_path)
+    {
+        fprintf(stderr, "--watch needs a scene file\n");
+        return -1;
+    }
+
+    /* Initialize the library */
+    if (!glfwInit())
+        return -1;
+
+    initializeWindow(&window);
+
+    if(scene_path)
+    {
+        if(!loadScene(scene_path))
+        {
+            glfwTerminate();
+            return -1;
+        }
+
+        /* Without a baked lightmap the static lights can only be cast live */
+        if(!lightmap.texels && static_light_count)
+        {
+            fprintf(stderr, "%s has no baked lightmap, casting its static lights live (run with --bake to bake them)\n", scene_path);
+            for(int i = 0; i < static_light_count; ++i)
+                addLight(static_lights[i].position, static_lights[i].velocity, static_lights[i].r, static_lights[i].g, static_lights[i].b, static_lights[i].radius);
+        }
+    }
+    else
+        loadDefaultScene();
+
+    if(!startInput(input, trace_path) || (stream_path && !startStream(stream_path)))
+    {
+        glfwTerminate();
+        return -1;
+    }
+
+    if(capture_prefix)
+        startCapture();
+
+    if(watch)
+        startSceneWatch(scene_path);
+
+    double last_time = 0.0;
+    double last_title_time = last_time;
+
+    /* Loop until the user closes the window or the replayed input runs out */
+    while (!glfwWindowShouldClose(window) && beginInputFrame(window))
+    {
+        pollSceneWatch();
+        updateEditor();
+
+        double now = input_frame.time;
+        updateLights(now - last_time);
+        updatePlayer(window, now - last_time);
+        updateAgents(now - last_time);
+
+        if(render_mode == MODE_PARTICLES)
+            updateParticles(now - last_time);
+        else if(render_mode == MODE_FOG)
+            updateFog();
+        last_time = now;
+
+        /* Refresh the title a few times a second rather than every frame */
+        if(now - last_title_time > 0.25)
+        {
+            updateWindowTitle(window);
+            last_title_time = now;
+        }
+
+        /* Render here */
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        if(render_mode == MODE_SOFT_SHADOWS)
+        {
+            double xpos, ypos;
+            inputCursorPos(&xpos, &ypos);
+
+            renderSoftShadows(normalizeMonitorCoordinates(xpos, ypos));
+            presentFramebuffer(&framebuffer, 1.0f);
+        }
+        else if(render_mode == MODE_PATH_TRACING)
+        {
+            double xpos, ypos;
+            inputCursorPos(&xpos, &ypos);
+
+            renderPathTracing(normalizeMonitorCoordinates(xpos, ypos));
+            presentFramebuffer(&framebuffer, 1.0f / path_samples);
+        }
+        else if(render_mode == MODE_CASCADES)
+        {
+            double xpos, ypos;
+            inputCursorPos(&xpos, &ypos);
+
+            renderRadianceCascades(normalizeMonitorCoordinates(xpos, ypos));
+            presentFramebuffer(&framebuffer, 1.0f);
+        }
+        else if(render_mode == MODE_PARTICLES)
+            drawParticles();
+        else if(render_mode == MODE_BEAMS)
+        {
+            double xpos, ypos;
+            inputCursorPos(&xpos, &ypos);
+
+            traceBeams(normalizeMonitorCoordinates(xpos, ypos));
+            drawBeams();
+        }
+        else if(render_mode == MODE_FIRST_PERSON)
+        {
+            renderFirstPerson();
+            presentFramebuffer(&framebuffer, 1.0f);
+        }
+
+        /* The first person view replaces the scene seen from above */
+        if(render_mode != MODE_FIRST_PERSON)
+        {
+            drawLightmap();
+
+            /* Radiance cascades already include every light */
+            if(render_mode != MODE_CASCADES)
+                drawLights();
+
+            if(render_mode == MODE_RAYS)
+                drawRays(&window);
+
+            // Draw walls
+            for(int i = 0; i < wall_count; ++i)
+            {
+                drawWall(&walls[i], wall_materials[i]);
+            }
+            drawEditor();
+
+            drawBodies();
+        }
+
+        if(render_mode == MODE_FOG)
+            drawFog();
+
+        streamVisibility();
+        captureFrame(window);
+
         /* Swap front and back buffers */
         glfwSwapBuffers(window);
 
         /* Poll for and process events */
         glfwPollEvents();
+        endInputFrame();
     }
 
+    finishInput();
+    finishCapture();
+    finishStream();
     glfwTerminate();
     return 0;
 }
\ No newline at end of file